@@ -22,6 +22,15 @@
 #include <errno.h>
 #include <unistd.h>
 #include <math.h>
+#include <stddef.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <zlib.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 #include "activity_stats.h"
 
 #define HALF_LIFE 24*60*60*3.0L
@@ -45,7 +54,7 @@ new_activity_stats_s(size_t blocks) {
 
 	struct activity_stats *ret;
 
-	ret = malloc(sizeof(struct activity_stats));
+	ret = calloc(sizeof(struct activity_stats), 1);
 
 	ret->block = calloc(sizeof(struct block_activity), blocks + 1);
 	ret->len = blocks + 1;
@@ -55,6 +64,27 @@ new_activity_stats_s(size_t blocks) {
 	return ret;
 }
 
+static void
+free_coaccess(struct coaccess *ca)
+{
+	if (!ca)
+		return;
+
+	free(ca->pairs);
+	free(ca);
+}
+
+static void
+free_hot_index(struct hot_index *hi)
+{
+	if (!hi)
+		return;
+
+	free(hi->heap);
+	free(hi->pos);
+	free(hi);
+}
+
 void
 destroy_activity_stats(struct activity_stats *activity) {
 
@@ -64,6 +94,17 @@ destroy_activity_stats(struct activity_stats *activity) {
 	if (activity->block)
 		free(activity->block);
 
+	free(activity->discard);
+	free(activity->bytes);
+	free(activity->profile);
+	free(activity->trend);
+	free(activity->group);
+	free_coaccess(activity->coaccess);
+	free_hot_index(activity->hot);
+	free(activity->summary);
+	free(activity->touched);
+	free(activity->dirty);
+
 	pthread_mutex_destroy(&activity->mutex);
 	free(activity);
 }
@@ -105,458 +146,5261 @@ add_block_activity_write(struct block_activity *block, int64_t time,
     }
 }
 
-int
-add_block(struct activity_stats *activity, int64_t off, int64_t time,
-		double mean_lifetime, double hit_score, int type) {
+// add transferred bytes to decayed byte counter of block, last_time is time
+// of previous access (the counter decays in step with the score)
+static void
+add_bytes_activity(float *bytes, uint64_t last_time, int64_t time,
+    double mean_lifetime, double io_bytes) {
+
+    uint64_t time_diff = time - last_time;
+    if (time_diff <= 0)
+      *bytes += io_bytes;
+    else
+      *bytes = score_decay(*bytes, time_diff, mean_lifetime) + io_bytes;
+}
+
+/*
+ * Optional per-block data, kept in arrays parallel to activity->block
+ */
+struct stats_section {
+	uint64_t id; /**< identifier of section in stats file */
+	size_t elem_size; /**< size of data kept for single block */
+	size_t offset; /**< offset of array pointer in struct activity_stats */
+};
+
+#define SECTION_DISCARD 0x7364726163736964ULL
+#define SECTION_BYTES 0x7365747962736f69ULL
+#define SECTION_PROFILE 0x656c69666f727064ULL
+#define SECTION_TREND 0x73646e6572747464ULL
+#define SECTION_GROUP 0x7370756f72676364ULL
+
+static const struct stats_section stats_sections[] = {
+	{ SECTION_DISCARD, sizeof(uint32_t), offsetof(struct activity_stats, discard) },
+	{ SECTION_BYTES, sizeof(struct block_bytes), offsetof(struct activity_stats, bytes) },
+	{ SECTION_PROFILE, sizeof(struct block_profile), offsetof(struct activity_stats, profile) },
+	{ SECTION_TREND, sizeof(struct block_trend), offsetof(struct activity_stats, trend) },
+	{ SECTION_GROUP, sizeof(uint32_t), offsetof(struct activity_stats, group) },
+};
+
+#define STATS_SECTIONS_NUM (sizeof(stats_sections)/sizeof(stats_sections[0]))
+
+// return reference to array pointer described by section
+static void **
+section_array(struct activity_stats *activity, const struct stats_section *sec)
+{
+	return (void **)((char *)activity + sec->offset);
+}
+
+// resize array, zeroing newly added elements
+static int
+realloc_zeroed(void **array, size_t elem_size, size_t old_len, size_t new_len)
+{
+	void *tmp;
+
+	tmp = realloc(*array, elem_size * new_len);
+	if (!tmp)
+		return ENOMEM;
+	*array = tmp;
+
+	if (new_len > old_len)
+		memset((char *)tmp + elem_size * old_len, 0,
+			elem_size * (new_len - old_len));
+
+	return 0;
+}
+
+// number of chunk summaries of `len` blocks
+#define SUMMARY_CHUNKS(len) (((len) + CHUNK_BLOCKS - 1) / CHUNK_BLOCKS)
+
+// dynamically extend activity->block and all present per-block arrays so
+// that block `off` fits in them, must be called with activity->mutex held
+static int
+extend_activity_stats(struct activity_stats *activity, int64_t off)
+{
+	if (activity->block && activity->len > off)
+		return 0;
+
+	if (!activity->block)
+		activity->len = 0;
+
+	for (size_t i=0; i < STATS_SECTIONS_NUM; i++) {
+		void **array = section_array(activity, &stats_sections[i]);
+		if (!*array)
+			continue;
+		if (realloc_zeroed(array, stats_sections[i].elem_size,
+				activity->len, off + 1))
+			return ENOMEM;
+	}
+
+	if (activity->summary && realloc_zeroed((void **)&activity->summary,
+			sizeof(struct block_activity),
+			SUMMARY_CHUNKS(activity->len), SUMMARY_CHUNKS(off + 1)))
+		return ENOMEM;
+
+	if (realloc_zeroed((void **)&activity->block,
+			sizeof(struct block_activity), activity->len, off + 1))
+		return ENOMEM;
+
+	activity->len = off + 1;
+
+	return 0;
+}
+
+// note that block changed since statistics were last saved, must be called
+// with activity->mutex held
+static int
+mark_block_dirty(struct activity_stats *activity, int64_t off)
+{
+	size_t words = (activity->len + 63) / 64;
+
+	if (activity->dirty_words < words) {
+		if (realloc_zeroed((void **)&activity->dirty, sizeof(uint64_t),
+				activity->dirty_words, words))
+			return ENOMEM;
+		activity->dirty_words = words;
+	}
+
+	activity->dirty[off / 64] |= 1ULL << (off % 64);
+
+	return 0;
+}
+
+// statistics were saved, must be called with activity->mutex held
+static void
+clear_dirty_blocks(struct activity_stats *activity)
+{
+	if (activity->dirty)
+		memset(activity->dirty, 0, sizeof(uint64_t) * activity->dirty_words);
+}
+
+// find first run of set bits in bitmap of `words` words, not before `off`
+// and not after `end`, returns its start (`end` if there's none)
+static int64_t
+next_set_bits(const uint64_t *bits, size_t words, int64_t off, int64_t end,
+    int64_t *run_end)
+{
+	int64_t limit = (int64_t)words * 64 < end ? (int64_t)words * 64 : end;
+	int64_t stop;
+
+	while (off < limit) {
+		uint64_t word = bits[off / 64] >> (off % 64);
+		if (word) {
+			off += __builtin_ctzll(word);
+			break;
+		}
+		off = (off / 64 + 1) * 64;
+	}
+	if (off >= limit) {
+		*run_end = end;
+		return end;
+	}
+
+	for (stop=off; stop < limit;) {
+		uint64_t word = ~bits[stop / 64] >> (stop % 64);
+		if (word) {
+			stop += __builtin_ctzll(word);
+			break;
+		}
+		stop = (stop / 64 + 1) * 64;
+	}
+	*run_end = stop < limit ? stop : limit;
+
+	return off;
+}
+
+int64_t
+next_touched_blocks(struct activity_stats *activity, int64_t off,
+    int64_t *run_end)
+{
+	int64_t len = activity->block ? activity->len : 0;
+
+	if (!activity->touched) {
+		*run_end = len;
+		return off < len ? off : len;
+	}
 
+	return next_set_bits(activity->touched, activity->touched_words, off,
+		len, run_end);
+}
+
+// note that block was accessed, if accessed blocks are tracked, must be
+// called with activity->mutex held
+static int
+mark_block_touched(struct activity_stats *activity, int64_t off)
+{
+	size_t words = (activity->len + 63) / 64;
+
+	if (!activity->touched)
+		return 0;
+
+	if (activity->touched_words < words) {
+		if (realloc_zeroed((void **)&activity->touched, sizeof(uint64_t),
+				activity->touched_words, words))
+			return ENOMEM;
+		activity->touched_words = words;
+	}
+
+	activity->touched[off / 64] |= 1ULL << (off % 64);
+
+	return 0;
+}
+
+int
+index_touched_blocks(struct activity_stats *activity)
+{
+	static const struct block_activity zero;
+	uint64_t *tmp;
+	size_t words;
 	int ret = 0;
+
+	pthread_mutex_lock(&activity->mutex);
+
+	words = activity->block ? (activity->len + 63) / 64 : 0;
+	tmp = realloc(activity->touched, sizeof(uint64_t) * (words ? words : 1));
+	if (!tmp) {
+		ret = ENOMEM;
+		goto mutex_cleanup;
+	}
+	activity->touched = tmp;
+	activity->touched_words = words;
+	memset(tmp, 0, sizeof(uint64_t) * words);
+
+	for (int64_t i=0; words && i < activity->len; i++)
+		if (memcmp(&activity->block[i], &zero, sizeof(zero)))
+			tmp[i / 64] |= 1ULL << (i % 64);
+
+mutex_cleanup:
+	pthread_mutex_unlock(&activity->mutex);
+
+	return ret;
+}
+
+// include block in summary of its chunk
+static void
+summarize_block(struct block_activity *summary,
+    const struct block_activity *ba)
+{
+	if (ba->read_score > summary->read_score)
+		summary->read_score = ba->read_score;
+	if (ba->write_score > summary->write_score)
+		summary->write_score = ba->write_score;
+	if (ba->read_time > summary->read_time)
+		summary->read_time = ba->read_time;
+	if (ba->write_time > summary->write_time)
+		summary->write_time = ba->write_time;
+}
+
+// fill summaries of all chunks of `len` blocks, looking only at blocks set
+// in `touched` bitmap of `words` words (at all of them if it's NULL)
+static void
+summarize_blocks(struct block_activity *summary,
+    const struct block_activity *block, int64_t len, const uint64_t *touched,
+    size_t words)
+{
+	int64_t run_end = len;
+
+	memset(summary, 0, sizeof(struct block_activity) * SUMMARY_CHUNKS(len));
+
+	for (int64_t off=0; off < len; off = run_end) {
+		if (touched)
+			off = next_set_bits(touched, words, off, len, &run_end);
+		for (int64_t i=off; i < run_end; i++)
+			summarize_block(&summary[i / CHUNK_BLOCKS], &block[i]);
+	}
+}
+
+int
+summarize_activity_stats(struct activity_stats *activity)
+{
 	struct block_activity *tmp;
+	int64_t len;
+	int ret = 0;
 
 	pthread_mutex_lock(&activity->mutex);
 
-	// dynamically extend activity->block as new blocks are added
-	if (!activity->block) {
+	len = activity->block ? activity->len : 0;
+	tmp = realloc(activity->summary, sizeof(struct block_activity)
+		* (len ? SUMMARY_CHUNKS(len) : 1));
+	if (!tmp) {
+		ret = ENOMEM;
+		goto mutex_cleanup;
+	}
+	activity->summary = tmp;
+
+	summarize_blocks(activity->summary, activity->block, len,
+		activity->touched, activity->touched_words);
+
+mutex_cleanup:
+	pthread_mutex_unlock(&activity->mutex);
+
+	return ret;
+}
+
+void
+get_profile_time(time_t time, struct profile_time *pt)
+{
+	struct tm tm;
+
+	localtime_r(&time, &tm);
+
+	pt->day = (time + tm.tm_gmtoff) / (24*60*60);
+	pt->hour = tm.tm_hour;
+	pt->wday = tm.tm_wday;
+}
+
+// decay profile of block to provided day
+static void
+decay_block_profile(struct block_profile *bp, int64_t day)
+{
+	if (day <= bp->day)
+		return;
+
+	double decay = exp(-1.0 * (day - bp->day) / PROFILE_MEAN_LIFETIME);
+
+	for (int i=0; i < 24; i++)
+		bp->hour[i] *= decay;
+	for (int i=0; i < 7; i++)
+		bp->weekday[i] *= decay;
+
+	bp->day = day;
+}
+
+// add hit to activity profile of block, must be called with mutex held
+static void
+add_block_profile(struct activity_stats *activity, int64_t off, int64_t time,
+		double hit_score)
+{
+	struct block_profile *bp = &activity->profile[off];
+
+	if (time != activity->profile_time) {
+		get_profile_time(time, &activity->profile_tm);
+		activity->profile_time = time;
+	}
+
+	decay_block_profile(bp, activity->profile_tm.day);
+
+	bp->hour[activity->profile_tm.hour] += hit_score;
+	bp->weekday[activity->profile_tm.wday] += hit_score;
+}
+
+int
+enable_activity_profile(struct activity_stats *activity)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&activity->mutex);
+
+	// allocate at least one element so that the array is extended
+	// together with block table
+	if (!activity->profile) {
+		activity->profile = calloc(sizeof(struct block_profile),
+				activity->len ? activity->len : 1);
+		if (!activity->profile)
+			ret = ENOMEM;
+	}
+
+	pthread_mutex_unlock(&activity->mutex);
+
+	return ret;
+}
+
+float
+get_block_profile_score(struct activity_stats *activity, off_t off,
+		struct profile_time *pt)
+{
+	if (!activity->profile)
+		return 0;
+
+	struct block_profile *bp = &activity->profile[off];
+	double week = 0;
+
+	for (int i=0; i < 7; i++)
+		week += bp->weekday[i];
+
+	if (week <= 0)
+		return 0;
+
+	// activity in the hour, scaled by how busy the day of week is in
+	// comparison to average day
+	double score = bp->hour[pt->hour] * bp->weekday[pt->wday] * 7 / week;
+
+	if (pt->day > bp->day)
+		score *= exp(-1.0 * (pt->day - bp->day) / PROFILE_MEAN_LIFETIME);
+
+	// buckets collect about PROFILE_MEAN_LIFETIME days of data
+	return score / PROFILE_MEAN_LIFETIME;
+}
+
+/** after this many intervals without activity the level is reset to zero */
+#define TREND_MAX_IDLE 64
+
+// single step of Holt smoothing with `count` observed in interval
+static void
+smooth_block_trend(struct block_trend *bt, double count, double alpha,
+		double beta)
+{
+	double level = alpha * count + (1 - alpha) * (bt->level + bt->trend);
+
+	if (level < 0)
+		level = 0;
+
+	bt->trend = beta * (level - bt->level) + (1 - beta) * bt->trend;
+	bt->level = level;
+}
+
+// close intervals that passed before `interval`, including idle ones
+static void
+advance_block_trend(struct block_trend *bt, uint32_t interval, double alpha,
+		double beta)
+{
+	if (interval <= bt->interval)
+		return;
+
+	uint32_t passed = interval - bt->interval;
+
+	if (passed > TREND_MAX_IDLE) {
+		bt->level = 0;
+		bt->trend = 0;
+	} else {
+		smooth_block_trend(bt, bt->count, alpha, beta);
+		for (uint32_t i=1; i < passed; i++)
+			smooth_block_trend(bt, 0, alpha, beta);
+	}
+
+	bt->count = 0;
+	bt->interval = interval;
+}
+
+int
+enable_activity_trend(struct activity_stats *activity, int64_t interval,
+		double alpha, double beta)
+{
+	int ret = 0;
+
+	assert(interval > 0);
+
+	pthread_mutex_lock(&activity->mutex);
+
+	activity->trend_interval = interval;
+	activity->trend_alpha = alpha;
+	activity->trend_beta = beta;
+
+	// allocate at least one element so that the array is extended
+	// together with block table
+	if (!activity->trend) {
+		activity->trend = calloc(sizeof(struct block_trend),
+				activity->len ? activity->len : 1);
+		if (!activity->trend)
+			ret = ENOMEM;
+	}
+
+	pthread_mutex_unlock(&activity->mutex);
+
+	return ret;
+}
+
+void
+get_block_trend(struct activity_stats *activity, off_t off, time_t time,
+		float *level, float *trend)
+{
+	if (!activity->trend || !activity->trend_interval) {
+		*level = 0;
+		*trend = 0;
+		return;
+	}
+
+	struct block_trend bt = activity->trend[off];
+
+	advance_block_trend(&bt, time / activity->trend_interval,
+		activity->trend_alpha, activity->trend_beta);
+
+	*level = bt.level;
+	*trend = bt.trend;
+}
+
+/** number of slots in co-access pair hash table */
+#define COACCESS_PAIRS 8192
+/** age counters after this many windows */
+#define COACCESS_AGE_WINDOWS 360
+/** largest group of blocks that is migrated together */
+#define COACCESS_MAX_GROUP 256
+
+int
+enable_coaccess_groups(struct activity_stats *activity, int64_t window,
+		float threshold)
+{
+	int ret = 0;
+
+	assert(window > 0);
+	assert(threshold > 0);
+
+	pthread_mutex_lock(&activity->mutex);
 
-		activity->block = calloc(sizeof(struct block_activity), off + 1);
-		if (!activity->block) {
+	if (!activity->coaccess) {
+		activity->coaccess = calloc(sizeof(struct coaccess), 1);
+		if (!activity->coaccess) {
 			ret = ENOMEM;
 			goto mutex_cleanup;
 		}
+		activity->coaccess->pairs = calloc(sizeof(struct coaccess_pair),
+				COACCESS_PAIRS);
+		if (!activity->coaccess->pairs) {
+			free(activity->coaccess);
+			activity->coaccess = NULL;
+			ret = ENOMEM;
+			goto mutex_cleanup;
+		}
+	}
+
+	activity->coaccess->window = window;
+	activity->coaccess->threshold = threshold;
+
+mutex_cleanup:
+	pthread_mutex_unlock(&activity->mutex);
+
+	return ret;
+}
+
+// return slot for pair (a, b) in hash table, either the one already used by
+// it or first free one
+static struct coaccess_pair *
+find_coaccess_pair(struct coaccess_pair *pairs, uint32_t a, uint32_t b)
+{
+	size_t i = ((uint64_t)a * 0x9e3779b1U ^ b * 0x85ebca6bU) % COACCESS_PAIRS;
+
+	while (pairs[i].a != pairs[i].b
+	       && (pairs[i].a != a || pairs[i].b != b))
+		i = (i + 1) % COACCESS_PAIRS;
+
+	return &pairs[i];
+}
+
+// halve all counters, forgetting pairs that weren't seen together recently
+static void
+age_coaccess_pairs(struct coaccess *ca)
+{
+	struct coaccess_pair *old = ca->pairs;
+	struct coaccess_pair *slot;
+
+	ca->pairs = calloc(sizeof(struct coaccess_pair), COACCESS_PAIRS);
+	if (!ca->pairs) {
+		// can't rehash, just forget everything
+		ca->pairs = old;
+		memset(ca->pairs, 0, sizeof(struct coaccess_pair) * COACCESS_PAIRS);
+		ca->pairs_used = 0;
+		return;
+	}
+
+	ca->pairs_used = 0;
+	for (size_t i=0; i < COACCESS_PAIRS; i++) {
+		if (old[i].a == old[i].b || old[i].count < 2)
+			continue;
+		slot = find_coaccess_pair(ca->pairs, old[i].a, old[i].b);
+		*slot = old[i];
+		slot->count /= 2;
+		ca->pairs_used++;
+	}
+
+	free(old);
+	ca->windows = 0;
+}
+
+static int
+uint32_compare(const void *v1, const void *v2)
+{
+	uint32_t a = *(const uint32_t *)v1;
+	uint32_t b = *(const uint32_t *)v2;
+
+	return (a > b) - (a < b);
+}
+
+// count co-occurrences of all pairs of blocks accessed in the window
+static void
+close_coaccess_window(struct coaccess *ca)
+{
+	struct coaccess_pair *slot;
+
+	qsort(ca->window_blocks, ca->window_len, sizeof(uint32_t),
+		uint32_compare);
+
+	for (size_t i=0; i < ca->window_len; i++)
+		for (size_t j=i+1; j < ca->window_len; j++) {
+			// keep the table at most half full, so that it stays fast
+			while (ca->pairs_used >= COACCESS_PAIRS / 2)
+				age_coaccess_pairs(ca);
+
+			slot = find_coaccess_pair(ca->pairs, ca->window_blocks[i],
+					ca->window_blocks[j]);
+			if (slot->a == slot->b) {
+				slot->a = ca->window_blocks[i];
+				slot->b = ca->window_blocks[j];
+				slot->count = 0;
+				ca->pairs_used++;
+			}
+			slot->count += 1;
+		}
+
+	ca->window_len = 0;
+
+	if (++ca->windows >= COACCESS_AGE_WINDOWS)
+		age_coaccess_pairs(ca);
+}
+
+// record access to block in co-access sketch, must be called with mutex held
+static void
+add_block_coaccess(struct coaccess *ca, int64_t off, int64_t time)
+{
+	if (time >= ca->window_start + ca->window) {
+		close_coaccess_window(ca);
+		ca->window_start = time - time % ca->window;
+	}
+
+	for (size_t i=0; i < ca->window_len; i++)
+		if (ca->window_blocks[i] == off)
+			return;
+
+	// very busy windows say little about which blocks are related
+	if (ca->window_len >= COACCESS_WINDOW_MAX)
+		return;
+
+	ca->window_blocks[ca->window_len++] = off;
+}
+
+// find root of block in union-find forest
+static uint32_t
+find_group_root(uint32_t *parent, uint32_t x)
+{
+	while (parent[x] != x) {
+		parent[x] = parent[parent[x]];
+		x = parent[x];
+	}
+	return x;
+}
+
+/*
+ * Recalculate groups of blocks from co-access sketch, blocks are in the same
+ * group when they are connected by pairs seen together at least `threshold`
+ * times, groups are limited to COACCESS_MAX_GROUP blocks.
+ * Must be called with mutex held.
+ */
+static int
+update_coaccess_groups(struct activity_stats *activity)
+{
+	struct coaccess *ca = activity->coaccess;
+	uint32_t *parent = NULL;
+	uint32_t *size = NULL;
+	uint32_t *group = NULL;
+	int ret = 0;
+
+	if (!ca || !activity->len)
+		return 0;
+
+	group = calloc(sizeof(uint32_t), activity->len);
+	parent = malloc(sizeof(uint32_t) * activity->len);
+	size = malloc(sizeof(uint32_t) * activity->len);
+	if (!group || !parent || !size) {
+		ret = ENOMEM;
+		goto cleanup;
+	}
+
+	// initialise only blocks that are in pairs
+	for (size_t i=0; i < COACCESS_PAIRS; i++) {
+		struct coaccess_pair *p = &ca->pairs[i];
+		if (p->a == p->b || p->count < ca->threshold)
+			continue;
+		parent[p->a] = p->a;
+		parent[p->b] = p->b;
+		size[p->a] = 1;
+		size[p->b] = 1;
+	}
+
+	for (size_t i=0; i < COACCESS_PAIRS; i++) {
+		struct coaccess_pair *p = &ca->pairs[i];
+		if (p->a == p->b || p->count < ca->threshold)
+			continue;
+
+		uint32_t ra = find_group_root(parent, p->a);
+		uint32_t rb = find_group_root(parent, p->b);
+		if (ra == rb || size[ra] + size[rb] > COACCESS_MAX_GROUP)
+			continue;
+
+		// lowest block becomes the root, it identifies the group
+		if (rb < ra) {
+			uint32_t tmp = ra;
+			ra = rb;
+			rb = tmp;
+		}
+		parent[rb] = ra;
+		size[ra] += size[rb];
+	}
+
+	for (size_t i=0; i < COACCESS_PAIRS; i++) {
+		struct coaccess_pair *p = &ca->pairs[i];
+		if (p->a == p->b || p->count < ca->threshold)
+			continue;
+
+		// blocks of a pair may be in different groups if joining them
+		// would make a group too large
+		uint32_t r = find_group_root(parent, p->a);
+		if (size[r] >= 2)
+			group[p->a] = r + 1;
+		r = find_group_root(parent, p->b);
+		if (size[r] >= 2)
+			group[p->b] = r + 1;
+	}
+
+	// blocks that changed group need to be saved in journal
+	for (size_t i=0; i < activity->len; i++) {
+		if (activity->group && activity->group[i] == group[i])
+			continue;
+		if (!activity->group && !group[i])
+			continue;
+		ret = mark_block_dirty(activity, i);
+		if (ret)
+			goto cleanup;
+	}
+
+	free(activity->group);
+	activity->group = group;
+	group = NULL;
+
+cleanup:
+	free(group);
+	free(parent);
+	free(size);
+
+	return ret;
+}
+
+int64_t
+get_block_group(struct activity_stats *activity, off_t off)
+{
+	if (!activity->group || !activity->group[off])
+		return -1;
+
+	return activity->group[off] - 1;
+}
+
+/*
+ * Hot-set index: min-heap of the blocks with highest scores, updated on
+ * every change of a block. As all scores decay at the same rate, scores
+ * normalized to a common landmark time (key = score * e^((time - landmark) /
+ * mean_lifetime)) keep their order as time passes, so only changed blocks
+ * need to be moved in heap.
+ */
+
+// heap is larger than the index by that part, blocks which lose score on
+// discard only sink into the reserve, so the index isn't rebuilt for them
+#define HOT_RESERVE_SHARE 8
+
+// keys grow exponentially with time, landmark is moved before they get
+// anywhere near overflowing a double
+#define HOT_REBASE 64
+
+// key of block a is ranked lower than that of block b, on equal keys blocks
+// further in the volume are worse
+static int
+worse_hot_entry(const struct hot_entry *a, const struct hot_entry *b)
+{
+	if (a->key != b->key)
+		return a->key < b->key;
+	return a->off > b->off;
+}
+
+static double
+hot_key(const struct hot_index *hi, const struct block_activity *ba)
+{
+	double key = 0;
+
+	if (ba->read_score)
+		key += hi->params.read_multiplier * ba->read_score
+			* exp(((double)ba->read_time - hi->landmark)
+				* hi->params.scale);
+	if (ba->write_score)
+		key += hi->params.write_multiplier * ba->write_score
+			* exp(((double)ba->write_time - hi->landmark)
+				* hi->params.scale);
+
+	return key;
+}
+
+static void
+set_hot_entry(struct hot_index *hi, size_t i, struct hot_entry he)
+{
+	hi->heap[i] = he;
+	hi->pos[he.off] = i + 1;
+}
+
+static void
+sift_down_hot_index(struct hot_index *hi, size_t i)
+{
+	struct hot_entry he = hi->heap[i];
+
+	while (1) {
+		size_t worst = i;
+		const struct hot_entry *w = &he;
+		size_t l = 2 * i + 1;
+		size_t r = 2 * i + 2;
+
+		if (l < hi->len && worse_hot_entry(&hi->heap[l], w)) {
+			worst = l;
+			w = &hi->heap[l];
+		}
+		if (r < hi->len && worse_hot_entry(&hi->heap[r], w))
+			worst = r;
+		if (worst == i)
+			break;
+
+		set_hot_entry(hi, i, hi->heap[worst]);
+		i = worst;
+	}
+
+	set_hot_entry(hi, i, he);
+}
+
+static void
+sift_up_hot_index(struct hot_index *hi, size_t i)
+{
+	struct hot_entry he = hi->heap[i];
+
+	while (i > 0) {
+		size_t parent = (i - 1) / 2;
+		if (!worse_hot_entry(&he, &hi->heap[parent]))
+			break;
+
+		set_hot_entry(hi, i, hi->heap[parent]);
+		i = parent;
+	}
+
+	set_hot_entry(hi, i, he);
+}
+
+// make sure position of every block can be recorded
+static int
+extend_hot_index(struct hot_index *hi, int64_t len)
+{
+	if (hi->pos_len >= (size_t)len)
+		return 0;
+
+	if (realloc_zeroed((void **)&hi->pos, sizeof(uint32_t), hi->pos_len, len))
+		return ENOMEM;
+	hi->pos_len = len;
+
+	return 0;
+}
+
+// move landmark to provided time, order of keys doesn't change
+static void
+rebase_hot_index(struct hot_index *hi, int64_t landmark)
+{
+	double factor = exp((hi->landmark - (double)landmark) * hi->params.scale);
+
+	for (size_t i=0; i < hi->len; i++)
+		hi->heap[i].key *= factor;
+	hi->landmark = landmark;
+}
+
+// put block in index if it's one of the hottest, must be called with
+// activity->mutex held
+static int
+update_hot_block(struct activity_stats *activity, int64_t off, int64_t time)
+{
+	struct hot_index *hi = activity->hot;
+	struct hot_entry he = { .off = off };
+	uint32_t pos;
+
+	if (!hi)
+		return 0;
+
+	if (extend_hot_index(hi, activity->len))
+		return ENOMEM;
+
+	if ((time - hi->landmark) * hi->params.scale > HOT_REBASE)
+		rebase_hot_index(hi, time);
+
+	he.key = hot_key(hi, &activity->block[off]);
+	pos = hi->pos[off];
+
+	if (pos) {
+		hi->heap[pos - 1] = he;
+		sift_down_hot_index(hi, pos - 1);
+		sift_up_hot_index(hi, hi->pos[off] - 1);
+	} else if (hi->len < hi->capacity) {
+		hi->heap[hi->len++] = he;
+		sift_up_hot_index(hi, hi->len - 1);
+	} else if (worse_hot_entry(&hi->heap[0], &he)) {
+		hi->pos[hi->heap[0].off] = 0;
+		hi->heap[0] = he;
+		sift_down_hot_index(hi, 0);
+	}
+
+	return 0;
+}
+
+// fill index from scratch, must be called with activity->mutex held
+static int
+rebuild_hot_index(struct activity_stats *activity)
+{
+	struct hot_index *hi = activity->hot;
+
+	if (extend_hot_index(hi, activity->len))
+		return ENOMEM;
+
+	for (size_t i=0; i < hi->len; i++)
+		hi->pos[hi->heap[i].off] = 0;
+	hi->len = 0;
+
+	for (int64_t off=0; activity->block && off < activity->len; off++) {
+		struct block_activity *ba = &activity->block[off];
+		if (!ba->read_score && !ba->write_score)
+			continue;
+		update_hot_block(activity, off, hi->landmark);
+	}
+
+	return 0;
+}
+
+int
+enable_hot_index(struct activity_stats *activity, size_t size,
+		int read_multiplier, int write_multiplier, double mean_lifetime)
+{
+	int ret = 0;
+	struct hot_index *hi;
+
+	assert(size > 0 && size <= UINT32_MAX / 2);
+	assert(mean_lifetime > 0);
+
+	pthread_mutex_lock(&activity->mutex);
+
+	free_hot_index(activity->hot);
+	activity->hot = NULL;
+
+	hi = calloc(sizeof(struct hot_index), 1);
+	if (!hi) {
+		ret = ENOMEM;
+		goto mutex_cleanup;
+	}
+	hi->capacity = size + size / HOT_RESERVE_SHARE + 1;
+	hi->heap = malloc(sizeof(struct hot_entry) * hi->capacity);
+	if (!hi->heap) {
+		free(hi);
+		ret = ENOMEM;
+		goto mutex_cleanup;
+	}
+	hi->size = size;
+	hi->params.read_multiplier = read_multiplier;
+	hi->params.write_multiplier = write_multiplier;
+	hi->params.scale = 1.0 / mean_lifetime;
+	hi->landmark = time(NULL);
+	activity->hot = hi;
+
+	ret = rebuild_hot_index(activity);
+	if (ret) {
+		free_hot_index(hi);
+		activity->hot = NULL;
+	}
+
+mutex_cleanup:
+	pthread_mutex_unlock(&activity->mutex);
+
+	return ret;
+}
+
+// order of entries from hottest to coldest
+static int
+compare_hot_entries(const void *a, const void *b)
+{
+	const struct hot_entry *x = a;
+	const struct hot_entry *y = b;
+
+	if (worse_hot_entry(x, y))
+		return 1;
+	if (worse_hot_entry(y, x))
+		return -1;
+	return 0;
+}
+
+// copy hottest blocks sorted from most to least active, without the
+// reserve, must be called with activity->mutex held
+static int
+copy_hot_entries(struct activity_stats *activity, struct hot_entry **he,
+    size_t *len)
+{
+	struct hot_index *hi = activity->hot;
+
+	*he = malloc(sizeof(struct hot_entry) * (hi->len ? hi->len : 1));
+	if (!*he)
+		return ENOMEM;
+
+	memcpy(*he, hi->heap, sizeof(struct hot_entry) * hi->len);
+
+	qsort(*he, hi->len, sizeof(struct hot_entry), compare_hot_entries);
+	*len = hi->len < hi->size ? hi->len : hi->size;
+
+	return 0;
+}
+
+int
+get_hot_blocks(struct activity_stats *activity, struct block_scores **bs,
+        size_t size, size_t *found)
+{
+	struct hot_entry *he = NULL;
+	struct block_activity *ba = NULL;
+	float *score = NULL;
+	time_t now = time(NULL);
+	size_t len;
+	int ret = 0;
+
+	assert(found);
+	*found = 0;
+
+	pthread_mutex_lock(&activity->mutex);
+
+	if (!activity->hot) {
+		ret = EINVAL;
+		goto mutex_cleanup;
+	}
+
+	if (!*bs)
+		*bs = malloc(sizeof(struct block_scores) * size);
+	if (!*bs) {
+		ret = ENOMEM;
+		goto mutex_cleanup;
+	}
+
+	ret = copy_hot_entries(activity, &he, &len);
+	if (ret)
+		goto mutex_cleanup;
+
+	if (len > size)
+		len = size;
+	if (!len)
+		goto mutex_cleanup;
+
+	// hot blocks are scattered over the volume, gather them for scoring
+	ba = malloc(sizeof(struct block_activity) * len);
+	score = malloc(sizeof(float) * len);
+	if (!ba || !score) {
+		ret = ENOMEM;
+		goto mutex_cleanup;
+	}
+
+	for (size_t i=0; i < len; i++)
+		ba[i] = activity->block[he[i].off];
+	score_blocks(ba, len, now, &activity->hot->params, score);
+	for (size_t i=0; i < len; i++) {
+		(*bs)[i].offset = he[i].off;
+		(*bs)[i].score = score[i];
+	}
+	*found = len;
+
+mutex_cleanup:
+	pthread_mutex_unlock(&activity->mutex);
+	free(he);
+	free(ba);
+	free(score);
+
+	return ret;
+}
+
+int
+add_block_io(struct activity_stats *activity, int64_t off, int64_t time,
+		double mean_lifetime, double hit_score, double bytes, int type) {
+
+	int ret = 0;
+	struct block_activity *ba;
+
+	pthread_mutex_lock(&activity->mutex);
+
+	// dynamically extend activity->block as new blocks are added
+	ret = extend_activity_stats(activity, off);
+	if (ret)
+		goto mutex_cleanup;
+
+	ret = mark_block_dirty(activity, off);
+	if (ret)
+		goto mutex_cleanup;
+
+	ret = mark_block_touched(activity, off);
+	if (ret)
+		goto mutex_cleanup;
+
+	// start counting bytes when first IO with known size is seen
+	if (bytes > 0 && !activity->bytes) {
+		activity->bytes = calloc(sizeof(struct block_bytes),
+				activity->len);
+		if (!activity->bytes) {
+			ret = ENOMEM;
+			goto mutex_cleanup;
+		}
+	}
+
+	ba = &activity->block[off];
+
+	if (activity->profile)
+		add_block_profile(activity, off, time, hit_score);
+
+	if (activity->coaccess)
+		add_block_coaccess(activity->coaccess, off, time);
+
+	if (activity->trend && activity->trend_interval) {
+		struct block_trend *bt = &activity->trend[off];
+		advance_block_trend(bt, time / activity->trend_interval,
+			activity->trend_alpha, activity->trend_beta);
+		bt->count += hit_score;
+	}
+
+	// update byte counters first, they need time of previous access
+	if (activity->bytes) {
+		if (type == T_READ)
+			add_bytes_activity(&activity->bytes[off].read_bytes,
+				ba->read_time, time, mean_lifetime, bytes);
+		else
+			add_bytes_activity(&activity->bytes[off].write_bytes,
+				ba->write_time, time, mean_lifetime, bytes);
+	}
+
+	if (type == T_READ)
+		add_block_activity_read(&(activity->block[off]), time, mean_lifetime, hit_score);
+	else {
+		add_block_activity_write(&(activity->block[off]), time, mean_lifetime, hit_score);
+		// block has new data, earlier discards don't matter any more
+		if (activity->discard)
+			activity->discard[off] = 0;
+	}
+
+	// discards only lower scores, summaries stay valid without update
+	if (activity->summary)
+		summarize_block(&activity->summary[off / CHUNK_BLOCKS], ba);
+
+	ret = update_hot_block(activity, off, time);
+
+mutex_cleanup:
+	pthread_mutex_unlock(&activity->mutex);
+
+	return ret;
+}
+
+int
+add_block_discard(struct activity_stats *activity, int64_t off,
+		int64_t sectors, int64_t block_sectors) {
+
+	int ret = 0;
+	int64_t discarded;
+	struct block_activity *ba;
+
+	assert(sectors > 0);
+	assert(block_sectors > 0);
+
+	pthread_mutex_lock(&activity->mutex);
+
+	// block never accessed, nothing to cool down
+	if (!activity->block || activity->len <= off)
+		goto mutex_cleanup;
+
+	if (!activity->discard) {
+		activity->discard = calloc(sizeof(uint32_t), activity->len);
+		if (!activity->discard) {
+			ret = ENOMEM;
+			goto mutex_cleanup;
+		}
+	}
+
+	ret = mark_block_dirty(activity, off);
+	if (ret)
+		goto mutex_cleanup;
+
+	ba = &activity->block[off];
+	discarded = activity->discard[off];
+
+	if (discarded + sectors >= block_sectors) {
+		// whole block is gone
+		ba->read_score = 0;
+		ba->write_score = 0;
+		activity->discard[off] = block_sectors;
+	} else {
+		// scale by part of still present data that was just removed
+		double left = (double)(block_sectors - discarded - sectors)
+			/ (block_sectors - discarded);
+		ba->read_score *= left;
+		ba->write_score *= left;
+		activity->discard[off] = discarded + sectors;
+	}
+
+	ret = update_hot_block(activity, off, time(NULL));
+
+mutex_cleanup:
+	pthread_mutex_unlock(&activity->mutex);
+
+	return ret;
+}
+
+int
+add_block_weighted_io(struct activity_stats *activity, int64_t off,
+		int64_t time, double mean_lifetime, double hit_score,
+		double weight, double bytes, int type)
+{
+	return add_block_io(activity, off, time, mean_lifetime,
+			hit_score * weight, bytes * weight, type);
+}
+
+int
+add_block_read(struct activity_stats *activity, int64_t off, int64_t time,
+    double mean_lifetime, double hit_score) {
+
+	return add_block_io(activity, off, time, mean_lifetime, hit_score, 0,
+			T_READ);
+}
+
+int
+add_block_write(struct activity_stats *activity, int64_t off, int64_t time,
+    double mean_lifetime, double hit_score) {
+
+	return add_block_io(activity, off, time, mean_lifetime, hit_score, 0,
+			T_WRITE);
+}
+
+struct block_activity*
+get_block_activity(struct activity_stats *activity, off_t off)
+{
+    return &activity->block[off];
+}
+
+// return last access time, either read or write
+time_t
+get_last_access_time(struct block_activity *ba, int type)
+{
+    time_t last_access = 0;
+
+    if (type == T_READ)
+        last_access = ba->read_time;
+    else
+        last_access = ba->write_time;
+
+    return last_access;
+}
+
+time_t
+get_last_read_time(struct block_activity *ba)
+{
+    return get_last_access_time(ba, T_READ);
+}
+
+time_t
+get_last_write_time(struct block_activity *ba)
+{
+    return get_last_access_time(ba, T_WRITE);
+}
+
+float
+get_block_activity_raw_score(struct block_activity *block, int type)
+{
+    assert(type == T_READ || type == T_WRITE);
+
+    if (type == T_READ)
+        return block->read_score;
+    else
+        return block->write_score;
+}
+
+float
+get_block_read_bytes(struct activity_stats *activity, off_t off)
+{
+    if (!activity->bytes)
+        return 0;
+
+    return activity->bytes[off].read_bytes;
+}
+
+float
+get_block_write_bytes(struct activity_stats *activity, off_t off)
+{
+    if (!activity->bytes)
+        return 0;
+
+    return activity->bytes[off].write_bytes;
+}
+
+/*
+ * Scores are calculated in batches: scores and ages of blocks are gathered
+ * to separate arrays, decayed and summed by a kernel using the widest vector
+ * instructions the CPU supports. All kernels use the same approximation of
+ * exp() (from Cephes expf(), relative error below 2e-7) and the same order of
+ * operations, so they return identical results.
+ */
+#define SCORE_BATCH 256
+
+#define EXP_LOG2E 1.44269504088896341f
+#define EXP_C1 0.693359375f
+#define EXP_C2 -2.12194440e-4f
+#define EXP_P0 1.9875691500e-4f
+#define EXP_P1 1.3981999507e-3f
+#define EXP_P2 8.3334519073e-3f
+#define EXP_P3 4.1665795894e-2f
+#define EXP_P4 1.6666665459e-1f
+#define EXP_P5 5.0000001201e-1f
+// below that the result isn't a normal float, it's rounded to 0
+#define EXP_MIN -87.3365f
+
+struct score_batch {
+	float read_score[SCORE_BATCH];
+	float read_age[SCORE_BATCH];
+	float write_score[SCORE_BATCH];
+	float write_age[SCORE_BATCH];
+};
+
+typedef void (*score_kernel_fn)(const struct score_batch *sb, size_t start,
+    size_t count, float neg_scale, float rm, float wm, float *out);
+
+// no kernel may fuse multiplications and additions, otherwise results would
+// differ between them and between compilers
+#define SCORE_NO_CONTRACT __attribute__((optimize("fp-contract=off")))
+
+SCORE_NO_CONTRACT static inline float
+exp_approx(float x)
+{
+	if (x < EXP_MIN)
+		return 0;
+
+	float n = floorf(x * EXP_LOG2E + 0.5f);
+	float r = x - n * EXP_C1 - n * EXP_C2;
+	float p = EXP_P0;
+	p = p * r + EXP_P1;
+	p = p * r + EXP_P2;
+	p = p * r + EXP_P3;
+	p = p * r + EXP_P4;
+	p = p * r + EXP_P5;
+	p = p * r * r + r + 1.0f;
+
+	union { float f; int32_t i; } e = { .i = ((int32_t)n + 127) << 23 };
+
+	return p * e.f;
+}
+
+SCORE_NO_CONTRACT static inline float
+score_one(float read_age, float read_score, float write_age,
+    float write_score, float neg_scale, float rm, float wm)
+{
+	return exp_approx(read_age * neg_scale) * read_score * rm
+		+ exp_approx(write_age * neg_scale) * write_score * wm;
+}
+
+SCORE_NO_CONTRACT static void
+score_kernel_scalar(const struct score_batch *sb, size_t start, size_t count,
+    float neg_scale, float rm, float wm, float *out)
+{
+	for (size_t i=start; i < count; i++)
+		out[i] = score_one(sb->read_age[i], sb->read_score[i],
+			sb->write_age[i], sb->write_score[i], neg_scale, rm, wm);
+}
+
+// score of single block, same as the one calculated by score_blocks(),
+// without setting up a whole batch
+static float
+score_block(const struct block_activity *ba, time_t now,
+    const struct score_params *params)
+{
+	// scores don't grow for accesses in the future
+	float read_age = now > (time_t)ba->read_time ?
+		now - (time_t)ba->read_time : 0;
+	float write_age = now > (time_t)ba->write_time ?
+		now - (time_t)ba->write_time : 0;
+
+	return score_one(read_age, ba->read_score, write_age, ba->write_score,
+		-params->scale, params->read_multiplier,
+		params->write_multiplier);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SCORE_TARGET(isa) __attribute__((target(isa), \
+		optimize("fp-contract=off")))
+
+SCORE_TARGET("avx2") static inline __m256
+exp_approx_avx2(__m256 x)
+{
+	__m256 under = _mm256_cmp_ps(x, _mm256_set1_ps(EXP_MIN), _CMP_LT_OQ);
+	x = _mm256_max_ps(x, _mm256_set1_ps(EXP_MIN));
+
+	__m256 n = _mm256_floor_ps(_mm256_add_ps(
+			_mm256_mul_ps(x, _mm256_set1_ps(EXP_LOG2E)),
+			_mm256_set1_ps(0.5f)));
+	__m256 r = _mm256_sub_ps(
+			_mm256_sub_ps(x, _mm256_mul_ps(n, _mm256_set1_ps(EXP_C1))),
+			_mm256_mul_ps(n, _mm256_set1_ps(EXP_C2)));
+	__m256 p = _mm256_set1_ps(EXP_P0);
+	p = _mm256_add_ps(_mm256_mul_ps(p, r), _mm256_set1_ps(EXP_P1));
+	p = _mm256_add_ps(_mm256_mul_ps(p, r), _mm256_set1_ps(EXP_P2));
+	p = _mm256_add_ps(_mm256_mul_ps(p, r), _mm256_set1_ps(EXP_P3));
+	p = _mm256_add_ps(_mm256_mul_ps(p, r), _mm256_set1_ps(EXP_P4));
+	p = _mm256_add_ps(_mm256_mul_ps(p, r), _mm256_set1_ps(EXP_P5));
+	p = _mm256_add_ps(_mm256_add_ps(
+			_mm256_mul_ps(_mm256_mul_ps(p, r), r), r),
+			_mm256_set1_ps(1.0f));
+
+	__m256i e = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n),
+			_mm256_set1_epi32(127)), 23);
+
+	return _mm256_andnot_ps(under, _mm256_mul_ps(p, _mm256_castsi256_ps(e)));
+}
+
+SCORE_TARGET("avx2") static void
+score_kernel_avx2(const struct score_batch *sb, size_t start, size_t count,
+    float neg_scale, float rm, float wm, float *out)
+{
+	__m256 ns = _mm256_set1_ps(neg_scale);
+	size_t i = start;
+
+	for (; i + 8 <= count; i += 8) {
+		__m256 r = _mm256_mul_ps(_mm256_mul_ps(
+				exp_approx_avx2(_mm256_mul_ps(
+					_mm256_loadu_ps(&sb->read_age[i]), ns)),
+				_mm256_loadu_ps(&sb->read_score[i])),
+			_mm256_set1_ps(rm));
+		__m256 w = _mm256_mul_ps(_mm256_mul_ps(
+				exp_approx_avx2(_mm256_mul_ps(
+					_mm256_loadu_ps(&sb->write_age[i]), ns)),
+				_mm256_loadu_ps(&sb->write_score[i])),
+			_mm256_set1_ps(wm));
+		_mm256_storeu_ps(&out[i], _mm256_add_ps(r, w));
+	}
+
+	score_kernel_scalar(sb, i, count, neg_scale, rm, wm, out);
+}
+
+SCORE_TARGET("avx512f") static inline __m512
+exp_approx_avx512(__m512 x)
+{
+	__mmask16 under = _mm512_cmp_ps_mask(x, _mm512_set1_ps(EXP_MIN),
+			_CMP_LT_OQ);
+	x = _mm512_max_ps(x, _mm512_set1_ps(EXP_MIN));
+
+	__m512 n = _mm512_roundscale_ps(_mm512_add_ps(
+			_mm512_mul_ps(x, _mm512_set1_ps(EXP_LOG2E)),
+			_mm512_set1_ps(0.5f)),
+		_MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+	__m512 r = _mm512_sub_ps(
+			_mm512_sub_ps(x, _mm512_mul_ps(n, _mm512_set1_ps(EXP_C1))),
+			_mm512_mul_ps(n, _mm512_set1_ps(EXP_C2)));
+	__m512 p = _mm512_set1_ps(EXP_P0);
+	p = _mm512_add_ps(_mm512_mul_ps(p, r), _mm512_set1_ps(EXP_P1));
+	p = _mm512_add_ps(_mm512_mul_ps(p, r), _mm512_set1_ps(EXP_P2));
+	p = _mm512_add_ps(_mm512_mul_ps(p, r), _mm512_set1_ps(EXP_P3));
+	p = _mm512_add_ps(_mm512_mul_ps(p, r), _mm512_set1_ps(EXP_P4));
+	p = _mm512_add_ps(_mm512_mul_ps(p, r), _mm512_set1_ps(EXP_P5));
+	p = _mm512_add_ps(_mm512_add_ps(
+			_mm512_mul_ps(_mm512_mul_ps(p, r), r), r),
+			_mm512_set1_ps(1.0f));
+
+	__m512i e = _mm512_slli_epi32(_mm512_add_epi32(_mm512_cvtps_epi32(n),
+			_mm512_set1_epi32(127)), 23);
+
+	return _mm512_maskz_mov_ps(~under,
+			_mm512_mul_ps(p, _mm512_castsi512_ps(e)));
+}
+
+SCORE_TARGET("avx512f") static void
+score_kernel_avx512(const struct score_batch *sb, size_t start, size_t count,
+    float neg_scale, float rm, float wm, float *out)
+{
+	__m512 ns = _mm512_set1_ps(neg_scale);
+	size_t i = start;
+
+	for (; i + 16 <= count; i += 16) {
+		__m512 r = _mm512_mul_ps(_mm512_mul_ps(
+				exp_approx_avx512(_mm512_mul_ps(
+					_mm512_loadu_ps(&sb->read_age[i]), ns)),
+				_mm512_loadu_ps(&sb->read_score[i])),
+			_mm512_set1_ps(rm));
+		__m512 w = _mm512_mul_ps(_mm512_mul_ps(
+				exp_approx_avx512(_mm512_mul_ps(
+					_mm512_loadu_ps(&sb->write_age[i]), ns)),
+				_mm512_loadu_ps(&sb->write_score[i])),
+			_mm512_set1_ps(wm));
+		_mm512_storeu_ps(&out[i], _mm512_add_ps(r, w));
+	}
+
+	score_kernel_scalar(sb, i, count, neg_scale, rm, wm, out);
+}
+
+static int
+cpu_has_avx512(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx512f");
+}
+
+static int
+cpu_has_avx2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+#endif
+
+static int
+cpu_has_nothing(void)
+{
+	return 1;
+}
+
+struct score_kernel {
+	const char *name;
+	int (*supported)(void);
+	score_kernel_fn fn;
+};
+
+/** kernels, from the fastest */
+static const struct score_kernel score_kernels[] = {
+#if defined(__x86_64__) || defined(__i386__)
+	{ "avx512", cpu_has_avx512, score_kernel_avx512 },
+	{ "avx2", cpu_has_avx2, score_kernel_avx2 },
+#endif
+	{ "scalar", cpu_has_nothing, score_kernel_scalar },
+};
+
+#define SCORE_KERNELS_NUM (sizeof(score_kernels)/sizeof(score_kernels[0]))
+
+static score_kernel_fn score_kernel;
+static pthread_once_t score_kernel_once = PTHREAD_ONCE_INIT;
+
+static void
+select_score_kernel(void)
+{
+	for (size_t i=0; i < SCORE_KERNELS_NUM; i++)
+		if (score_kernels[i].supported()) {
+			score_kernel = score_kernels[i].fn;
+			return;
+		}
+}
+
+// score blocks using provided kernel
+static void
+score_blocks_with(score_kernel_fn kernel, const struct block_activity *block,
+    size_t count, time_t now, const struct score_params *params, float *out)
+{
+	struct score_batch sb;
+	float neg_scale = -params->scale;
+
+	for (size_t off=0; off < count; off += SCORE_BATCH) {
+		const struct block_activity *ba = &block[off];
+		size_t n = count - off;
+		if (n > SCORE_BATCH)
+			n = SCORE_BATCH;
+
+		// scores don't grow for accesses in the future
+		for (size_t i=0; i < n; i++) {
+			sb.read_score[i] = ba[i].read_score;
+			sb.read_age[i] = now > (time_t)ba[i].read_time ?
+				now - (time_t)ba[i].read_time : 0;
+			sb.write_score[i] = ba[i].write_score;
+			sb.write_age[i] = now > (time_t)ba[i].write_time ?
+				now - (time_t)ba[i].write_time : 0;
+		}
+
+		kernel(&sb, 0, n, neg_scale, params->read_multiplier,
+			params->write_multiplier, &out[off]);
+	}
+}
+
+void
+score_blocks(const struct block_activity *block, size_t count, time_t now,
+    const struct score_params *params, float *out)
+{
+	pthread_once(&score_kernel_once, select_score_kernel);
+
+	score_blocks_with(score_kernel, block, count, now, params, out);
+}
+
+void
+score_range(struct activity_stats *activity, int64_t first, size_t count,
+    time_t now, const struct score_params *params, float *out)
+{
+	assert(first >= 0 && first + (int64_t)count <= activity->len);
+
+	score_blocks(&activity->block[first], count, now, params, out);
+}
+
+int
+smooth_block_scores(float *score, size_t len, float share, size_t radius)
+{
+	float *orig;
+
+	if (!radius || !len)
+		return 0;
+
+	orig = malloc(sizeof(float) * len);
+	if (!orig)
+		return ENOMEM;
+	memcpy(orig, score, sizeof(float) * len);
+
+	for (size_t i=0; i < len; i++) {
+		double weight = 1;
+		double sum = orig[i];
+
+		for (size_t d=1; d <= radius; d++) {
+			weight *= share;
+			if (i >= d)
+				sum += weight * orig[i - d];
+			if (i + d < len)
+				sum += weight * orig[i + d];
+		}
+
+		score[i] = sum;
+	}
+
+	free(orig);
+
+	return 0;
+}
+
+int
+set_group_block_scores(struct activity_stats *activity, float *score,
+    size_t len)
+{
+	double *sum;
+	uint32_t *count;
+
+	if (!activity->group || !len)
+		return 0;
+
+	sum = calloc(sizeof(double), len);
+	count = calloc(sizeof(uint32_t), len);
+	if (!sum || !count) {
+		free(sum);
+		free(count);
+		return ENOMEM;
+	}
+
+	for (size_t i=0; i < len && (int64_t)i < activity->len; i++) {
+		int64_t group = get_block_group(activity, i);
+		if (group < 0 || (size_t)group >= len)
+			continue;
+		sum[group] += score[i];
+		count[group]++;
+	}
+
+	for (size_t i=0; i < len && (int64_t)i < activity->len; i++) {
+		int64_t group = get_block_group(activity, i);
+		if (group < 0 || (size_t)group >= len)
+			continue;
+		score[i] = sum[group] / count[group];
+	}
+
+	free(sum);
+	free(count);
+
+	return 0;
+}
+
+float
+calculate_score(float read_score,
+                time_t read_time,
+                float read_multiplier,
+                float write_score,
+                time_t write_time,
+                float write_multiplier,
+                time_t curr_time,
+                float scale)
+{
+    struct block_activity ba = {
+        .read_time = read_time, .read_score = read_score,
+        .write_time = write_time, .write_score = write_score };
+    struct score_params params = { .read_multiplier = read_multiplier,
+        .write_multiplier = write_multiplier, .scale = scale };
+
+    return score_block(&ba, curr_time, &params);
+}
+
+float
+get_raw_block_read_score(struct block_activity *ba)
+{
+    return get_block_activity_raw_score(ba, T_READ);
+}
+
+float
+get_raw_block_write_score(struct block_activity *ba)
+{
+    return get_block_activity_raw_score(ba, T_WRITE);
+}
+
+void
+dump_activity_stats(struct activity_stats *activity) {
+
+	int64_t end;
+
+	// blocks never accessed are omitted
+	for (int64_t off=next_touched_blocks(activity, 0, &end);
+			off < activity->len;
+			off=next_touched_blocks(activity, end, &end)) {
+		for (int64_t i=off; i<end; i++) {
+			printf("block %8lu, last read:  %lu, read score:  %e\n",
+					(unsigned long)i, activity->block[i].read_time,
+					activity->block[i].read_score);
+			printf("block %8lu, last write: %lu, write score: %e\n",
+					(unsigned long)i, activity->block[i].write_time,
+					activity->block[i].write_score);
+		}
+	}
+}
+
+#define FILE_MAGIC 0xefabb773746d766cULL
+#define OLD_MAGIC 0xffabb773746d766cULL
+#define FILE_MAGIC_V2 0xefabb873746d766cULL
+#define FILE_VERSION 2
+
+/*
+ * Version 2 file starts with a header padded to STATS_ALIGN bytes, followed
+ * by regions: the table of block records and optional per-block arrays, each
+ * a single contiguous array aligned to STATS_ALIGN bytes. Regions are
+ * described in the header together with their CRC32 checksums.
+ */
+#define STATS_ALIGN 4096
+#define STATS_REGIONS_MAX (STATS_IMAGE_PARTS - 1)
+#define STATS_RECORD_FIELDS 4
+
+#define SECTION_BLOCKS 0x7974697669746361ULL
+// hottest blocks from hot-set index, sorted from most to least active
+#define SECTION_HOT 0x7865646e69746f68ULL
+// summaries of chunks of CHUNK_BLOCKS block records
+#define SECTION_SUMMARY 0x7972616d6d757363ULL
+// bitmap of blocks that were ever accessed
+#define SECTION_TOUCHED 0x646568637563746fULL
+
+/** entry of SECTION_HOT region */
+struct hot_record {
+	int64_t off;
+	struct block_activity ba;
+};
+
+// snapshots in archive are named after the time they were taken
+#define ARCHIVE_SUFFIX ".lvmts"
+
+struct stats_region {
+	uint64_t id; /**< section id */
+	uint32_t elem_size; /**< size of data kept for single block */
+	uint32_t checksum; /**< CRC32 of region data */
+	uint64_t offset; /**< position of region in file */
+	uint64_t length; /**< length of region in bytes */
+};
+
+struct stats_file_header {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t checksum; /**< CRC32 of header with this field zeroed */
+	int64_t len; /**< number of block records */
+	uint64_t extent_size; /**< in bytes, 0 if unknown */
+	uint64_t generation;
+	int64_t time; /**< time the file was written */
+	char vg_name[STATS_NAME_LEN];
+	char lv_name[STATS_NAME_LEN];
+	uint32_t record_size;
+	/** offset (upper 16 bits) and size (lower 16 bits) of record fields */
+	uint32_t record_layout[STATS_RECORD_FIELDS];
+	uint32_t regions;
+	struct stats_region region[STATS_REGIONS_MAX];
+};
+
+#define RECORD_FIELD(field) \
+	((uint32_t)offsetof(struct block_activity, field) << 16 \
+	 | sizeof(((struct block_activity *)0)->field))
+
+static const uint32_t record_layout[STATS_RECORD_FIELDS] = {
+	RECORD_FIELD(read_time),
+	RECORD_FIELD(write_time),
+	RECORD_FIELD(read_score),
+	RECORD_FIELD(write_score),
+};
+
+// update CRC32 with contents of buffer, zlib takes only 32 bit lengths so
+// process it in chunks
+static uint32_t
+stats_crc32_update(uint32_t crc, const void *buf, size_t len)
+{
+	const Bytef *p = buf;
+
+	while (len) {
+		uInt n = len > (1U << 30) ? (1U << 30) : len;
+		crc = crc32(crc, p, n);
+		p += n;
+		len -= n;
+	}
+
+	return crc;
+}
+
+// CRC32 of buffer
+static uint32_t
+stats_crc32(const void *buf, size_t len)
+{
+	return stats_crc32_update(crc32(0L, Z_NULL, 0), buf, len);
+}
+
+int
+pwrite_all(int fd, const void *buf, size_t len, off_t off)
+{
+	const char *p = buf;
+
+	while (len) {
+		ssize_t n = pwrite(fd, p, len, off);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return EIO;
+		}
+		p += n;
+		off += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+// read whole buffer from provided offset, end of file is an error
+static int
+pread_all(int fd, void *buf, size_t len, off_t off)
+{
+	char *p = buf;
+
+	while (len) {
+		ssize_t n = pread(fd, p, len, off);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return EIO;
+		}
+		if (n == 0)
+			return EIO;
+		p += n;
+		off += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+void
+set_activity_stats_volume(struct activity_stats *activity,
+        const char *vg_name, const char *lv_name, uint64_t extent_size)
+{
+	pthread_mutex_lock(&activity->mutex);
+
+	if (vg_name != activity->vg_name)
+		snprintf(activity->vg_name, STATS_NAME_LEN, "%s",
+			vg_name ? vg_name : "");
+	if (lv_name != activity->lv_name)
+		snprintf(activity->lv_name, STATS_NAME_LEN, "%s",
+			lv_name ? lv_name : "");
+	activity->extent_size = extent_size;
+
+	pthread_mutex_unlock(&activity->mutex);
+}
+
+/*
+ * Statistics of the same volume collected separately (e.g. on different
+ * hosts) are merged by decaying scores of every record to the newest access
+ * time among the inputs and summing them, as if all IO was seen by a single
+ * collector. Ranges of blocks are merged in parallel.
+ */
+struct merge_param {
+	struct activity_stats *merged;
+	struct activity_stats **stats;
+	size_t count;
+	double mean_lifetime;
+	int64_t start;
+	int64_t end;
+};
+
+static double
+decay_to_time(float score, uint64_t from, uint64_t to, double mean_lifetime)
+{
+	if (to <= from)
+		return score;
+
+	return score_decay(score, to - from, mean_lifetime);
+}
+
+static void *
+merge_blocks_worker(void *in)
+{
+	struct merge_param *mp = in;
+	struct activity_stats *m = mp->merged;
+
+	for (int64_t off=mp->start; off < mp->end; off++) {
+		struct block_activity *mb = &m->block[off];
+		double read_score = 0;
+		double write_score = 0;
+		double read_bytes = 0;
+		double write_bytes = 0;
+		uint64_t discard_time = 0;
+
+		for (size_t i=0; i < mp->count; i++) {
+			if (off >= mp->stats[i]->len)
+				continue;
+			struct block_activity *ba = &mp->stats[i]->block[off];
+			if (ba->read_time > mb->read_time)
+				mb->read_time = ba->read_time;
+			if (ba->write_time > mb->write_time)
+				mb->write_time = ba->write_time;
+		}
+
+		for (size_t i=0; i < mp->count; i++) {
+			struct activity_stats *as = mp->stats[i];
+			if (off >= as->len)
+				continue;
+			struct block_activity *ba = &as->block[off];
+
+			read_score += decay_to_time(ba->read_score, ba->read_time,
+				mb->read_time, mp->mean_lifetime);
+			write_score += decay_to_time(ba->write_score, ba->write_time,
+				mb->write_time, mp->mean_lifetime);
+
+			if (as->bytes) {
+				read_bytes += decay_to_time(as->bytes[off].read_bytes,
+					ba->read_time, mb->read_time, mp->mean_lifetime);
+				write_bytes += decay_to_time(as->bytes[off].write_bytes,
+					ba->write_time, mb->write_time, mp->mean_lifetime);
+			}
+
+			// discards made before the last write don't matter
+			if (m->discard) {
+				uint32_t discard = as->discard ? as->discard[off] : 0;
+				if (ba->write_time > discard_time) {
+					m->discard[off] = discard;
+					discard_time = ba->write_time;
+				} else if (ba->write_time == discard_time
+				    && discard > m->discard[off])
+					m->discard[off] = discard;
+			}
+
+			if (as->profile) {
+				struct block_profile bp = as->profile[off];
+				struct block_profile *mbp = &m->profile[off];
+
+				if (bp.day > mbp->day)
+					decay_block_profile(mbp, bp.day);
+				else
+					decay_block_profile(&bp, mbp->day);
+				for (int h=0; h < 24; h++)
+					mbp->hour[h] += bp.hour[h];
+				for (int d=0; d < 7; d++)
+					mbp->weekday[d] += bp.weekday[d];
+			}
+		}
+
+		mb->read_score = read_score;
+		mb->write_score = write_score;
+		if (m->bytes) {
+			m->bytes[off].read_bytes = read_bytes;
+			m->bytes[off].write_bytes = write_bytes;
+		}
+	}
+
+	return NULL;
+}
+
+// statistics describe the same volume or the volume isn't known
+static int
+same_volume(struct activity_stats *a, struct activity_stats *b)
+{
+	if (a->extent_size && b->extent_size && a->extent_size != b->extent_size)
+		return 0;
+	if (a->vg_name[0] && b->vg_name[0] && strcmp(a->vg_name, b->vg_name))
+		return 0;
+	if (a->lv_name[0] && b->lv_name[0] && strcmp(a->lv_name, b->lv_name))
+		return 0;
+
+	return 1;
+}
+
+int
+merge_activity_stats(struct activity_stats **merged,
+        struct activity_stats **stats, size_t count, double mean_lifetime,
+        int threads)
+{
+	assert(merged);
+	assert(stats);
+	assert(count);
+	assert(mean_lifetime > 0);
+
+	struct activity_stats *m;
+	struct merge_param *mp = NULL;
+	pthread_t *thread = NULL;
+	int *started = NULL;
+	int64_t len = 0;
+	int ret = 0;
+
+	for (size_t i=0; i < count; i++) {
+		if (!same_volume(stats[0], stats[i]))
+			return EINVAL;
+		if (stats[i]->len > len)
+			len = stats[i]->len;
+	}
+
+	m = new_activity_stats();
+	if (!m)
+		return ENOMEM;
+
+	for (size_t i=0; i < count; i++) {
+		struct activity_stats *as = stats[i];
+		set_activity_stats_volume(m,
+			m->vg_name[0] ? m->vg_name : as->vg_name,
+			m->lv_name[0] ? m->lv_name : as->lv_name,
+			m->extent_size ? m->extent_size : as->extent_size);
+	}
+
+	if (!len)
+		goto cleanup;
+
+	m->block = calloc(sizeof(struct block_activity), len);
+	if (!m->block) {
+		ret = ENOMEM;
+		goto cleanup;
+	}
+	m->len = len;
+
+	// trends and co-access groups depend on collector settings and
+	// order of IO, they are collected again by lvmtscd
+	for (size_t i=0; i < count; i++) {
+		if (stats[i]->discard && !m->discard)
+			m->discard = calloc(sizeof(uint32_t), len);
+		if (stats[i]->bytes && !m->bytes)
+			m->bytes = calloc(sizeof(struct block_bytes), len);
+		if (stats[i]->profile && !m->profile)
+			m->profile = calloc(sizeof(struct block_profile), len);
+		if ((stats[i]->discard && !m->discard)
+		    || (stats[i]->bytes && !m->bytes)
+		    || (stats[i]->profile && !m->profile)) {
+			ret = ENOMEM;
+			goto cleanup;
+		}
+	}
+
+	if (threads < 1)
+		threads = 1;
+	if (threads > len)
+		threads = len;
+
+	mp = calloc(sizeof(struct merge_param), threads);
+	thread = calloc(sizeof(pthread_t), threads);
+	started = calloc(sizeof(int), threads);
+	if (!mp || !thread || !started) {
+		ret = ENOMEM;
+		goto cleanup;
+	}
+
+	for (int t=0; t < threads; t++) {
+		mp[t].merged = m;
+		mp[t].stats = stats;
+		mp[t].count = count;
+		mp[t].mean_lifetime = mean_lifetime;
+		mp[t].start = len * t / threads;
+		mp[t].end = len * (t + 1) / threads;
+
+		// merge the range in this thread if another can't be started
+		if (pthread_create(&thread[t], NULL, merge_blocks_worker, &mp[t]))
+			merge_blocks_worker(&mp[t]);
+		else
+			started[t] = 1;
+	}
+
+	for (int t=0; t < threads; t++)
+		if (started[t])
+			pthread_join(thread[t], NULL);
+
+cleanup:
+	free(mp);
+	free(thread);
+	free(started);
+
+	if (ret) {
+		destroy_activity_stats(m);
+		return ret;
+	}
+
+	*merged = m;
+
+	return 0;
+}
+
+/*
+ * Compressed regions are split into chunks of STATS_CHUNK elements, each
+ * encoded and compressed separately, so they can be decoded in parallel or
+ * skipped. Region starts with number of chunks and an index of them.
+ * In chunk, runs of untouched (zeroed) elements are stored as their length,
+ * followed by number and data of elements that follow them, for block
+ * records times are stored as difference to previous record.
+ */
+#define REGION_COMPRESSED 0x80000000U
+// the same as summarized chunks, so that they can be skipped when streaming
+#define STATS_CHUNK CHUNK_BLOCKS
+#define STATS_DECODE_THREADS 16
+// worst case, every element in its own run, with two varints for run header
+// and two for times of block record
+#define ENCODED_CHUNK_MAX(elem_size) (STATS_CHUNK * ((elem_size) + 4 * 10))
+
+struct stats_chunk {
+	uint64_t offset; /**< position of chunk data in region */
+	uint32_t length; /**< length of compressed data */
+	uint32_t encoded_length; /**< length of data after decompression */
+};
+
+static void
+put_varint(uint8_t **p, uint64_t val)
+{
+	while (val >= 0x80) {
+		*(*p)++ = val | 0x80;
+		val >>= 7;
+	}
+	*(*p)++ = val;
+}
+
+static int
+get_varint(const uint8_t **p, const uint8_t *end, uint64_t *val)
+{
+	*val = 0;
+	for (int shift=0; shift < 64; shift += 7) {
+		if (*p >= end)
+			return EIO;
+		uint8_t b = *(*p)++;
+		*val |= (uint64_t)(b & 0x7f) << shift;
+		if (!(b & 0x80))
+			return 0;
+	}
+	return EIO;
+}
+
+// signed differences are stored as small unsigned numbers
+static uint64_t
+zigzag(int64_t val)
+{
+	return ((uint64_t)val << 1) ^ (uint64_t)(val >> 63);
+}
+
+static int64_t
+unzigzag(uint64_t val)
+{
+	return (int64_t)(val >> 1) ^ -(int64_t)(val & 1);
+}
+
+static int
+is_zeroed(const uint8_t *elem, size_t elem_size)
+{
+	for (size_t i=0; i < elem_size; i++)
+		if (elem[i])
+			return 0;
+	return 1;
+}
+
+// encode elements of a single chunk, returns length of encoded data, runs
+// of zeroed elements are taken from `touched` bitmap of chunk if provided
+static size_t
+encode_chunk(uint64_t id, size_t elem_size, const uint8_t *array,
+    size_t count, const uint64_t *touched, uint8_t *out)
+{
+	uint8_t *p = out;
+	uint64_t read_time = 0, write_time = 0;
+	size_t i = 0;
+
+	while (i < count) {
+		size_t zeroes = 0, literals = 0;
+
+		if (touched) {
+			int64_t run_end;
+			int64_t run = next_set_bits(touched, (count + 63) / 64, i,
+				count, &run_end);
+			zeroes = run - i;
+			literals = run_end - run;
+			i += zeroes;
+		} else {
+			while (i + zeroes < count
+			    && is_zeroed(array + (i + zeroes) * elem_size,
+				    elem_size))
+				zeroes++;
+			i += zeroes;
+			while (i + literals < count
+			    && !is_zeroed(array + (i + literals) * elem_size,
+				    elem_size))
+				literals++;
+		}
+
+		put_varint(&p, zeroes);
+		put_varint(&p, literals);
+
+		for (; literals; literals--, i++) {
+			const uint8_t *elem = array + i * elem_size;
+			if (id != SECTION_BLOCKS) {
+				memcpy(p, elem, elem_size);
+				p += elem_size;
+				continue;
+			}
+
+			const struct block_activity *ba =
+				(const struct block_activity *)elem;
+			put_varint(&p, zigzag(ba->read_time - read_time));
+			put_varint(&p, zigzag(ba->write_time - write_time));
+			memcpy(p, &ba->read_score, sizeof(float));
+			p += sizeof(float);
+			memcpy(p, &ba->write_score, sizeof(float));
+			p += sizeof(float);
+			read_time = ba->read_time;
+			write_time = ba->write_time;
+		}
+	}
+
+	return p - out;
+}
+
+static int
+decode_chunk(uint64_t id, size_t elem_size, const uint8_t *p, size_t len,
+    uint8_t *array, size_t count)
+{
+	const uint8_t *end = p + len;
+	uint64_t read_time = 0, write_time = 0;
+	uint64_t zeroes, literals, val;
+	size_t i = 0;
+
+	while (i < count) {
+		if (get_varint(&p, end, &zeroes) || get_varint(&p, end, &literals)
+		    || zeroes > count - i || literals > count - i - zeroes)
+			return EIO;
+
+		memset(array + i * elem_size, 0, zeroes * elem_size);
+		i += zeroes;
+
+		for (; literals; literals--, i++) {
+			uint8_t *elem = array + i * elem_size;
+			if (id != SECTION_BLOCKS) {
+				if ((size_t)(end - p) < elem_size)
+					return EIO;
+				memcpy(elem, p, elem_size);
+				p += elem_size;
+				continue;
+			}
+
+			struct block_activity *ba = (struct block_activity *)elem;
+			if (get_varint(&p, end, &val))
+				return EIO;
+			ba->read_time = read_time += unzigzag(val);
+			if (get_varint(&p, end, &val))
+				return EIO;
+			ba->write_time = write_time += unzigzag(val);
+			if ((size_t)(end - p) < 2 * sizeof(float))
+				return EIO;
+			memcpy(&ba->read_score, p, sizeof(float));
+			p += sizeof(float);
+			memcpy(&ba->write_score, p, sizeof(float));
+			p += sizeof(float);
+		}
+	}
+
+	return p == end ? 0 : EIO;
+}
+
+// encode and compress array of elements, *out must be freed by caller, for
+// block records bitmap of touched blocks may be provided, padded to a whole
+// number of words
+static int
+encode_stats_region(uint64_t id, size_t elem_size, const void *array,
+    int64_t len, const uint64_t *touched, void **out, size_t *out_len)
+{
+	size_t chunks = (len + STATS_CHUNK - 1) / STATS_CHUNK;
+	size_t encoded_max = ENCODED_CHUNK_MAX(elem_size);
+	size_t size = sizeof(uint64_t) + sizeof(struct stats_chunk) * chunks;
+	size_t alloc = size + elem_size * len / 8 + STATS_ALIGN;
+	struct stats_chunk *index;
+	uint8_t *encoded;
+	uint8_t *buf;
+	int ret = 0;
+
+	encoded = malloc(encoded_max);
+	buf = malloc(alloc);
+	if (!encoded || !buf) {
+		ret = ENOMEM;
+		goto cleanup;
+	}
+	*(uint64_t *)buf = chunks;
+
+	for (size_t c=0; c < chunks; c++) {
+		size_t count = len - c * STATS_CHUNK;
+		if (count > STATS_CHUNK)
+			count = STATS_CHUNK;
+
+		size_t encoded_len = encode_chunk(id, elem_size,
+			(const uint8_t *)array + c * STATS_CHUNK * elem_size,
+			count, touched ? touched + c * STATS_CHUNK / 64 : NULL,
+			encoded);
+
+		uLongf length = compressBound(encoded_len);
+		if (alloc - size < length) {
+			alloc = (alloc + length) * 2;
+			uint8_t *tmp = realloc(buf, alloc);
+			if (!tmp) {
+				ret = ENOMEM;
+				goto cleanup;
+			}
+			buf = tmp;
+		}
+
+		if (compress2(buf + size, &length, encoded, encoded_len, 1)
+		    != Z_OK) {
+			ret = ENOMEM;
+			goto cleanup;
+		}
+
+		index = (struct stats_chunk *)(buf + sizeof(uint64_t));
+		index[c].offset = size;
+		index[c].length = length;
+		index[c].encoded_length = encoded_len;
+		size += length;
+	}
+
+	*out = buf;
+	*out_len = size;
+	buf = NULL;
+
+cleanup:
+	free(encoded);
+	free(buf);
+
+	return ret;
+}
+
+struct decode_param {
+	uint64_t id;
+	size_t elem_size;
+	const uint8_t *region;
+	const struct stats_chunk *index;
+	size_t chunks;
+	int64_t len;
+	uint8_t *array;
+	size_t first; /**< first chunk decoded by thread */
+	size_t step; /**< distance between chunks decoded by thread */
+	int ret;
+};
+
+static void *
+decode_chunks_worker(void *in)
+{
+	struct decode_param *dp = in;
+	uint8_t *encoded = malloc(ENCODED_CHUNK_MAX(dp->elem_size));
+
+	if (!encoded) {
+		dp->ret = ENOMEM;
+		return NULL;
+	}
+
+	for (size_t c = dp->first; c < dp->chunks && !dp->ret; c += dp->step) {
+		size_t count = dp->len - c * STATS_CHUNK;
+		if (count > STATS_CHUNK)
+			count = STATS_CHUNK;
+
+		uLongf length = dp->index[c].encoded_length;
+		if (length > ENCODED_CHUNK_MAX(dp->elem_size)
+		    || uncompress(encoded, &length, dp->region + dp->index[c].offset,
+			    dp->index[c].length) != Z_OK) {
+			dp->ret = EIO;
+			break;
+		}
+
+		dp->ret = decode_chunk(dp->id, dp->elem_size, encoded, length,
+			dp->array + c * STATS_CHUNK * dp->elem_size, count);
+	}
+
+	free(encoded);
+	return NULL;
+}
+
+// decompress region into array of len elements, chunks are decoded by
+// multiple threads
+static int
+decode_stats_region(uint64_t id, size_t elem_size, const uint8_t *region,
+    size_t region_len, int64_t len, void *array)
+{
+	struct decode_param dp[STATS_DECODE_THREADS];
+	pthread_t thread[STATS_DECODE_THREADS];
+	size_t chunks;
+	size_t threads;
+	int ret = 0;
+
+	if (region_len < sizeof(uint64_t))
+		return EIO;
+	chunks = *(const uint64_t *)region;
+	if (chunks != (len + STATS_CHUNK - 1) / STATS_CHUNK
+	    || (region_len - sizeof(uint64_t)) / sizeof(struct stats_chunk) < chunks)
+		return EIO;
+
+	const struct stats_chunk *index =
+		(const struct stats_chunk *)(region + sizeof(uint64_t));
+	for (size_t c=0; c < chunks; c++)
+		if (index[c].offset > region_len
+		    || index[c].length > region_len - index[c].offset)
+			return EIO;
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	threads = cpus > 0 ? cpus : 1;
+	if (threads > STATS_DECODE_THREADS)
+		threads = STATS_DECODE_THREADS;
+	if (threads > chunks)
+		threads = chunks ? chunks : 1;
+
+	for (size_t t=0; t < threads; t++) {
+		dp[t] = (struct decode_param) {
+			.id = id, .elem_size = elem_size, .region = region,
+			.index = index, .chunks = chunks, .len = len,
+			.array = array, .first = t, .step = threads, .ret = 0 };
+	}
+
+	// first stripe is decoded in this thread
+	size_t started = 1;
+	for (; started < threads; started++)
+		if (pthread_create(&thread[started], NULL, decode_chunks_worker,
+				&dp[started]))
+			break;
+
+	// as are stripes of threads that couldn't be started
+	for (size_t t=started; t < threads; t++)
+		decode_chunks_worker(&dp[t]);
+	decode_chunks_worker(&dp[0]);
+
+	for (size_t t=1; t < started; t++)
+		pthread_join(thread[t], NULL);
+
+	for (size_t t=0; t < threads; t++)
+		if (dp[t].ret)
+			ret = dp[t].ret;
+
+	return ret;
+}
+
+// copy array of elements to buffer aligned for writing
+static void *
+copy_region_data(const void *array, size_t length)
+{
+	void *buf;
+
+	if (posix_memalign(&buf, STATS_ALIGN, length ? length : 1))
+		return NULL;
+	if (length)
+		memcpy(buf, array, length);
+
+	return buf;
+}
+
+// fill in region description of data in image part, compressing it if
+// requested, places region at *pos, `touched` is bitmap of blocks with
+// non-zero records (or NULL)
+static int
+add_stats_region(struct stats_file_header *hdr, struct stats_image_part *part,
+    int compress, const uint64_t *touched, uint64_t *pos)
+{
+	struct stats_region *reg = &hdr->region[hdr->regions];
+	uint32_t elem_size = reg->elem_size;
+	void *encoded;
+	size_t length;
+
+	// only arrays with data of every block are compressed
+	if (compress && hdr->len && reg->id != SECTION_HOT
+	    && reg->id != SECTION_SUMMARY && reg->id != SECTION_TOUCHED) {
+		if (encode_stats_region(reg->id, elem_size, part->buf, hdr->len,
+				reg->id == SECTION_BLOCKS ? touched : NULL,
+				&encoded, &length))
+			return ENOMEM;
+		free(part->buf);
+		part->buf = encoded;
+		part->len = length;
+		reg->elem_size |= REGION_COMPRESSED;
+	}
+
+	reg->offset = *pos;
+	reg->length = part->len;
+	reg->checksum = stats_crc32(part->buf, part->len);
+	part->offset = *pos;
+
+	hdr->regions++;
+	*pos += (reg->length + STATS_ALIGN - 1) / STATS_ALIGN * STATS_ALIGN;
+
+	return 0;
+}
+
+// copy hot-set index to buffer aligned for writing
+static int
+copy_hot_records(struct activity_stats *activity,
+    struct stats_image_part *part)
+{
+	struct hot_entry *he;
+	struct hot_record *hr;
+	size_t len;
+
+	if (copy_hot_entries(activity, &he, &len))
+		return ENOMEM;
+
+	part->len = sizeof(struct hot_record) * len;
+	if (posix_memalign(&part->buf, STATS_ALIGN, part->len ? part->len : 1)) {
+		part->buf = NULL;
+		free(he);
+		return ENOMEM;
+	}
+
+	hr = part->buf;
+	for (size_t i=0; i < len; i++) {
+		hr[i].off = he[i].off;
+		hr[i].ba = activity->block[he[i].off];
+	}
+
+	free(he);
+
+	return 0;
+}
+
+// copy bitmap of touched blocks, covering all `len` blocks, to buffer aligned
+// for writing
+static int
+copy_touched_bits(struct activity_stats *activity, int64_t len,
+    struct stats_image_part *part)
+{
+	size_t words = (len + 63) / 64;
+	size_t have = activity->touched_words < words ?
+		activity->touched_words : words;
+
+	part->len = sizeof(uint64_t) * words;
+	if (posix_memalign(&part->buf, STATS_ALIGN, part->len)) {
+		part->buf = NULL;
+		return ENOMEM;
+	}
+
+	memcpy(part->buf, activity->touched, sizeof(uint64_t) * have);
+	memset((uint64_t *)part->buf + have, 0,
+		sizeof(uint64_t) * (words - have));
+
+	return 0;
+}
+
+void
+free_stats_image(struct stats_image *image)
+{
+	if (!image)
+		return;
+
+	for (size_t i=0; i < image->parts; i++)
+		free(image->part[i].buf);
+	free(image);
+}
+
+int
+snapshot_activity_stats(struct activity_stats *activity,
+        struct stats_image **image) {
+
+	assert(activity);
+	assert(image);
+	assert(STATS_SECTIONS_NUM + 5 <= STATS_IMAGE_PARTS);
+
+	int ret = 0;
+	int compress;
+	const uint64_t *touched = NULL;
+	struct stats_file_header *hdr;
+	struct stats_image_part *part;
+	uint64_t pos = STATS_ALIGN;
+
+	*image = calloc(1, sizeof(struct stats_image));
+	if (posix_memalign((void **)&hdr, STATS_ALIGN, STATS_ALIGN))
+		hdr = NULL;
+	if (!*image || !hdr) {
+		free(*image);
+		*image = NULL;
+		free(hdr);
+		return ENOMEM;
+	}
+	memset(hdr, 0, STATS_ALIGN);
+
+	// only copying of data happens with lock held, encoding and
+	// checksumming is done on the copy
+	pthread_mutex_lock(&activity->mutex);
+
+	// groups are saved in file, refresh them from co-access sketch
+	ret = update_coaccess_groups(activity);
+	if (ret)
+		goto unlock;
+
+	hdr->magic = FILE_MAGIC_V2;
+	hdr->version = FILE_VERSION;
+	hdr->len = activity->block ? activity->len : 0;
+	hdr->extent_size = activity->extent_size;
+	hdr->generation = activity->generation + 1;
+	hdr->time = time(NULL);
+	memcpy(hdr->vg_name, activity->vg_name, STATS_NAME_LEN);
+	memcpy(hdr->lv_name, activity->lv_name, STATS_NAME_LEN);
+	hdr->record_size = sizeof(struct block_activity);
+	memcpy(hdr->record_layout, record_layout, sizeof(record_layout));
+	compress = activity->compress;
+
+	part = &(*image)->part[0];
+	part->len = sizeof(struct block_activity) * hdr->len;
+	part->buf = copy_region_data(activity->block, part->len);
+	if (!part->buf) {
+		ret = ENOMEM;
+		goto unlock;
+	}
+	hdr->region[0].id = SECTION_BLOCKS;
+	hdr->region[0].elem_size = sizeof(struct block_activity);
+	(*image)->parts = 1;
+
+	for (size_t i=0; i < STATS_SECTIONS_NUM; i++) {
+		void *array = *section_array(activity, &stats_sections[i]);
+		if (!array)
+			continue;
+
+		part = &(*image)->part[(*image)->parts];
+		part->len = stats_sections[i].elem_size * hdr->len;
+		part->buf = copy_region_data(array, part->len);
+		if (!part->buf) {
+			ret = ENOMEM;
+			goto unlock;
+		}
+		hdr->region[(*image)->parts].id = stats_sections[i].id;
+		hdr->region[(*image)->parts].elem_size = stats_sections[i].elem_size;
+		(*image)->parts++;
+	}
+
+	if (activity->hot) {
+		ret = copy_hot_records(activity, &(*image)->part[(*image)->parts]);
+		if (ret)
+			goto unlock;
+		hdr->region[(*image)->parts].id = SECTION_HOT;
+		hdr->region[(*image)->parts].elem_size = sizeof(struct hot_record);
+		(*image)->parts++;
+	}
+
+	if (activity->touched && hdr->len) {
+		part = &(*image)->part[(*image)->parts];
+		ret = copy_touched_bits(activity, hdr->len, part);
+		if (ret)
+			goto unlock;
+		touched = part->buf;
+		hdr->region[(*image)->parts].id = SECTION_TOUCHED;
+		hdr->region[(*image)->parts].elem_size = sizeof(uint64_t);
+		(*image)->parts++;
+	}
+
+	// the copy will hold all changes, journal can start from it
+	activity->generation++;
+	clear_dirty_blocks(activity);
+	activity->base_generation = activity->generation;
+
+unlock:
+	pthread_mutex_unlock(&activity->mutex);
+
+	// summaries are made from the copy, without holding the lock
+	if (!ret && hdr->len) {
+		part = &(*image)->part[(*image)->parts];
+		part->len = sizeof(struct block_activity) * SUMMARY_CHUNKS(hdr->len);
+		if (posix_memalign(&part->buf, STATS_ALIGN, part->len)) {
+			part->buf = NULL;
+			ret = ENOMEM;
+		} else {
+			summarize_blocks(part->buf, (*image)->part[0].buf, hdr->len,
+				touched, (hdr->len + 63) / 64);
+			hdr->region[(*image)->parts].id = SECTION_SUMMARY;
+			hdr->region[(*image)->parts].elem_size =
+				sizeof(struct block_activity);
+			(*image)->parts++;
+		}
+	}
+
+	for (size_t i=0; !ret && i < (*image)->parts; i++)
+		ret = add_stats_region(hdr, &(*image)->part[i], compress, touched,
+			&pos);
+
+	// header is the last part, so that partially written file is never
+	// valid
+	hdr->checksum = stats_crc32(hdr, sizeof(struct stats_file_header));
+	part = &(*image)->part[(*image)->parts++];
+	part->buf = hdr;
+	part->len = STATS_ALIGN;
+	part->offset = 0;
+
+	if (ret) {
+		free_stats_image(*image);
+		*image = NULL;
+	}
+
+	return ret;
+}
+
+void
+invalidate_activity_stats_base(struct activity_stats *activity)
+{
+	pthread_mutex_lock(&activity->mutex);
+	activity->base_generation = 0;
+	pthread_mutex_unlock(&activity->mutex);
+}
+
+int
+write_activity_stats(struct activity_stats *activity, char *file) {
+
+	assert(activity);
+	assert(file);
+
+	int fd;
+	int ret = 0;
+	char *tmp = NULL;
+	struct stats_image *image;
+
+	fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		if (asprintf(&tmp, "Can't open file \"%s\"", file) == -1) {
+			fprintf(stderr, "Out of memory\n");
+			return 1;
+		}
+		perror(tmp);
+		free(tmp);
+		return 1;
+	}
+
+	ret = snapshot_activity_stats(activity, &image);
+	if (ret)
+		goto file_cleanup;
+
+	for (size_t i=0; i < image->parts && !ret; i++)
+		ret = pwrite_all(fd, image->part[i].buf, image->part[i].len,
+			image->part[i].offset);
+
+	if (!ret && fsync(fd))
+		ret = EIO;
+
+	// file doesn't hold the changes, next save must be a full one
+	if (ret)
+		invalidate_activity_stats_base(activity);
+
+	free_stats_image(image);
+
+file_cleanup:
+	close(fd);
+
+	return ret;
+}
+
+// v1 files keep records packed as read time, read score, write time and
+// write score
+#define V1_RECORD_SIZE (2 * sizeof(uint64_t) + 2 * sizeof(float))
+#define V1_CHUNK 4096
+
+static void
+unpack_blocks_v1(struct block_activity *block, const unsigned char *rec,
+    size_t n) {
+
+	for (size_t j=0; j < n; j++, block++) {
+		memcpy(&block->read_time, rec, sizeof(uint64_t));
+		rec += sizeof(uint64_t);
+		memcpy(&block->read_score, rec, sizeof(float));
+		rec += sizeof(float);
+		memcpy(&block->write_time, rec, sizeof(uint64_t));
+		rec += sizeof(uint64_t);
+		memcpy(&block->write_score, rec, sizeof(float));
+		rec += sizeof(float);
+	}
+}
+
+// returns 2 if the file ends before all blocks were read
+static int
+read_blocks_v1(struct activity_stats *activity, FILE *f) {
+	unsigned char *buf;
+	size_t want, n;
+	int ret = 0;
+
+	buf = malloc(V1_RECORD_SIZE * V1_CHUNK);
+	if (!buf)
+		return ENOMEM;
+
+	for (size_t i=0; i < activity->len; i += n) {
+		want = activity->len - i;
+		if (want > V1_CHUNK)
+			want = V1_CHUNK;
+
+		n = fread(buf, V1_RECORD_SIZE, want, f);
+		unpack_blocks_v1(&activity->block[i], buf, n);
+
+		if (n != want) {
+			ret = ferror(f) ? EIO : 2;
+			break;
+		}
+	}
+
+	free(buf);
+	return ret;
+}
+
+/*
+ * Optional per-block arrays are saved after the block table, each as
+ * a header with section id, size of single element and number of elements
+ * followed by the array itself. Readers skip sections they don't know.
+ */
+static int
+read_sections(struct activity_stats *activity, FILE *f) {
+	int n;
+	uint64_t header[3];
+	const struct stats_section *sec;
+
+	while (1) {
+		n = fread(header, sizeof(header), 1, f);
+		if (n != 1) {
+			if (feof(f))
+				return 0;
+			return EIO;
+		}
+
+		sec = NULL;
+		for (size_t i=0; i < STATS_SECTIONS_NUM; i++)
+			if (stats_sections[i].id == header[0])
+				sec = &stats_sections[i];
+
+		// unknown or incompatible section
+		if (!sec || sec->elem_size != header[1]
+		    || header[2] != activity->len) {
+			if (fseek(f, header[1] * header[2], SEEK_CUR))
+				return EIO;
+			continue;
+		}
+
+		void **array = section_array(activity, sec);
+		free(*array);
+		*array = malloc(sec->elem_size * activity->len);
+		if (!*array)
+			return ENOMEM;
+
+		n = fread(*array, sec->elem_size, activity->len, f);
+		if (n != activity->len) {
+			free(*array);
+			*array = NULL;
+			return EIO;
+		}
+	}
+}
+
+// read file in v1 format, positioned just after magic value
+static int
+read_activity_stats_v1(struct activity_stats **activity, FILE *f) {
+	int n;
+	uint64_t len;
+
+	n = fread(&len, sizeof(uint64_t), 1, f);
+	if (n != 1) {
+		fprintf(stderr, "File read error\n");
+		return 1;
+	}
+
+	*activity = new_activity_stats_s(len-1);
+	if (!*activity) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+
+	fseek(f, sizeof(int32_t)*3, SEEK_CUR);
+
+	n = read_blocks_v1(*activity, f);
+	if (n == 2)
+		return 0;
+	if (!n)
+		n = read_sections(*activity, f);
+	if (n) {
+		fprintf(stderr, "File read error\n");
+		destroy_activity_stats(*activity);
+		*activity = NULL;
+		return n;
+	}
+
+	return 0;
+}
+
+// find where array of region with provided id is kept in activity
+static void **
+region_array(struct activity_stats *activity, struct stats_region *reg,
+    int64_t len)
+{
+	void **array = NULL;
+	uint32_t elem_size = reg->elem_size & ~REGION_COMPRESSED;
+
+	if (reg->id == SECTION_BLOCKS) {
+		if (elem_size == sizeof(struct block_activity))
+			array = (void **)&activity->block;
+	} else {
+		for (size_t i=0; i < STATS_SECTIONS_NUM; i++)
+			if (stats_sections[i].id == reg->id
+			    && stats_sections[i].elem_size == elem_size)
+				array = section_array(activity, &stats_sections[i]);
+	}
+
+	if (!(reg->elem_size & REGION_COMPRESSED)
+	    && reg->length != (uint64_t)elem_size * len)
+		return NULL;
+
+	return array;
+}
+
+// read and verify header of v2 file
+static int
+read_stats_header(int fd, struct stats_file_header *hdr) {
+	uint32_t checksum;
+
+	if (pread_all(fd, hdr, sizeof(struct stats_file_header), 0)) {
+		fprintf(stderr, "File read error\n");
+		return 1;
+	}
+
+	checksum = hdr->checksum;
+	hdr->checksum = 0;
+	if (checksum != stats_crc32(hdr, sizeof(struct stats_file_header))) {
+		fprintf(stderr, "File corrupted, header checksum incorrect\n");
+		return 1;
+	}
+
+	if (hdr->version != FILE_VERSION) {
+		fprintf(stderr, "Unsupported file version: %u\n", hdr->version);
+		return 1;
+	}
+
+	if (hdr->record_size != sizeof(struct block_activity)
+	    || memcmp(hdr->record_layout, record_layout, sizeof(record_layout))
+	    || hdr->regions > STATS_REGIONS_MAX || hdr->len < 0) {
+		fprintf(stderr, "File format error, unsupported record layout\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+// load bitmap of touched blocks from `n`-th region of file, regions of
+// unexpected size are ignored
+static int
+read_touched_bits(struct activity_stats *activity, int fd,
+    struct stats_region *reg, uint32_t n)
+{
+	size_t words = (activity->len + 63) / 64;
+
+	if (reg->elem_size != sizeof(uint64_t) || !words || activity->touched
+	    || reg->length != sizeof(uint64_t) * words)
+		return 0;
+
+	activity->touched = malloc(reg->length);
+	if (!activity->touched) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	activity->touched_words = words;
+
+	if (pread_all(fd, activity->touched, reg->length, reg->offset)) {
+		fprintf(stderr, "File read error\n");
+		return 1;
+	}
+
+	if (reg->checksum != stats_crc32(activity->touched, reg->length)) {
+		fprintf(stderr, "File corrupted, checksum of region %u "
+			"incorrect\n", n);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int
+read_activity_stats_v2(struct activity_stats **activity, int fd) {
+	int ret = 0;
+	struct stats_file_header *hdr;
+	uint8_t *buf = NULL;
+
+	hdr = malloc(sizeof(struct stats_file_header));
+	if (!hdr) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+
+	if (read_stats_header(fd, hdr)) {
+		ret = 1;
+		goto hdr_cleanup;
+	}
+
+	*activity = new_activity_stats();
+	if (!*activity) {
+		fprintf(stderr, "Out of memory\n");
+		ret = 1;
+		goto hdr_cleanup;
+	}
+
+	(*activity)->len = hdr->len;
+	(*activity)->extent_size = hdr->extent_size;
+	(*activity)->generation = hdr->generation;
+	(*activity)->base_generation = hdr->generation;
+	memcpy((*activity)->vg_name, hdr->vg_name, STATS_NAME_LEN);
+	(*activity)->vg_name[STATS_NAME_LEN - 1] = '\0';
+	memcpy((*activity)->lv_name, hdr->lv_name, STATS_NAME_LEN);
+	(*activity)->lv_name[STATS_NAME_LEN - 1] = '\0';
+
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	for (uint32_t i=0; i < hdr->regions; i++) {
+		struct stats_region *reg = &hdr->region[i];
+
+		if (reg->id == SECTION_TOUCHED) {
+			ret = read_touched_bits(*activity, fd, reg, i);
+			if (ret)
+				goto activity_cleanup;
+			continue;
+		}
+
+		// unknown or incompatible regions are skipped
+		void **array = region_array(*activity, reg, hdr->len);
+		if (!array || !reg->length || !hdr->len || *array)
+			continue;
+
+		size_t elem_size = reg->elem_size & ~REGION_COMPRESSED;
+
+		if (reg->elem_size & REGION_COMPRESSED)
+			buf = malloc(reg->length);
+		*array = malloc(elem_size * hdr->len);
+		if (!*array || ((reg->elem_size & REGION_COMPRESSED) && !buf)) {
+			fprintf(stderr, "Out of memory\n");
+			ret = 1;
+			goto activity_cleanup;
+		}
+
+		uint8_t *data = buf ? buf : *array;
+
+		if (pread_all(fd, data, reg->length, reg->offset)) {
+			fprintf(stderr, "File read error\n");
+			ret = 1;
+			goto activity_cleanup;
+		}
+
+		if (reg->checksum != stats_crc32(data, reg->length)) {
+			fprintf(stderr, "File corrupted, checksum of region %i "
+				"incorrect\n", i);
+			ret = 1;
+			goto activity_cleanup;
+		}
+
+		if (buf) {
+			if (decode_stats_region(reg->id, elem_size, buf,
+					reg->length, hdr->len, *array)) {
+				fprintf(stderr, "File corrupted, can't decode "
+					"region %i\n", i);
+				ret = 1;
+				goto activity_cleanup;
+			}
+			free(buf);
+			buf = NULL;
+		}
+	}
+
+	if ((*activity)->len && !(*activity)->block) {
+		fprintf(stderr, "File format error, no block records\n");
+		ret = 1;
+		goto activity_cleanup;
+	}
+
+	goto hdr_cleanup;
+
+activity_cleanup:
+	destroy_activity_stats(*activity);
+	*activity = NULL;
+
+hdr_cleanup:
+	free(hdr);
+	free(buf);
+
+	return ret;
+}
+
+/*
+ * Journal keeps blocks changed between full saves of statistics. It's a
+ * sequence of entries, each being a header, table of regions (with offsets
+ * relative to start of entry) and region data: numbers of saved blocks
+ * followed by their records and optional per-block data.
+ */
+#define JOURNAL_MAGIC 0xefabb86c6e726a6cULL
+#define SECTION_INDEX 0x7865646e696b6c62ULL
+
+struct journal_header {
+	uint64_t magic;
+	uint32_t regions;
+	uint32_t checksum; /**< CRC32 of header and region table */
+	uint64_t base_generation; /**< generation of stats file entry applies to */
+	uint64_t generation;
+	int64_t len; /**< number of blocks in statistics */
+	uint64_t count; /**< number of blocks saved in entry */
+	uint64_t size; /**< size of whole entry in bytes */
+};
+
+char *
+get_journal_file_name(const char *file)
+{
+	char *ret = NULL;
+
+	if (asprintf(&ret, "%s.journal", file) == -1)
+		return NULL;
+
+	return ret;
+}
+
+// append whole buffer to file opened with O_APPEND
+static int
+write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+
+	while (len) {
+		ssize_t n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return EIO;
+		}
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+// copy data of blocks listed in index to consecutive elements of dst
+static void
+gather_blocks(void *dst, const void *array, size_t elem_size,
+    const uint64_t *index, size_t count)
+{
+	for (size_t i=0; i < count; i++)
+		memcpy((char *)dst + i * elem_size,
+			(const char *)array + index[i] * elem_size, elem_size);
+}
+
+int
+append_activity_journal(struct activity_stats *activity, char *journal) {
+
+	assert(activity);
+	assert(journal);
+	assert(STATS_SECTIONS_NUM + 2 <= STATS_REGIONS_MAX);
+
+	int ret = 0;
+	int fd = -1;
+	size_t count = 0;
+	size_t size;
+	char *buf = NULL;
+	struct journal_header *jh;
+	struct stats_region *reg;
+	uint64_t *index;
+	struct stat st;
+
+	pthread_mutex_lock(&activity->mutex);
+
+	// groups are saved too, refresh them from co-access sketch
+	ret = update_coaccess_groups(activity);
+	if (ret)
+		goto unlock;
+
+	for (size_t i=0; i < activity->dirty_words; i++)
+		count += __builtin_popcountll(activity->dirty[i]);
+
+	if (!count)
+		goto unlock;
+
+	// header, index and block records are always present
+	uint32_t regions = 2;
+	size = sizeof(uint64_t) * count + sizeof(struct block_activity) * count;
+	for (size_t i=0; i < STATS_SECTIONS_NUM; i++) {
+		if (!*section_array(activity, &stats_sections[i]))
+			continue;
+		regions++;
+		size += stats_sections[i].elem_size * count;
+	}
+	size += sizeof(struct journal_header)
+		+ sizeof(struct stats_region) * regions;
+
+	buf = calloc(1, size);
+	if (!buf) {
+		ret = ENOMEM;
+		goto unlock;
+	}
+
+	jh = (struct journal_header *)buf;
+	jh->magic = JOURNAL_MAGIC;
+	jh->regions = regions;
+	jh->base_generation = activity->base_generation;
+	jh->generation = activity->generation + 1;
+	jh->len = activity->len;
+	jh->count = count;
+	jh->size = size;
+
+	reg = (struct stats_region *)(buf + sizeof(struct journal_header));
+	reg[0].id = SECTION_INDEX;
+	reg[0].elem_size = sizeof(uint64_t);
+	reg[0].offset = sizeof(struct journal_header)
+		+ sizeof(struct stats_region) * regions;
+	reg[0].length = sizeof(uint64_t) * count;
+
+	index = (uint64_t *)(buf + reg[0].offset);
+	count = 0;
+	for (size_t i=0; i < activity->dirty_words; i++) {
+		uint64_t word = activity->dirty[i];
+		while (word) {
+			index[count++] = i * 64 + __builtin_ctzll(word);
+			word &= word - 1;
+		}
+	}
+
+	reg[1].id = SECTION_BLOCKS;
+	reg[1].elem_size = sizeof(struct block_activity);
+	reg[1].offset = reg[0].offset + reg[0].length;
+	reg[1].length = sizeof(struct block_activity) * count;
+	gather_blocks(buf + reg[1].offset, activity->block,
+		sizeof(struct block_activity), index, count);
+
+	for (size_t i=0, r=2; i < STATS_SECTIONS_NUM; i++) {
+		void *array = *section_array(activity, &stats_sections[i]);
+		if (!array)
+			continue;
+		reg[r].id = stats_sections[i].id;
+		reg[r].elem_size = stats_sections[i].elem_size;
+		reg[r].offset = reg[r-1].offset + reg[r-1].length;
+		reg[r].length = stats_sections[i].elem_size * count;
+		gather_blocks(buf + reg[r].offset, array,
+			stats_sections[i].elem_size, index, count);
+		r++;
+	}
+
+	for (uint32_t r=0; r < regions; r++)
+		reg[r].checksum = stats_crc32(buf + reg[r].offset, reg[r].length);
+	jh->checksum = stats_crc32(buf, reg[0].offset);
+
+	fd = open(journal, O_WRONLY | O_APPEND | O_CREAT, 0644);
+	if (fd < 0 || fstat(fd, &st)) {
+		ret = EIO;
+		goto unlock;
+	}
+
+	ret = write_all(fd, buf, size);
+	if (!ret && fdatasync(fd))
+		ret = EIO;
+	if (ret) {
+		// don't leave partial entry, later ones wouldn't be read
+		if (ftruncate(fd, st.st_size))
+			activity->base_generation = 0;
+		goto unlock;
+	}
+
+	clear_dirty_blocks(activity);
+	activity->generation++;
+
+unlock:
+	pthread_mutex_unlock(&activity->mutex);
+
+	if (fd >= 0)
+		close(fd);
+	free(buf);
+
+	return ret;
+}
+
+// apply changes from journal entry to statistics
+static int
+apply_journal_entry(struct activity_stats *activity, char *buf)
+{
+	struct journal_header *jh = (struct journal_header *)buf;
+	struct stats_region *reg;
+	uint64_t *index;
+
+	reg = (struct stats_region *)(buf + sizeof(struct journal_header));
+	if (jh->regions < 2 || reg[0].id != SECTION_INDEX
+	    || reg[0].elem_size != sizeof(uint64_t)
+	    || reg[0].length != sizeof(uint64_t) * jh->count)
+		return 0;
+	index = (uint64_t *)(buf + reg[0].offset);
+
+	if (jh->len > 0 && extend_activity_stats(activity, jh->len - 1))
+		return ENOMEM;
+
+	for (uint32_t r=1; r < jh->regions; r++) {
+		// unknown or incompatible regions are skipped
+		void **array = region_array(activity, &reg[r], jh->count);
+		if (!array || (reg[r].elem_size & REGION_COMPRESSED))
+			continue;
+
+		if (!*array) {
+			*array = calloc(reg[r].elem_size, activity->len);
+			if (!*array)
+				return ENOMEM;
+		}
+
+		for (size_t i=0; i < jh->count; i++) {
+			if (index[i] >= activity->len)
+				continue;
+			memcpy((char *)*array + index[i] * reg[r].elem_size,
+				buf + reg[r].offset + i * reg[r].elem_size,
+				reg[r].elem_size);
+		}
+	}
+
+	for (size_t i=0; i < jh->count; i++)
+		if (index[i] < activity->len
+		    && mark_block_touched(activity, index[i]))
+			return ENOMEM;
+
+	activity->generation = jh->generation;
+
+	return 0;
+}
+
+// read journal entry at offset, returns 1 if it's damaged, -1 at end of file
+static int
+read_journal_entry(int fd, off_t off, char **buf)
+{
+	struct {
+		struct journal_header jh;
+		struct stats_region reg[STATS_REGIONS_MAX];
+	} table;
+	struct stats_region *reg;
+	ssize_t n;
+	uint32_t checksum;
+	size_t table_size;
+
+	n = pread(fd, &table.jh, sizeof(struct journal_header), off);
+	if (n == 0)
+		return -1;
+	if (n != sizeof(struct journal_header) || table.jh.magic != JOURNAL_MAGIC
+	    || table.jh.regions > STATS_REGIONS_MAX)
+		return 1;
+
+	// verify header before trusting the size of entry
+	table_size = sizeof(struct journal_header)
+		+ sizeof(struct stats_region) * table.jh.regions;
+	if (pread_all(fd, &table, table_size, off))
+		return 1;
+
+	checksum = table.jh.checksum;
+	table.jh.checksum = 0;
+	if (checksum != stats_crc32(&table, table_size)
+	    || table.jh.size < table_size)
+		return 1;
+
+	*buf = malloc(table.jh.size);
+	if (!*buf)
+		return ENOMEM;
+
+	if (pread_all(fd, *buf, table.jh.size, off))
+		return 1;
+
+	reg = (struct stats_region *)(*buf + sizeof(struct journal_header));
+	for (uint32_t r=0; r < table.jh.regions; r++) {
+		if (reg[r].offset < table_size || reg[r].offset > table.jh.size
+		    || reg[r].length > table.jh.size - reg[r].offset)
+			return 1;
+		if (reg[r].checksum
+		    != stats_crc32(*buf + reg[r].offset, reg[r].length))
+			return 1;
+	}
+
+	return 0;
+}
+
+// apply entries of journal written since activity was saved in full
+static int
+replay_activity_journal(struct activity_stats *activity, const char *journal)
+{
+	int fd;
+	int ret = 0;
+	off_t off = 0;
+	char *buf;
+
+	fd = open(journal, O_RDONLY);
+	if (fd < 0)
+		return errno == ENOENT ? 0 : EIO;
+
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	while (1) {
+		buf = NULL;
+		ret = read_journal_entry(fd, off, &buf);
+		if (ret)
+			break;
+
+		struct journal_header *jh = (struct journal_header *)buf;
+
+		// entries written before last full save are stale
+		if (jh->base_generation == activity->base_generation
+		    && jh->generation > activity->generation) {
+			ret = apply_journal_entry(activity, buf);
+			if (ret)
+				break;
+		}
+
+		off += jh->size;
+		free(buf);
+	}
+	free(buf);
+
+	if (ret == 1) {
+		fprintf(stderr, "Journal \"%s\" damaged, ignoring rest of it\n",
+			journal);
+		// new entries would end up after damaged one, start over
+		activity->base_generation = 0;
+	}
+
+	close(fd);
+
+	return ret > 0 && ret != 1 ? ret : 0;
+}
+
+// apply journal kept together with statistics file
+static int
+replay_file_journal(struct activity_stats *activity, const char *file)
+{
+	int ret = 0;
+	char *journal = get_journal_file_name(file);
+
+	if (!journal) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+
+	if (replay_activity_journal(activity, journal)) {
+		fprintf(stderr, "Journal read error\n");
+		ret = 1;
+	}
+	free(journal);
+
+	return ret;
+}
+
+int
+read_activity_stats(struct activity_stats **activity, char *file) {
+	assert(activity);
+	int ret = 0;
+	char *tmp = NULL;
+	int fd;
+	FILE *f;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		if (asprintf(&tmp, "Can't open file \"%s\"", file) == -1) {
+			fprintf(stderr, "Out of memory\n");
+			return 1;
+		}
+		perror(tmp);
+		free(tmp);
+		return 1;
+	}
+
+	uint64_t magic;
+
+	if (pread_all(fd, &magic, sizeof(uint64_t), 0)) {
+		fprintf(stderr, "File read error\n");
+		close(fd);
+		return 1;
+	}
+
+	switch (magic) {
+	case FILE_MAGIC_V2:
+		ret = read_activity_stats_v2(activity, fd);
+		if (ret || !(*activity)->base_generation)
+			break;
+
+		ret = replay_file_journal(*activity, file);
+		if (ret) {
+			destroy_activity_stats(*activity);
+			*activity = NULL;
+		}
+		break;
+	case FILE_MAGIC:
+		f = fdopen(fd, "r");
+		if (!f) {
+			fprintf(stderr, "Out of memory\n");
+			ret = 1;
+			break;
+		}
+		fseek(f, sizeof(uint64_t), SEEK_SET);
+		ret = read_activity_stats_v1(activity, f);
+		fclose(f);
+		fd = -1;
+		break;
+	case OLD_MAGIC:
+		fprintf(stderr, "Old file format detected. Remove the file and generate new data\n");
+		ret = 1;
+		break;
+	default:
+		fprintf(stderr, "File format error, magic value incorrect\n");
+		ret = 1;
+		break;
+	}
+
+	if (fd >= 0)
+		close(fd);
+
+	if (ret)
+		return ret;
+
+	// older files don't record which blocks were accessed
+	if ((!(*activity)->touched && index_touched_blocks(*activity))
+	    || summarize_activity_stats(*activity)) {
+		fprintf(stderr, "Out of memory\n");
+		destroy_activity_stats(*activity);
+		*activity = NULL;
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Streaming of stats files: records are read in pieces and passed to
+ * a callback, without allocating the whole table
+ */
+
+/** record of block from journal, overriding the one in stats file */
+struct block_override {
+	int64_t off;
+	uint64_t seq; /**< position in journal, later records win */
+	struct block_activity ba;
+};
+
+struct record_stream {
+	block_record_fn fn;
+	chunk_filter_fn filter;
+	void *arg;
+	struct block_activity *summary; /**< NULL if file has no summaries */
+	struct block_override *ovr; /**< sorted by block */
+	size_t ovr_len;
+	size_t ovr_pos;
+	int64_t ovr_blocks; /**< number of blocks according to journal */
+};
+
+static int
+compare_overrides(const void *a, const void *b)
+{
+	const struct block_override *x = a, *y = b;
+
+	if (x->off != y->off)
+		return x->off < y->off ? -1 : 1;
+	if (x->seq != y->seq)
+		return x->seq < y->seq ? -1 : 1;
+	return 0;
+}
+
+// collect block records from journal entries that apply to stats file of
+// provided generation, keeping only the latest record of every block
+static int
+read_journal_overrides(const char *journal, uint64_t base_generation,
+    struct record_stream *rs)
+{
+	int fd;
+	int ret = 0;
+	off_t off = 0;
+	char *buf;
+	uint64_t generation = base_generation;
+	size_t alloc = 0;
+
+	fd = open(journal, O_RDONLY);
+	if (fd < 0)
+		return errno == ENOENT ? 0 : EIO;
+
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	while (1) {
+		buf = NULL;
+		ret = read_journal_entry(fd, off, &buf);
+		if (ret)
+			break;
+
+		struct journal_header *jh = (struct journal_header *)buf;
+		struct stats_region *reg =
+			(struct stats_region *)(buf + sizeof(struct journal_header));
+		off += jh->size;
+
+		if (jh->base_generation != base_generation
+		    || jh->generation <= generation || jh->regions < 2
+		    || reg[0].id != SECTION_INDEX
+		    || reg[0].length != sizeof(uint64_t) * jh->count
+		    || reg[1].id != SECTION_BLOCKS
+		    || reg[1].elem_size != sizeof(struct block_activity)
+		    || reg[1].length != sizeof(struct block_activity) * jh->count) {
+			free(buf);
+			continue;
+		}
+		generation = jh->generation;
+		if (jh->len > rs->ovr_blocks)
+			rs->ovr_blocks = jh->len;
+
+		if (rs->ovr_len + jh->count > alloc) {
+			alloc = (rs->ovr_len + jh->count) * 2;
+			struct block_override *tmp =
+				realloc(rs->ovr, sizeof(struct block_override) * alloc);
+			if (!tmp) {
+				ret = ENOMEM;
+				break;
+			}
+			rs->ovr = tmp;
+		}
+
+		uint64_t *index = (uint64_t *)(buf + reg[0].offset);
+		struct block_activity *ba =
+			(struct block_activity *)(buf + reg[1].offset);
+		for (size_t i=0; i < jh->count; i++) {
+			struct block_override *bo = &rs->ovr[rs->ovr_len];
+			bo->off = index[i];
+			bo->seq = rs->ovr_len;
+			bo->ba = ba[i];
+			rs->ovr_len++;
+		}
+
+		free(buf);
+	}
+	free(buf);
+	close(fd);
+
+	if (ret == 1)
+		fprintf(stderr, "Journal \"%s\" damaged, ignoring rest of it\n",
+			journal);
+	if (ret > 0 && ret != 1)
+		return ret;
+
+	qsort(rs->ovr, rs->ovr_len, sizeof(struct block_override),
+		compare_overrides);
+
+	// keep only the last record of each block
+	size_t n = 0;
+	for (size_t i=0; i < rs->ovr_len; i++) {
+		if (i + 1 < rs->ovr_len && rs->ovr[i + 1].off == rs->ovr[i].off)
+			continue;
+		rs->ovr[n++] = rs->ovr[i];
+	}
+	rs->ovr_len = n;
+
+	return 0;
+}
+
+// pass records of consecutive blocks, starting with `off`, to callback,
+// replacing them with records from journal
+static int
+emit_block_records(struct record_stream *rs, int64_t off,
+    const struct block_activity *ba, size_t n)
+{
+	int ret;
+
+	for (size_t i=0; i < n; i++, off++) {
+		const struct block_activity *rec = &ba[i];
+
+		while (rs->ovr_pos < rs->ovr_len && rs->ovr[rs->ovr_pos].off < off)
+			rs->ovr_pos++;
+		if (rs->ovr_pos < rs->ovr_len && rs->ovr[rs->ovr_pos].off == off)
+			rec = &rs->ovr[rs->ovr_pos].ba;
+
+		ret = rs->fn(rs->arg, off, rec);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+// chunk of `n` blocks starting with `off` is rejected by filter and journal
+// doesn't change any of its blocks
+static int
+skip_chunk(struct record_stream *rs, int64_t off, size_t n)
+{
+	if (!rs->summary)
+		return 0;
+
+	while (rs->ovr_pos < rs->ovr_len && rs->ovr[rs->ovr_pos].off < off)
+		rs->ovr_pos++;
+	if (rs->ovr_pos < rs->ovr_len
+	    && rs->ovr[rs->ovr_pos].off < off + (int64_t)n)
+		return 0;
+
+	return rs->filter(rs->arg, off, &rs->summary[off / CHUNK_BLOCKS]);
+}
+
+// pass untouched blocks from `off` up to `end` to callback
+static int
+emit_zeroed_records(struct record_stream *rs, int64_t off, int64_t end)
+{
+	struct block_activity zero[64];
+	int ret;
+
+	memset(zero, 0, sizeof(zero));
+
+	while (off < end) {
+		size_t n = end - off > 64 ? 64 : end - off;
+		ret = emit_block_records(rs, off, zero, n);
+		if (ret)
+			return ret;
+		off += n;
+	}
+
+	return 0;
+}
+
+static int
+stream_blocks_v1(FILE *f, struct record_stream *rs)
+{
+	unsigned char *buf;
+	struct block_activity *ba;
+	uint64_t len;
+	size_t want, n = 0;
+	int64_t off = 0;
+	int ret = 0;
+
+	if (fread(&len, sizeof(uint64_t), 1, f) != 1)
+		return EIO;
+	fseek(f, sizeof(int32_t)*3, SEEK_CUR);
+
+	buf = malloc(V1_RECORD_SIZE * V1_CHUNK);
+	ba = malloc(sizeof(struct block_activity) * V1_CHUNK);
+	if (!buf || !ba) {
+		ret = ENOMEM;
+		goto cleanup;
+	}
+
+	for (; off < len; off += n) {
+		want = len - off > V1_CHUNK ? V1_CHUNK : len - off;
+
+		n = fread(buf, V1_RECORD_SIZE, want, f);
+		unpack_blocks_v1(ba, buf, n);
+		ret = emit_block_records(rs, off, ba, n);
+		if (ret)
+			goto cleanup;
+
+		if (n != want) {
+			if (ferror(f))
+				ret = EIO;
+			else
+				off += n;
+			break;
+		}
+	}
+
+	// missing records in truncated file are untouched blocks
+	if (!ret)
+		ret = emit_zeroed_records(rs, off, len);
+
+cleanup:
+	free(buf);
+	free(ba);
+
+	return ret;
+}
+
+// stream records of uncompressed region, dropping them from page cache
+// once used
+static int
+stream_plain_blocks(int fd, struct stats_region *reg, int64_t len,
+    struct record_stream *rs)
+{
+	struct block_activity *ba;
+	uint32_t crc = 0;
+	int ret = 0;
+
+	ba = malloc(sizeof(struct block_activity) * STATS_CHUNK);
+	if (!ba)
+		return ENOMEM;
+
+	for (int64_t off=0; off < len && !ret; off += STATS_CHUNK) {
+		size_t n = len - off > STATS_CHUNK ? STATS_CHUNK : len - off;
+		off_t pos = reg->offset + off * sizeof(struct block_activity);
+
+		if (pread_all(fd, ba, n * sizeof(struct block_activity), pos)) {
+			ret = EIO;
+			break;
+		}
+		crc = stats_crc32_update(crc, ba, n * sizeof(struct block_activity));
+		posix_fadvise(fd, pos, n * sizeof(struct block_activity),
+			POSIX_FADV_DONTNEED);
+
+		// skipped chunks are still read, to verify the checksum
+		if (!skip_chunk(rs, off, n))
+			ret = emit_block_records(rs, off, ba, n);
+	}
+
+	if (!ret && crc != reg->checksum)
+		ret = EIO;
+
+	free(ba);
+	return ret;
+}
+
+// stream records of compressed region, chunk by chunk
+static int
+stream_compressed_blocks(int fd, struct stats_region *reg, int64_t len,
+    struct record_stream *rs)
+{
+	struct stats_chunk index[STATS_ALIGN / sizeof(struct stats_chunk)];
+	const size_t index_step = STATS_ALIGN / sizeof(struct stats_chunk);
+	size_t elem_size = sizeof(struct block_activity);
+	uint64_t chunks;
+	uint64_t pos;
+	uint8_t *cbuf = NULL;
+	size_t cbuf_len = 0;
+	uint8_t *encoded;
+	struct block_activity *ba;
+	// index and chunk data are read interleaved, so their checksums are
+	// calculated separately and combined at the end
+	uint32_t crc = 0;
+	uint32_t data_crc = 0;
+	int ret = 0;
+
+	encoded = malloc(ENCODED_CHUNK_MAX(elem_size));
+	ba = malloc(elem_size * STATS_CHUNK);
+	if (!encoded || !ba) {
+		ret = ENOMEM;
+		goto cleanup;
+	}
+
+	if (pread_all(fd, &chunks, sizeof(uint64_t), reg->offset)
+	    || chunks != (len + STATS_CHUNK - 1) / STATS_CHUNK) {
+		ret = EIO;
+		goto cleanup;
+	}
+	crc = stats_crc32_update(crc, &chunks, sizeof(uint64_t));
+
+	// chunks follow the index, in order
+	pos = sizeof(uint64_t) + sizeof(struct stats_chunk) * chunks;
+
+	for (uint64_t c=0; c < chunks; c++) {
+		struct stats_chunk *sc = &index[c % index_step];
+
+		// index is read in pieces too
+		if (c % index_step == 0) {
+			size_t n = chunks - c > index_step ? index_step : chunks - c;
+			if (pread_all(fd, index, sizeof(struct stats_chunk) * n,
+					reg->offset + sizeof(uint64_t)
+					+ sizeof(struct stats_chunk) * c)) {
+				ret = EIO;
+				goto cleanup;
+			}
+			crc = stats_crc32_update(crc, index,
+				sizeof(struct stats_chunk) * n);
+		}
+
+		if (sc->offset != pos || sc->length > reg->length - pos
+		    || sc->encoded_length > ENCODED_CHUNK_MAX(elem_size)) {
+			ret = EIO;
+			goto cleanup;
+		}
+
+		if (sc->length > cbuf_len) {
+			free(cbuf);
+			cbuf_len = sc->length;
+			cbuf = malloc(cbuf_len);
+			if (!cbuf) {
+				ret = ENOMEM;
+				goto cleanup;
+			}
+		}
+
+		if (pread_all(fd, cbuf, sc->length, reg->offset + pos)) {
+			ret = EIO;
+			goto cleanup;
+		}
+		data_crc = stats_crc32_update(data_crc, cbuf, sc->length);
+		pos += sc->length;
+
+		size_t count = len - c * STATS_CHUNK;
+		if (count > STATS_CHUNK)
+			count = STATS_CHUNK;
+
+		if (skip_chunk(rs, c * STATS_CHUNK, count))
+			continue;
+
+		uLongf length = sc->encoded_length;
+		if (uncompress(encoded, &length, cbuf, sc->length) != Z_OK
+		    || decode_chunk(SECTION_BLOCKS, elem_size, encoded, length,
+			    (uint8_t *)ba, count)) {
+			ret = EIO;
+			goto cleanup;
+		}
+
+		ret = emit_block_records(rs, c * STATS_CHUNK, ba, count);
+		if (ret)
+			goto cleanup;
+	}
+
+	// region can be verified only after all of it was used
+	crc = crc32_combine(crc, data_crc,
+		pos - sizeof(uint64_t) - sizeof(struct stats_chunk) * chunks);
+	if (pos != reg->length || crc != reg->checksum)
+		ret = EIO;
+
+cleanup:
+	free(encoded);
+	free(ba);
+	free(cbuf);
+
+	return ret;
+}
+
+// load chunk summaries from file, if it has them
+static int
+read_stream_summary(int fd, struct stats_file_header *hdr,
+    struct record_stream *rs)
+{
+	struct stats_region *reg = NULL;
+
+	for (uint32_t i=0; i < hdr->regions; i++)
+		if (hdr->region[i].id == SECTION_SUMMARY
+		    && hdr->region[i].elem_size == sizeof(struct block_activity)
+		    && hdr->region[i].length == sizeof(struct block_activity)
+			* SUMMARY_CHUNKS(hdr->len))
+			reg = &hdr->region[i];
+	if (!reg || !reg->length)
+		return 0;
+
+	rs->summary = malloc(reg->length);
+	if (!rs->summary)
+		return ENOMEM;
+
+	if (pread_all(fd, rs->summary, reg->length, reg->offset)
+	    || stats_crc32(rs->summary, reg->length) != reg->checksum)
+		return EIO;
+
+	return 0;
+}
+
+static int
+stream_blocks_v2(int fd, const char *file, struct record_stream *rs)
+{
+	struct stats_file_header *hdr;
+	struct stats_region *reg = NULL;
+	int ret = 0;
+
+	hdr = malloc(sizeof(struct stats_file_header));
+	if (!hdr)
+		return ENOMEM;
+
+	if (read_stats_header(fd, hdr)) {
+		ret = EIO;
+		goto cleanup;
+	}
+
+	for (uint32_t i=0; i < hdr->regions; i++)
+		if (hdr->region[i].id == SECTION_BLOCKS
+		    && (hdr->region[i].elem_size & ~REGION_COMPRESSED)
+			== sizeof(struct block_activity))
+			reg = &hdr->region[i];
+
+	if (hdr->len && !reg) {
+		fprintf(stderr, "File format error, no block records\n");
+		ret = EIO;
+		goto cleanup;
+	}
+
+	if (rs->filter) {
+		ret = read_stream_summary(fd, hdr, rs);
+		if (ret)
+			goto cleanup;
+	}
+
+	if (hdr->generation) {
+		char *journal = get_journal_file_name(file);
+		if (!journal) {
+			ret = ENOMEM;
+			goto cleanup;
+		}
+		ret = read_journal_overrides(journal, hdr->generation, rs);
+		free(journal);
+		if (ret)
+			goto cleanup;
+	}
+
+	if (hdr->len) {
+		posix_fadvise(fd, reg->offset, reg->length, POSIX_FADV_SEQUENTIAL);
+
+		if (reg->elem_size & REGION_COMPRESSED)
+			ret = stream_compressed_blocks(fd, reg, hdr->len, rs);
+		else {
+			if (reg->length != sizeof(struct block_activity) * hdr->len) {
+				ret = EIO;
+				goto cleanup;
+			}
+			ret = stream_plain_blocks(fd, reg, hdr->len, rs);
+		}
+		if (ret)
+			goto cleanup;
+	}
+
+	// blocks added after the file was written are only in journal
+	ret = emit_zeroed_records(rs, hdr->len, rs->ovr_blocks);
+
+cleanup:
+	free(hdr);
+
+	return ret;
+}
+
+int
+stream_activity_stats(char *file, block_record_fn fn, void *arg)
+{
+	return stream_activity_stats_filtered(file, fn, NULL, arg);
+}
+
+int
+stream_activity_stats_filtered(char *file, block_record_fn fn,
+        chunk_filter_fn filter, void *arg)
+{
+	assert(file);
+	assert(fn);
+
+	struct record_stream rs = { .fn = fn, .filter = filter, .arg = arg };
+	uint64_t magic;
+	int ret = 0;
+	FILE *f;
+	int fd;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0)
+		return EIO;
+
+	if (pread_all(fd, &magic, sizeof(uint64_t), 0)) {
+		close(fd);
+		return EIO;
+	}
+
+	if (magic == FILE_MAGIC_V2) {
+		ret = stream_blocks_v2(fd, file, &rs);
+		close(fd);
+	} else if (magic == FILE_MAGIC) {
+		f = fdopen(fd, "r");
+		if (!f) {
+			close(fd);
+			return ENOMEM;
+		}
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		fseek(f, sizeof(uint64_t), SEEK_SET);
+		ret = stream_blocks_v1(f, &rs);
+		fclose(f);
+	} else {
+		fprintf(stderr, "File format error, magic value incorrect\n");
+		close(fd);
+		ret = EIO;
+	}
+
+	free(rs.ovr);
+	free(rs.summary);
+
+	return ret;
+}
+
+// block a is ranked lower than block b, on equal scores blocks further in
+// the volume are worse
+static int
+worse_block_score(const struct block_scores *a, const struct block_scores *b)
+{
+	if (a->score != b->score)
+		return a->score < b->score;
+	return a->offset > b->offset;
+}
+
+// restore heap property (worst block at the top) below element i
+static void
+sift_down_block_scores(struct block_scores *heap, size_t len, size_t i)
+{
+	struct block_scores tmp;
+
+	while (1) {
+		size_t worst = i;
+		size_t l = 2 * i + 1;
+		size_t r = 2 * i + 2;
+
+		if (l < len && worse_block_score(&heap[l], &heap[worst]))
+			worst = l;
+		if (r < len && worse_block_score(&heap[r], &heap[worst]))
+			worst = r;
+		if (worst == i)
+			return;
+
+		tmp = heap[i];
+		heap[i] = heap[worst];
+		heap[worst] = tmp;
+		i = worst;
+	}
+}
+
+static void
+sift_up_block_scores(struct block_scores *heap, size_t i)
+{
+	struct block_scores tmp;
+
+	while (i > 0) {
+		size_t parent = (i - 1) / 2;
+		if (!worse_block_score(&heap[i], &heap[parent]))
+			return;
+
+		tmp = heap[i];
+		heap[i] = heap[parent];
+		heap[parent] = tmp;
+		i = parent;
+	}
+}
+
+struct top_blocks {
+	struct block_scores *heap; /**< worst of the best blocks at the top */
+	size_t size;
+	size_t len;
+	struct score_params params;
+	float max_score;
+	time_t now;
+	// blocks waiting to be scored together
+	int64_t pending_off[SCORE_BATCH];
+	struct block_activity pending[SCORE_BATCH];
+	size_t pending_len;
+};
+
+static void
+push_top_block(struct top_blocks *tb, int64_t off, float score)
+{
+	struct block_scores block = { .offset = off, .score = score };
+
+	if (block.score > tb->max_score)
+		return;
+
+	if (tb->len < tb->size) {
+		tb->heap[tb->len] = block;
+		sift_up_block_scores(tb->heap, tb->len);
+		tb->len++;
+	} else if (worse_block_score(&tb->heap[0], &block)) {
+		tb->heap[0] = block;
+		sift_down_block_scores(tb->heap, tb->len, 0);
+	}
+}
+
+// push pending blocks with provided scores to heap
+static void
+push_pending_blocks(struct top_blocks *tb, const float *score)
+{
+	for (size_t i=0; i < tb->pending_len; i++)
+		push_top_block(tb, tb->pending_off[i], score[i]);
+	tb->pending_len = 0;
+}
+
+static void
+flush_top_blocks(struct top_blocks *tb)
+{
+	float score[SCORE_BATCH];
+
+	score_blocks(tb->pending, tb->pending_len, tb->now, &tb->params, score);
+	push_pending_blocks(tb, score);
+}
+
+static int
+add_top_block(void *arg, int64_t off, const struct block_activity *ba)
+{
+	struct top_blocks *tb = arg;
+
+	tb->pending_off[tb->pending_len] = off;
+	tb->pending[tb->pending_len] = *ba;
+	if (++tb->pending_len == SCORE_BATCH)
+		flush_top_blocks(tb);
+
+	return 0;
+}
+
+// score kernels are accurate to 1e-5 (relative), bound calculated in double
+// precision is raised by that much so that it stays above their results
+#define SCORE_BOUND_SLACK 1e-5
+
+// highest score any block of chunk with provided summary can have, none of
+// its blocks has higher score nor newer accesses than the summary
+static float
+chunk_score_bound(const struct block_activity *summary, time_t now,
+    const struct score_params *params)
+{
+	double read_age = now > (time_t)summary->read_time ?
+		now - (time_t)summary->read_time : 0;
+	double write_age = now > (time_t)summary->write_time ?
+		now - (time_t)summary->write_time : 0;
+
+	return (params->read_multiplier * summary->read_score
+			* exp(-read_age * params->scale)
+		+ params->write_multiplier * summary->write_score
+			* exp(-write_age * params->scale))
+		* (1 + SCORE_BOUND_SLACK);
+}
+
+// chunk has no block that would get into full heap, chunks are visited in
+// order, so its blocks would lose ties too
+static int
+skip_top_chunk(void *arg, int64_t first, const struct block_activity *summary)
+{
+	struct top_blocks *tb = arg;
+
+	// heap has to include all blocks before the chunk
+	flush_top_blocks(tb);
+
+	return tb->size && tb->len == tb->size
+		&& chunk_score_bound(summary, tb->now, &tb->params)
+			<= tb->heap[0].score;
+}
+
+// sort from most to least active, worst block goes to the end
+static void
+sort_top_blocks(struct top_blocks *tb)
+{
+	for (size_t i=tb->len; i > 1; i--) {
+		struct block_scores tmp = tb->heap[0];
+		tb->heap[0] = tb->heap[i - 1];
+		tb->heap[i - 1] = tmp;
+		sift_down_block_scores(tb->heap, i - 1, 0);
+	}
+}
+
+int
+get_best_blocks_from_file_at(char *file, struct block_scores **bs,
+        size_t size, size_t *found, int read_multiplier, int write_multiplier,
+        double mean_lifetime, float max_score, time_t now)
+{
+	assert(read_multiplier || write_multiplier);
+	assert(found);
+
+	struct top_blocks tb = {
+		.size = size,
+		.params = {
+			.read_multiplier = read_multiplier,
+			.write_multiplier = write_multiplier,
+			.scale = 1.0 / mean_lifetime },
+		.max_score = max_score,
+		// use the same time base for all blocks
+		.now = now,
+	};
+	int ret;
+
+	*found = 0;
+
+	if (!*bs)
+		*bs = malloc(sizeof(struct block_scores) * size);
+	if (!*bs)
+		return ENOMEM;
+	tb.heap = *bs;
+
+	ret = stream_activity_stats_filtered(file, add_top_block, skip_top_chunk,
+		&tb);
+	if (ret)
+		return ret;
+
+	flush_top_blocks(&tb);
+	sort_top_blocks(&tb);
+
+	*found = tb.len;
+
+	return 0;
+}
+
+int
+get_best_blocks_from_file(char *file, struct block_scores **bs, size_t size,
+        size_t *found, int read_multiplier, int write_multiplier,
+        double mean_lifetime, float max_score)
+{
+	return get_best_blocks_from_file_at(file, bs, size, found,
+		read_multiplier, write_multiplier, mean_lifetime, max_score,
+		time(NULL));
+}
+
+static int
+compare_override_block(const void *a, const void *b)
+{
+	const struct block_override *x = a, *y = b;
+
+	if (x->off != y->off)
+		return x->off < y->off ? -1 : 1;
+	return 0;
+}
+
+// rank blocks of hot index together with blocks changed in journal after the
+// index was written, journal records replace the ones in index
+static int
+rank_hot_blocks(struct top_blocks *tb, const struct hot_record *hr,
+    size_t len, const struct record_stream *rs)
+{
+	char *merged = calloc(rs->ovr_len, 1);
+	if (!merged)
+		return ENOMEM;
+
+	for (size_t i=0; i < len; i++) {
+		struct block_override key = { .off = hr[i].off };
+		struct block_override *bo = bsearch(&key, rs->ovr, rs->ovr_len,
+			sizeof(struct block_override), compare_override_block);
+
+		if (bo) {
+			merged[bo - rs->ovr] = 1;
+			add_top_block(tb, hr[i].off, &bo->ba);
+		} else
+			add_top_block(tb, hr[i].off, &hr[i].ba);
+	}
+
+	for (size_t i=0; i < rs->ovr_len; i++)
+		if (!merged[i])
+			add_top_block(tb, rs->ovr[i].off, &rs->ovr[i].ba);
+
+	flush_top_blocks(tb);
+	sort_top_blocks(tb);
+
+	free(merged);
+
+	return 0;
+}
+
+int
+read_hot_blocks(char *file, struct block_scores **bs, size_t size,
+        size_t *found, int read_multiplier, int write_multiplier,
+        double mean_lifetime)
+{
+	assert(read_multiplier || write_multiplier);
+	assert(found);
+
+	struct score_params params = {
+		.read_multiplier = read_multiplier,
+		.write_multiplier = write_multiplier,
+		.scale = 1.0 / mean_lifetime };
+	struct stats_file_header *hdr;
+	struct stats_region *reg = NULL;
+	struct hot_record *hr = NULL;
+	struct record_stream rs = { 0 };
+	time_t now = time(NULL);
+	size_t len;
+	int ret = 0;
+	int fd;
+
+	*found = 0;
+
+	hdr = malloc(sizeof(struct stats_file_header));
+	if (!hdr)
+		return ENOMEM;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		free(hdr);
+		return EIO;
+	}
+
+	if (read_stats_header(fd, hdr)) {
+		ret = EIO;
+		goto cleanup;
+	}
+
+	for (uint32_t i=0; i < hdr->regions; i++)
+		if (hdr->region[i].id == SECTION_HOT
+		    && hdr->region[i].elem_size == sizeof(struct hot_record))
+			reg = &hdr->region[i];
+	if (!reg) {
+		ret = ENOENT;
+		goto cleanup;
+	}
+
+	len = reg->length / sizeof(struct hot_record);
+	if (len > size)
+		len = size;
+
+	if (!*bs)
+		*bs = malloc(sizeof(struct block_scores) * size);
+	hr = malloc(reg->length ? reg->length : 1);
+	if (!*bs || !hr) {
+		ret = ENOMEM;
+		goto cleanup;
+	}
+
+	if (pread_all(fd, hr, reg->length, reg->offset)
+	    || stats_crc32(hr, reg->length) != reg->checksum) {
+		ret = EIO;
+		goto cleanup;
+	}
+
+	if (hdr->generation) {
+		char *journal = get_journal_file_name(file);
+		if (!journal) {
+			ret = ENOMEM;
+			goto cleanup;
+		}
+		ret = read_journal_overrides(journal, hdr->generation, &rs);
+		free(journal);
+		if (ret)
+			goto cleanup;
+	}
+
+	// order of collector is stale once blocks changed after it
+	if (rs.ovr_len) {
+		struct top_blocks tb = {
+			.heap = *bs,
+			.size = size,
+			.params = params,
+			.max_score = INFINITY,
+			.now = now,
+		};
+
+		ret = rank_hot_blocks(&tb, hr,
+			reg->length / sizeof(struct hot_record), &rs);
+		if (!ret)
+			*found = tb.len;
+		goto cleanup;
+	}
+
+	for (size_t i=0; i < len; i += SCORE_BATCH) {
+		struct block_activity ba[SCORE_BATCH];
+		float score[SCORE_BATCH];
+		size_t n = len - i > SCORE_BATCH ? SCORE_BATCH : len - i;
+
+		for (size_t j=0; j < n; j++)
+			ba[j] = hr[i + j].ba;
+		score_blocks(ba, n, now, &params, score);
+		for (size_t j=0; j < n; j++) {
+			(*bs)[i + j].offset = hr[i + j].off;
+			(*bs)[i + j].score = score[j];
+		}
+	}
+	*found = len;
+
+cleanup:
+	close(fd);
+	free(rs.ovr);
+	free(hr);
+	free(hdr);
+
+	return ret;
+}
+
+struct gained_blocks {
+	struct top_blocks tb;
+	struct activity_stats *old;
+	// old records of pending blocks
+	struct block_activity pending_old[SCORE_BATCH];
+};
+
+static void
+flush_gained_blocks(struct gained_blocks *gb)
+{
+	struct top_blocks *tb = &gb->tb;
+	float score[SCORE_BATCH];
+	float old_score[SCORE_BATCH];
+
+	score_blocks(tb->pending, tb->pending_len, tb->now, &tb->params, score);
+	score_blocks(gb->pending_old, tb->pending_len, tb->now, &tb->params,
+		old_score);
+
+	// scores decay exponentially, so what remains of the old score is
+	// exactly the part that wasn't gained between snapshots
+	for (size_t i=0; i < tb->pending_len; i++) {
+		score[i] -= old_score[i];
+		if (score[i] < 0)
+			score[i] = 0;
+	}
+
+	push_pending_blocks(tb, score);
+}
+
+static int
+add_gained_block(void *arg, int64_t off, const struct block_activity *ba)
+{
+	struct gained_blocks *gb = arg;
+	struct top_blocks *tb = &gb->tb;
+
+	tb->pending_off[tb->pending_len] = off;
+	tb->pending[tb->pending_len] = *ba;
+	if (off < gb->old->len)
+		gb->pending_old[tb->pending_len] = gb->old->block[off];
+	else
+		memset(&gb->pending_old[tb->pending_len], 0,
+			sizeof(struct block_activity));
+	if (++tb->pending_len == SCORE_BATCH)
+		flush_gained_blocks(gb);
+
+	return 0;
+}
+
+int
+get_best_blocks_between_files(char *old_file, char *new_file,
+        struct block_scores **bs, size_t size, size_t *found,
+        int read_multiplier, int write_multiplier, double mean_lifetime,
+        float max_score, time_t now)
+{
+	assert(read_multiplier || write_multiplier);
+	assert(found);
+
+	struct gained_blocks gb = {
+		.tb = {
+			.size = size,
+			.params = {
+				.read_multiplier = read_multiplier,
+				.write_multiplier = write_multiplier,
+				.scale = 1.0 / mean_lifetime },
+			.max_score = max_score,
+			.now = now,
+		},
+	};
+	int ret;
+
+	*found = 0;
+
+	if (!*bs)
+		*bs = malloc(sizeof(struct block_scores) * size);
+	if (!*bs)
+		return ENOMEM;
+	gb.tb.heap = *bs;
+
+	ret = read_activity_stats(&gb.old, old_file);
+	if (ret)
+		return ret;
+
+	ret = stream_activity_stats(new_file, add_gained_block, &gb);
+	if (!ret)
+		flush_gained_blocks(&gb);
+	destroy_activity_stats(gb.old);
+	if (ret)
+		return ret;
+
+	sort_top_blocks(&gb.tb);
+
+	*found = gb.tb.len;
+
+	return 0;
+}
+
+/*
+ * Selection of best blocks from statistics in memory: the block array is
+ * split between threads, each scoring its blocks in batches and keeping the
+ * best ones in a heap, the heaps are merged at the end. All scores use the
+ * same time. Chunks of blocks that, according to their summary, have no
+ * block better than the worst one in full heap are skipped.
+ */
+#define BEST_BLOCKS_THREADS 16
+#define BEST_BLOCKS_MIN_PER_THREAD 65536
+
+struct best_blocks_param {
+	struct top_blocks tb;
+	struct activity_stats *activity;
+	int64_t start;
+	int64_t end;
+};
+
+static void *
+best_blocks_worker(void *in)
+{
+	struct best_blocks_param *bp = in;
+	struct top_blocks *tb = &bp->tb;
+	const struct block_activity *block = bp->activity->block;
+	const struct block_activity *summary = bp->activity->summary;
+	const uint64_t *touched = bp->activity->touched;
+	float score[SCORE_BATCH];
+	int64_t run_end = bp->start;
+	int64_t off = bp->start;
+	size_t n;
+
+	// only blocks that were accessed are scored
+	for (; off < bp->end; off += n) {
+		if (off >= run_end) {
+			off = next_touched_blocks(bp->activity, off, &run_end);
+			if (off >= bp->end)
+				break;
+			if (run_end > bp->end)
+				run_end = bp->end;
+		}
+		n = run_end - off;
+
+		// rest of the chunk is skipped if none of its blocks can get
+		// into the heap
+		if (summary && skip_top_chunk(tb, off,
+				&summary[off / CHUNK_BLOCKS])) {
+			n = CHUNK_BLOCKS - off % CHUNK_BLOCKS;
+			continue;
+		}
+
+		if (n > SCORE_BATCH)
+			n = SCORE_BATCH;
+		if (n > (size_t)(CHUNK_BLOCKS - off % CHUNK_BLOCKS))
+			n = CHUNK_BLOCKS - off % CHUNK_BLOCKS;
+
+		score_blocks(&block[off], n, tb->now, &tb->params, score);
+
+		for (size_t i=0; i < n; i++) {
+			// blocks are visited in order, so on equal scores the
+			// one already in heap wins
+			if (tb->len == tb->size && score[i] <= tb->heap[0].score)
+				continue;
+			push_top_block(tb, off + i, score[i]);
+		}
+	}
+
+	// blocks never accessed have zero score, they matter only if the heap
+	// isn't full or it has blocks with zero score further in the volume
+	for (off=bp->start; touched && tb->size && off < bp->end; off++) {
+		if (tb->len == tb->size && (tb->heap[0].score > 0
+		    || tb->heap[0].offset < off))
+			break;
+		if (off / 64 >= (int64_t)bp->activity->touched_words
+		    || !(touched[off / 64] >> (off % 64) & 1))
+			push_top_block(tb, off, 0);
+	}
+
+	return NULL;
+}
+
+// number of threads worth using for selecting from `len` blocks
+static int64_t
+best_blocks_threads(int64_t len)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int64_t threads = cpus > 0 ? cpus : 1;
+
+	if (threads > len / BEST_BLOCKS_MIN_PER_THREAD)
+		threads = len / BEST_BLOCKS_MIN_PER_THREAD;
+
+	return threads < 1 ? 1 : threads;
+}
+
+// select `size` best blocks to bs, sorted from most to least active
+static int
+select_best_blocks(struct activity_stats *activity, struct block_scores *bs,
+    size_t size, size_t *found, int read_multiplier, int write_multiplier,
+    double mean_lifetime, float max_score, int64_t threads)
+{
+	struct best_blocks_param bp[BEST_BLOCKS_THREADS];
+	pthread_t thread[BEST_BLOCKS_THREADS];
+	struct top_blocks tb = {
+		.heap = bs,
+		.size = size,
+		.params = {
+			.read_multiplier = read_multiplier,
+			.write_multiplier = write_multiplier,
+			.scale = 1.0 / mean_lifetime },
+		.max_score = max_score,
+		.now = time(NULL),
+	};
+	int ret = 0;
+
+	*found = 0;
+	if (!size || !activity->len)
+		return 0;
+
+	if (threads > BEST_BLOCKS_THREADS)
+		threads = BEST_BLOCKS_THREADS;
+	if (threads > activity->len)
+		threads = activity->len;
+
+	// with single thread the result heap is used directly
+	if (threads == 1) {
+		bp[0] = (struct best_blocks_param) { .tb = tb,
+			.activity = activity, .start = 0, .end = activity->len };
+		best_blocks_worker(&bp[0]);
+		tb = bp[0].tb;
+		goto sort;
+	}
+
+	for (int64_t t=0; t < threads; t++) {
+		bp[t] = (struct best_blocks_param) { .tb = tb,
+			.activity = activity,
+			.start = activity->len * t / threads,
+			.end = activity->len * (t + 1) / threads };
+		bp[t].tb.heap = malloc(sizeof(struct block_scores) * size);
+		if (!bp[t].tb.heap)
+			ret = ENOMEM;
+	}
+	if (ret)
+		goto cleanup;
+
+	// first range is processed in this thread
+	int64_t started = 1;
+	for (; started < threads; started++)
+		if (pthread_create(&thread[started], NULL, best_blocks_worker,
+				&bp[started]))
+			break;
+
+	// as are ranges of threads that couldn't be started
+	for (int64_t t=started; t < threads; t++)
+		best_blocks_worker(&bp[t]);
+	best_blocks_worker(&bp[0]);
+
+	for (int64_t t=1; t < started; t++)
+		pthread_join(thread[t], NULL);
+
+	for (int64_t t=0; t < threads; t++)
+		for (size_t i=0; i < bp[t].tb.len; i++)
+			push_top_block(&tb, bp[t].tb.heap[i].offset,
+				bp[t].tb.heap[i].score);
+
+sort:
+	sort_top_blocks(&tb);
+	*found = tb.len;
+
+cleanup:
+	if (threads > 1)
+		for (int64_t t=0; t < threads; t++)
+			free(bp[t].tb.heap);
+
+	return ret;
+}
+
+/*
+ * Score histogram: blocks grouped in buckets by logarithm of their score,
+ * hottest bucket first. Counts and quantiles are found from bucket sizes,
+ * only blocks of the single bucket the answer falls in are looked at.
+ */
+
+// scores below 2^-SCORE_HISTOGRAM_MIN_EXP share bucket 0 with zero scores,
+// scores above range of the histogram go to the last bucket
+#define SCORE_HISTOGRAM_MIN_EXP 24
+
+// bucket is given by the exponent and top bits of mantissa of the score
+static unsigned int
+score_bucket(float score)
+{
+	union { float f; uint32_t i; } u = { .f = score };
+	int64_t bucket;
+
+	if (!(score > 0))
+		return 0;
 
-		activity->len = off + 1;
+	bucket = (int64_t)(u.i >> (23 - SCORE_HISTOGRAM_STEP_BITS))
+		- ((int64_t)(127 - SCORE_HISTOGRAM_MIN_EXP)
+			<< SCORE_HISTOGRAM_STEP_BITS);
+	if (bucket < 0)
+		return 0;
+	if (bucket >= SCORE_HISTOGRAM_BUCKETS)
+		return SCORE_HISTOGRAM_BUCKETS - 1;
 
-	} else if (activity->len <= off) {
+	return bucket;
+}
 
-		tmp = realloc(activity->block,
-				sizeof(struct block_activity) * (off + 1));
-		if (!tmp) {
-			ret = ENOMEM;
-			goto mutex_cleanup;
-		}
-		activity->block = tmp;
+struct score_histogram *
+new_score_histogram(struct activity_stats *activity, time_t now,
+        const struct score_params *params)
+{
+	struct score_histogram *hist;
+	uint64_t pos[SCORE_HISTOGRAM_BUCKETS];
+	uint8_t *bucket = NULL;
+	float *score = NULL;
+	int64_t len = activity->block ? activity->len : 0;
+	size_t alloc = len ? len : 1;
+
+	hist = calloc(sizeof(struct score_histogram), 1);
+	if (!hist)
+		return NULL;
 
-		memset(activity->block + activity->len,
-			0,
-			(off + 1 - activity->len)*sizeof(struct block_activity));
-		activity->len = off + 1;
+	hist->now = now;
+	hist->params = *params;
+	hist->len = len;
+	hist->block = malloc(sizeof(int64_t) * alloc);
+	hist->score = malloc(sizeof(float) * alloc);
+	score = malloc(sizeof(float) * alloc);
+	bucket = malloc(alloc);
+	if (!hist->block || !hist->score || !score || !bucket) {
+		free_score_histogram(hist);
+		hist = NULL;
+		goto cleanup;
 	}
 
-	if (type == T_READ)
-		add_block_activity_read(&(activity->block[off]), time, mean_lifetime, hit_score);
-	else
-		add_block_activity_write(&(activity->block[off]), time, mean_lifetime, hit_score);
-mutex_cleanup:
-	pthread_mutex_unlock(&activity->mutex);
+	if (len)
+		score_range(activity, 0, len, now, params, score);
 
-	return ret;
-}
+	for (int64_t i=0; i < len; i++) {
+		bucket[i] = score_bucket(score[i]);
+		hist->count[bucket[i]]++;
+	}
 
-int
-add_block_read(struct activity_stats *activity, int64_t off, int64_t time,
-    double mean_lifetime, double hit_score) {
+	for (unsigned int b=SCORE_HISTOGRAM_BUCKETS - 1; b > 0; b--)
+		hist->start[b - 1] = hist->start[b] + hist->count[b];
+	memcpy(pos, hist->start, sizeof(pos));
 
-	return add_block(activity, off, time, mean_lifetime, hit_score, T_READ);
-}
+	// inside buckets blocks remain sorted by offset
+	for (int64_t i=0; i < len; i++) {
+		uint64_t p = pos[bucket[i]]++;
+		hist->block[p] = i;
+		hist->score[p] = score[i];
+	}
 
-int
-add_block_write(struct activity_stats *activity, int64_t off, int64_t time,
-    double mean_lifetime, double hit_score) {
+cleanup:
+	free(score);
+	free(bucket);
 
-	return add_block(activity, off, time, mean_lifetime, hit_score, T_WRITE);
+	return hist;
 }
 
-struct block_activity*
-get_block_activity(struct activity_stats *activity, off_t off)
+void
+free_score_histogram(struct score_histogram *hist)
 {
-    return &activity->block[off];
+	if (!hist)
+		return;
+
+	free(hist->block);
+	free(hist->score);
+	free(hist);
 }
 
-// return last access time, either read or write
-time_t
-get_last_access_time(struct block_activity *ba, int type)
+uint64_t
+histogram_count_above(struct score_histogram *hist, float score)
 {
-    time_t last_access = 0;
+	unsigned int b = score_bucket(score);
+	uint64_t count = hist->start[b];
 
-    if (type == T_READ)
-        last_access = ba->read_time;
-    else
-        last_access = ba->write_time;
+	for (uint64_t i=hist->start[b]; i < hist->start[b] + hist->count[b]; i++)
+		if (hist->score[i] > score)
+			count++;
 
-    return last_access;
+	return count;
 }
 
-time_t
-get_last_read_time(struct block_activity *ba)
+// return n-th (from 0) highest score, reorders the array
+static float
+select_nth_score(float *score, size_t len, size_t n)
 {
-    return get_last_access_time(ba, T_READ);
-}
+	size_t left = 0;
+	size_t right = len;
 
-time_t
-get_last_write_time(struct block_activity *ba)
-{
-    return get_last_access_time(ba, T_WRITE);
-}
+	while (right - left > 1) {
+		float pivot = score[left + (right - left) / 2];
+		size_t higher = left;
+		size_t lower = right;
+		float tmp;
 
-float
-get_block_activity_raw_score(struct block_activity *block, int type)
-{
-    assert(type == T_READ || type == T_WRITE);
+		// partition to higher, equal and lower than pivot
+		for (size_t i=left; i < lower;) {
+			if (score[i] > pivot) {
+				tmp = score[i];
+				score[i++] = score[higher];
+				score[higher++] = tmp;
+			} else if (score[i] < pivot) {
+				tmp = score[i];
+				score[i] = score[--lower];
+				score[lower] = tmp;
+			} else
+				i++;
+		}
 
-    if (type == T_READ)
-        return block->read_score;
-    else
-        return block->write_score;
+		if (n < higher)
+			right = higher;
+		else if (n >= lower)
+			left = lower;
+		else
+			return pivot;
+	}
+
+	return score[n];
 }
 
 float
-calculate_score(float read_score,
-                time_t read_time,
-                float read_multiplier,
-                float write_score,
-                time_t write_time,
-                float write_multiplier,
-                time_t curr_time,
-                float scale)
+histogram_quantile(struct score_histogram *hist, double q)
 {
-    float score;
+	unsigned int b;
+	float *score;
+	float ret;
 
-    time_t read_diff = curr_time - read_time;
-    time_t write_diff = curr_time - write_time;
+	assert(q >= 0 && q <= 1);
 
-    float curr_read_score;
-    float curr_write_score;
+	if (!hist->len)
+		return 0;
 
-    curr_read_score = exp(-1.0 * scale * read_diff) * read_score;
-    curr_write_score = exp(-1.0 * scale * write_diff) * write_score;
+	// position of the block in order from the hottest one
+	uint64_t n = hist->len - 1 - (uint64_t)(q * (hist->len - 1));
 
-    score = curr_read_score * read_multiplier
-      + curr_write_score * write_multiplier;
+	for (b=0; b < SCORE_HISTOGRAM_BUCKETS; b++)
+		if (n >= hist->start[b] && n < hist->start[b] + hist->count[b])
+			break;
 
-    return score;
+	score = malloc(sizeof(float) * hist->count[b]);
+	if (!score)
+		return NAN;
+	memcpy(score, &hist->score[hist->start[b]],
+		sizeof(float) * hist->count[b]);
+
+	ret = select_nth_score(score, hist->count[b], n - hist->start[b]);
+
+	free(score);
+
+	return ret;
 }
 
-float
-get_block_score(struct activity_stats *activity, int64_t off, int type,
-    double mean_lifetime) {
+int
+histogram_best_blocks(struct score_histogram *hist, struct block_scores **bs,
+        size_t size, size_t *found, float max_score)
+{
+	struct top_blocks tb = { .size = size, .max_score = max_score };
 
-	double score = 0.0;
-	time_t time_diff;
+	assert(found);
+	*found = 0;
 
-    struct block_activity *ba = get_block_activity(activity, off);
+	if (!*bs)
+		*bs = malloc(sizeof(struct block_scores) * size);
+	if (!*bs)
+		return ENOMEM;
+	tb.heap = *bs;
 
-    if (type == T_READ) {
-        time_diff = time(NULL) - ba->read_time;
-        score = ba->read_score;
-    } else {
-        time_diff = time(NULL) - ba->write_time;
-        score = ba->write_score;
-    }
+	// blocks in lower buckets have lower scores than any block in heap
+	// once it is full
+	for (unsigned int b=score_bucket(max_score) + 1; b > 0 && tb.len < size;
+			b--)
+		for (uint64_t i=hist->start[b - 1];
+				i < hist->start[b - 1] + hist->count[b - 1]; i++)
+			push_top_block(&tb, hist->block[i], hist->score[i]);
 
-    if (time_diff > 0)
-	    score *= exp(-1.0 * time_diff / mean_lifetime);
+	sort_top_blocks(&tb);
+	*found = tb.len;
 
-	return score;
+	return 0;
 }
 
-float
-get_block_write_score(struct activity_stats *activity, int64_t off,
-    double mean_lifetime) {
+/*
+ * Ranking cursor: blocks of score histogram are sorted one bucket at a time,
+ * when the cursor gets to it, so successive pages cost time proportional to
+ * their size.
+ */
 
-	return get_block_score(activity, off, T_WRITE, mean_lifetime);
+// order of ranking, from the most to the least active
+static int
+compare_ranked_blocks(const void *a, const void *b)
+{
+	if (worse_block_score(a, b))
+		return 1;
+	if (worse_block_score(b, a))
+		return -1;
+	return 0;
 }
 
-float
-get_block_read_score(struct activity_stats *activity, int64_t off,
-    double mean_lifetime) {
+struct rank_cursor *
+new_rank_cursor(struct activity_stats *activity, time_t now,
+        const struct score_params *params)
+{
+	struct rank_cursor *rc;
+
+	rc = calloc(sizeof(struct rank_cursor), 1);
+	if (!rc)
+		return NULL;
+
+	rc->hist = new_score_histogram(activity, now, params);
+	if (!rc->hist) {
+		free(rc);
+		return NULL;
+	}
+	rc->bucket = -1;
 
-	return get_block_score(activity, off, T_READ, mean_lifetime);
+	return rc;
 }
 
-float
-get_raw_block_read_score(struct block_activity *ba)
+void
+free_rank_cursor(struct rank_cursor *rc)
 {
-    return get_block_activity_raw_score(ba, T_READ);
+	if (!rc)
+		return;
+
+	free_score_histogram(rc->hist);
+	free(rc->sorted);
+	free(rc);
 }
 
-float
-get_raw_block_write_score(struct block_activity *ba)
+void
+rank_cursor_seek(struct rank_cursor *rc, uint64_t rank)
 {
-    return get_block_activity_raw_score(ba, T_WRITE);
+	rc->rank = rank < (uint64_t)rc->hist->len ? rank : rc->hist->len;
 }
 
-void
-dump_activity_stats(struct activity_stats *activity) {
+// put blocks of bucket in ranking order
+static int
+sort_rank_bucket(struct rank_cursor *rc, unsigned int b)
+{
+	struct score_histogram *hist = rc->hist;
+	size_t count = hist->count[b];
+	int sorted = 1;
+
+	if (count > rc->sorted_size) {
+		struct block_scores *tmp = realloc(rc->sorted,
+			sizeof(struct block_scores) * count);
+		if (!tmp)
+			return ENOMEM;
+		rc->sorted = tmp;
+		rc->sorted_size = count;
+	}
 
-	for (size_t i=0; i<activity->len; i++) {
-		printf("block %8lu, last read:  %lu, read score:  %e\n",
-				i, activity->block[i].read_time,
-                activity->block[i].read_score);
-        printf("block %8lu, last write: %lu, write score: %e\n",
-				i, activity->block[i].write_time,
-                activity->block[i].write_score);
+	for (size_t i=0; i < count; i++) {
+		rc->sorted[i].offset = hist->block[hist->start[b] + i];
+		rc->sorted[i].score = hist->score[hist->start[b] + i];
+		if (i && worse_block_score(&rc->sorted[i - 1], &rc->sorted[i]))
+			sorted = 0;
 	}
+
+	// blocks in bucket are ordered by offset, with equal scores (like
+	// in bucket of blocks never accessed) that's the ranking already
+	if (!sorted)
+		qsort(rc->sorted, count, sizeof(struct block_scores),
+			compare_ranked_blocks);
+
+	rc->bucket = b;
+
+	return 0;
 }
 
-#define FILE_MAGIC 0xefabb773746d766cULL
-#define OLD_MAGIC 0xffabb773746d766cULL
+int
+rank_cursor_next(struct rank_cursor *rc, struct block_scores **bs,
+        size_t size, size_t *found)
+{
+	struct score_histogram *hist = rc->hist;
+	unsigned int b;
 
-static int
-write_block(struct block_activity *block, FILE *f) {
-	int n;
+	assert(found);
+	*found = 0;
+
+	if (!*bs)
+		*bs = malloc(sizeof(struct block_scores) * size);
+	if (!*bs)
+		return ENOMEM;
 
-    n = fwrite(&block->read_time, sizeof(uint64_t), 1, f);
-    if (n != 1)
-        return EIO;
-    n = fwrite(&block->read_score, sizeof(float), 1, f);
-    if (n != 1)
-        return EIO;
+	while (*found < size && rc->rank < (uint64_t)hist->len) {
+		// buckets are placed from the hottest, so unless cursor was
+		// moved back it only moves to colder ones
+		if (rc->bucket >= 0 && rc->rank >= hist->start[rc->bucket])
+			b = rc->bucket;
+		else
+			b = SCORE_HISTOGRAM_BUCKETS - 1;
+		while (rc->rank >= hist->start[b] + hist->count[b])
+			b--;
 
-    n = fwrite(&block->write_time, sizeof(uint64_t), 1, f);
-    if (n != 1)
-        return EIO;
-    n = fwrite(&block->write_score, sizeof(float), 1, f);
-    if (n != 1)
-        return EIO;
+		if ((int)b != rc->bucket && sort_rank_bucket(rc, b))
+			return ENOMEM;
+
+		size_t n = hist->start[b] + hist->count[b] - rc->rank;
+		if (n > size - *found)
+			n = size - *found;
+
+		memcpy(&(*bs)[*found], &rc->sorted[rc->rank - hist->start[b]],
+			sizeof(struct block_scores) * n);
+		*found += n;
+		rc->rank += n;
+	}
 
 	return 0;
 }
 
-static int
-read_block(struct block_activity *block, FILE *f) {
-	int n;
-	float score;
-	uint64_t time;
+char *
+get_archive_file_name(const char *dir, time_t time)
+{
+	char *ret = NULL;
 
-	clearerr(f);
+	if (asprintf(&ret, "%s/%lld" ARCHIVE_SUFFIX, dir, (long long)time) == -1)
+		return NULL;
 
-    n = fread(&time, sizeof(uint64_t), 1, f);
-    if (n != 1) {
-        if (feof(f))
-            return 2;
-        else
-            return 1;
-    }
-    n = fread(&score, sizeof(float), 1, f);
-    if (n != 1) {
-        if (feof(f))
-            return 2;
-        else
-            return 1;
-    }
-    block->read_score = score;
-    block->read_time = time;
-
-    n = fread(&time, sizeof(uint64_t), 1, f);
-    if (n != 1) {
-        if (feof(f))
-            return 2;
-        else
-            return 1;
-    }
-    n = fread(&score, sizeof(float), 1, f);
-    if (n != 1) {
-        if (feof(f))
-            return 2;
-        else
-            return 1;
-    }
-    block->write_score = score;
-    block->write_time = time;
+	return ret;
+}
 
-	return 0;
+// parse time of snapshot from its name in archive, -1 if it isn't one
+static time_t
+archive_file_time(const char *name)
+{
+	char *end;
+	long long time;
+
+	if (*name < '0' || *name > '9')
+		return -1;
+
+	errno = 0;
+	time = strtoll(name, &end, 10);
+	if (errno || strcmp(end, ARCHIVE_SUFFIX))
+		return -1;
+
+	return time;
 }
 
-int
-write_activity_stats(struct activity_stats *activity, char *file) {
+static int
+compare_times(const void *a, const void *b)
+{
+	time_t x = *(const time_t *)a;
+	time_t y = *(const time_t *)b;
 
-	assert(activity);
-	assert(file);
+	return (x > y) - (x < y);
+}
 
-	FILE *f;
+int
+list_stats_archive(const char *dir, time_t **times, size_t *count)
+{
+	assert(times);
+	assert(count);
+
+	DIR *d;
+	struct dirent *de;
+	size_t alloc = 0;
+	time_t *tmp;
 	int ret = 0;
-	char *tmp = NULL;
-	int n;
 
-	f = fopen(file, "w");
-	if (!f) {
-		if (asprintf(&tmp, "Can't open file \"%s\"", file) == -1) {
-			fprintf(stderr, "Out of memory\n");
-			return 1;
+	*times = NULL;
+	*count = 0;
+
+	d = opendir(dir);
+	if (!d)
+		return errno == ENOENT ? 0 : EIO;
+
+	while ((de = readdir(d))) {
+		time_t t = archive_file_time(de->d_name);
+		if (t < 0)
+			continue;
+
+		if (*count == alloc) {
+			alloc = alloc ? alloc * 2 : 64;
+			tmp = realloc(*times, sizeof(time_t) * alloc);
+			if (!tmp) {
+				ret = ENOMEM;
+				goto cleanup;
+			}
+			*times = tmp;
 		}
-		perror(tmp);
-		free(tmp);
-		return 1;
+		(*times)[(*count)++] = t;
 	}
 
-	uint64_t magic = FILE_MAGIC;
+	qsort(*times, *count, sizeof(time_t), compare_times);
 
-	n = fwrite(&magic, sizeof(uint64_t), 1, f);
-	if (n != 1) {
-		ret = 1;
-		goto file_cleanup;
+cleanup:
+	closedir(d);
+	if (ret) {
+		free(*times);
+		*times = NULL;
+		*count = 0;
 	}
 
-	n = fwrite(&(activity->len), sizeof(int64_t), 1, f);
-	if (n != 1) {
-		ret = 1;
-		goto file_cleanup;
-	}
+	return ret;
+}
 
-	fseek(f, sizeof(int32_t)*3, SEEK_CUR);
+char *
+find_archived_stats(const char *dir, time_t time)
+{
+	time_t *times;
+	size_t count;
+	char *ret = NULL;
 
-	pthread_mutex_lock(&activity->mutex);
+	if (list_stats_archive(dir, &times, &count))
+		return NULL;
 
-	for(size_t i=0; i<activity->len; i++) {
-		n = write_block(&(activity->block[i]), f);
-		if (n) {
-			ret = n;
+	// newest snapshot that isn't newer than asked for
+	for (size_t i=count; i > 0; i--)
+		if (times[i - 1] <= time) {
+			ret = get_archive_file_name(dir, times[i - 1]);
 			break;
 		}
-	}
 
-	pthread_mutex_unlock(&activity->mutex);
-
-file_cleanup:
-	fsync(fileno(f));
-	fclose(f);
+	free(times);
 
 	return ret;
 }
 
-// TODO optimise file format so that reading it under valgrind doesn't take
-// half a minute
-int
-read_activity_stats(struct activity_stats **activity, char *file) {
-	assert(activity);
-	int ret = 0;
-	int n;
+// copy file when it can't be linked (different file system)
+static int
+copy_stats_file(const char *src, const char *dst)
+{
+	const size_t buf_len = STATS_ALIGN * 256;
 	char *tmp = NULL;
-	FILE *f;
+	char *buf = NULL;
+	int in = -1;
+	int out = -1;
+	ssize_t n;
+	int ret = 0;
 
-	f = fopen(file, "r");
-	if (!f) {
-		if (asprintf(&tmp, "Can't open file \"%s\"", file) == -1) {
-			fprintf(stderr, "Out of memory\n");
-			return 1;
-		}
-		perror(tmp);
-		free(tmp);
-		return 1;
-	}
+	if (asprintf(&tmp, "%s.tmp", dst) == -1)
+		return ENOMEM;
 
-	uint64_t magic;
+	buf = malloc(buf_len);
+	if (!buf) {
+		ret = ENOMEM;
+		goto cleanup;
+	}
 
-	n = fread(&magic, sizeof(uint64_t), 1, f);
-	if (n != 1) {
-		fprintf(stderr, "File read error\n");
-		ret = 1;
-		goto file_cleanup;
+	in = open(src, O_RDONLY);
+	out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (in < 0 || out < 0) {
+		ret = EIO;
+		goto cleanup;
 	}
 
-    if (magic == OLD_MAGIC) {
-        fprintf(stderr, "Old file format detected. Remove the file and generate new data\n");
-        ret = 1;
-        goto file_cleanup;
-    }
+	posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
 
-	if (magic != FILE_MAGIC) {
-		fprintf(stderr, "File format error, magic value incorrect\n");
-		ret = 1;
-		goto file_cleanup;
-	}
+	while ((n = read(in, buf, buf_len)) > 0)
+		if (write_all(out, buf, n)) {
+			ret = EIO;
+			goto cleanup;
+		}
 
-	uint64_t len;
-	n = fread(&len, sizeof(uint64_t), 1, f);
-	if (n != 1) {
-		fprintf(stderr, "File read error\n");
-		ret = 1;
-		goto file_cleanup;
-	}
+	if (n < 0 || fsync(out) || rename(tmp, dst))
+		ret = EIO;
 
-	*activity = new_activity_stats_s(len-1);
-	if (!*activity) {
-		fprintf(stderr, "Out of memory\n");
-		ret = 1;
-		goto file_cleanup;
-	}
+cleanup:
+	if (in >= 0)
+		close(in);
+	if (out >= 0)
+		close(out);
+	if (ret)
+		unlink(tmp);
+	free(tmp);
+	free(buf);
 
-	fseek(f, sizeof(int32_t)*3, SEEK_CUR);
+	return ret;
+}
 
-	for(size_t i=0; i<(*activity)->len; i++) {
-		n = read_block(&((*activity)->block[i]), f);
-		if (n == 2)
-			break;
-		if (n) {
-			fprintf(stderr, "File read error\n");
-			ret = n;
-			goto activity_cleanup;
-		}
-	}
+int
+archive_activity_stats(const char *file, const char *dir, time_t retention)
+{
+	struct stats_file_header *hdr;
+	time_t *times = NULL;
+	size_t count;
+	char *name = NULL;
+	int ret = 0;
+	int fd;
 
-	goto file_cleanup;
+	hdr = malloc(sizeof(struct stats_file_header));
+	if (!hdr)
+		return ENOMEM;
 
-activity_cleanup:
-	destroy_activity_stats(*activity);
-	*activity = NULL;
+	fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		ret = EIO;
+		goto cleanup;
+	}
+	ret = read_stats_header(fd, hdr);
+	close(fd);
+	if (ret) {
+		ret = EIO;
+		goto cleanup;
+	}
 
-file_cleanup:
-	fclose(f);
+	name = get_archive_file_name(dir, hdr->time);
+	if (!name) {
+		ret = ENOMEM;
+		goto cleanup;
+	}
 
-	return ret;
-}
+	if (mkdir(dir, 0755) && errno != EEXIST) {
+		ret = EIO;
+		goto cleanup;
+	}
 
-// add data about a block, extending the bs structure (assumes that enough
-// memory has already been allocated)
-static void
-add_score_to_block_scores(struct block_scores *bs, size_t size,
-    struct block_scores *block)
-{
-  // empty set case
-  if (size == 0) {
-    memcpy(bs, block, sizeof(struct block_scores));
-    return;
-  }
-
-  // when is better than one of the elements
-  // TODO can be made n log n, instead of n^2, by using binary search instead
-  // of linear
-  for (size_t i=0; i<size; i++) {
-    if (block->score > bs[i].score) {
-      memmove(&(bs[i+1]), &(bs[i]), sizeof(struct block_scores) * (size-i));
-      memcpy(&(bs[i]), block, sizeof(struct block_scores));
-      return;
-    }
-  }
+	// stats files are replaced, never modified in place, so the snapshot
+	// can share the inode with the current file
+	if (link(file, name) && errno != EEXIST) {
+		if (errno != EXDEV && errno != EPERM) {
+			ret = EIO;
+			goto cleanup;
+		}
+		ret = copy_stats_file(file, name);
+		if (ret)
+			goto cleanup;
+	}
 
-  // when new element is worse than all others
-  memcpy(&(bs[size]), block, sizeof(struct block_scores));
+	if (!retention)
+		goto cleanup;
 
-  return;
-}
+	ret = list_stats_archive(dir, &times, &count);
+	if (ret)
+		goto cleanup;
 
-// Add new data about a block, removing the worst one off the list
-static void
-insert_score_to_block_scores(struct block_scores *bs, size_t size,
-    struct block_scores *block)
-{
-  assert(bs);
-  assert(block);
-  assert(size>0);
-
-  if (block->score < bs[size-1].score)
-    return;
-
-  // TODO can be made n log n, instead of n^2, by using binary search instead
-  // of linear
-  for (size_t i=0; i<size; i++) {
-    if (block->score > bs[i].score) {
-      memmove(&(bs[i+1]), &(bs[i]), sizeof(struct block_scores) * (size-i-1));
-      memcpy(&(bs[i]), block, sizeof(struct block_scores));
-      return;
-    }
-  }
+	for (size_t i=0; i < count && times[i] < (time_t)hdr->time - retention;
+			i++) {
+		char *old = get_archive_file_name(dir, times[i]);
+		if (!old) {
+			ret = ENOMEM;
+			goto cleanup;
+		}
+		unlink(old);
+		free(old);
+	}
 
-  return;
+cleanup:
+	free(times);
+	free(name);
+	free(hdr);
+
+	return ret;
 }
 
 // dump collected block_scores
@@ -586,37 +5430,8 @@ get_best_blocks(struct activity_stats *activity, struct block_scores **bs,
         size_t size, int read_multiplier, int write_multiplier,
         double mean_lifetime)
 {
-  assert(read_multiplier || write_multiplier);
-  int f_ret = 0;
-
-  if (!*bs)
-    *bs = malloc(sizeof(struct block_scores)*size);
-
-  if (!*bs) {
-    f_ret = 1;
-    goto no_cleanup;
-  }
-
-  struct block_scores block;
-
-  for (size_t i=0; i<size; i++) {
-    block.offset = i;
-    block.score = get_block_read_score(activity, i, mean_lifetime) * read_multiplier +
-      get_block_write_score(activity, i, mean_lifetime) * write_multiplier;
-    add_score_to_block_scores(*bs, i, &block);
-  }
-
-  for (size_t i=size; i<activity->len; i++) {
-    block.score = get_block_read_score(activity, i, mean_lifetime) * read_multiplier +
-      get_block_write_score(activity, i, mean_lifetime) * write_multiplier;
-    if (block.score > (*bs)[size-1].score) {
-      block.offset = i;
-      insert_score_to_block_scores(*bs, size, &block);
-    }
-  }
-
-no_cleanup:
-  return f_ret;
+  return get_best_blocks_with_max_score(activity, bs, size, read_multiplier,
+      write_multiplier, mean_lifetime, INFINITY);
 }
 
 /** get best n blocks with score equal and lower than provided
@@ -637,44 +5452,20 @@ get_best_blocks_with_max_score(struct activity_stats *activity,
         int write_multiplier, double mean_lifetime, float max_score)
 {
   assert(read_multiplier || write_multiplier);
-  int f_ret = 0;
+  size_t found;
 
   if (!*bs)
     *bs = malloc(sizeof(struct block_scores)*size);
 
-  if (!*bs) {
-    f_ret = 1;
-    goto no_cleanup;
-  }
-
-  struct block_scores block;
-
-  size_t count=0;
-  size_t i=0;
-  for (; count<size && count < activity->len; i++) {
-    block.offset = i;
-    block.score = get_block_read_score(activity, i, mean_lifetime) * read_multiplier +
-      get_block_write_score(activity, i, mean_lifetime) * write_multiplier;
-    if (block.score > max_score)
-	continue;
-    add_score_to_block_scores(*bs, count, &block);
-    count++;
-  }
-
-  if (count != size)
-    return f_ret; // there are less qualifying blocks in activity that places in block_scores
-
-  for (; i<activity->len; i++) {
-    block.score = get_block_read_score(activity, i, mean_lifetime) * read_multiplier +
-      get_block_write_score(activity, i, mean_lifetime) * write_multiplier;
-    if (block.score > max_score)
-	  continue;
-    if (block.score > (*bs)[size-1].score) {
-      block.offset = i;
-      insert_score_to_block_scores(*bs, size, &block);
-    }
-  }
+  if (!*bs)
+    return 1;
+
+  // there may be less qualifying blocks in activity than places in
+  // block_scores, rest of them is left untouched
+  if (select_best_blocks(activity, *bs, size, &found, read_multiplier,
+        write_multiplier, mean_lifetime, max_score,
+        best_blocks_threads(activity->len)))
+    return 1;
 
-no_cleanup:
-  return f_ret;
+  return 0;
 }
@@ -20,6 +20,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <sys/types.h>
 
 #define T_READ 1
 #define T_WRITE 2
@@ -31,10 +32,179 @@ struct block_activity {
     float    write_score;
 };
 
+/** decayed amount of data transferred, decays together with scores */
+struct block_bytes {
+    float read_bytes;
+    float write_bytes;
+};
+
+/** number of days over which the activity profile is averaged */
+#define PROFILE_MEAN_LIFETIME 28
+
+/**
+ * hour-of-day and day-of-week activity of block, decayed daily
+ */
+struct block_profile {
+    uint32_t day; /**< local day (since epoch) of last update */
+    float hour[24];
+    float weekday[7];
+};
+
+/** local time broken down for use with activity profiles */
+struct profile_time {
+    int64_t day; /**< local day since epoch */
+    int hour;
+    int wday;
+};
+
+/**
+ * Holt (double exponential) smoothing of block activity in fixed
+ * intervals
+ */
+struct block_trend {
+    uint32_t interval; /**< number of interval currently being collected */
+    float count; /**< score collected in current interval */
+    float level; /**< smoothed score per interval */
+    float trend; /**< smoothed change of score per interval */
+};
+
+/** maximum number of distinct blocks tracked in single co-access window */
+#define COACCESS_WINDOW_MAX 32
+
+/** counter of windows in which two blocks were accessed together */
+struct coaccess_pair {
+    uint32_t a; /**< smaller block number, pair is unused if a == b */
+    uint32_t b;
+    float count;
+};
+
+/**
+ * Streaming co-occurrence sketch used to find blocks accessed together
+ */
+struct coaccess {
+    int64_t window; /**< length of window in seconds */
+    float threshold; /**< co-occurrences needed to join blocks in group */
+    int64_t window_start;
+    uint32_t window_blocks[COACCESS_WINDOW_MAX];
+    size_t window_len;
+    size_t windows; /**< windows closed since counters were last aged */
+    struct coaccess_pair *pairs; /**< open addressing hash table */
+    size_t pairs_used;
+};
+
+/** parameters of block score calculation */
+struct score_params {
+    float read_multiplier;
+    float write_multiplier;
+    double scale; /**< inverse of mean lifetime of scores (in seconds) */
+};
+
+/** block in hot-set index */
+struct hot_entry {
+    double key; /**< score normalized to landmark time of index */
+    int64_t off;
+};
+
+/**
+ * Set of blocks with highest scores, updated together with the blocks
+ */
+struct hot_index {
+    struct hot_entry *heap; /**< coldest of the hot blocks at the top */
+    size_t size; /**< number of blocks returned from index */
+    size_t capacity; /**< size of heap, with reserve for blocks losing score */
+    size_t len;
+    uint32_t *pos; /**< position in heap + 1 of every block, 0 if not in it */
+    size_t pos_len;
+    struct score_params params;
+    int64_t landmark; /**< time keys are normalized to */
+};
+
+/** buckets per power of two in score histogram (log2) */
+#define SCORE_HISTOGRAM_STEP_BITS 2
+#define SCORE_HISTOGRAM_BUCKETS 256
+
+/**
+ * Scores of all blocks at single time, grouped by logarithmic buckets
+ */
+struct score_histogram {
+    time_t now;
+    struct score_params params;
+    int64_t len;
+    uint64_t count[SCORE_HISTOGRAM_BUCKETS]; /**< blocks in bucket */
+    uint64_t start[SCORE_HISTOGRAM_BUCKETS]; /**< first block of bucket */
+    int64_t *block; /**< blocks from the hottest bucket to the coldest */
+    float *score; /**< scores of blocks in above order */
+};
+
+/**
+ * Number of blocks in chunk, for every chunk highest scores and newest access
+ * times of its blocks are kept
+ */
+#define CHUNK_BLOCKS 4096
+
+/**
+ * Ranking of blocks by their score at single time, read page by page
+ */
+struct rank_cursor {
+    struct score_histogram *hist;
+    uint64_t rank; /**< rank of the next block returned */
+    int bucket; /**< bucket of histogram sorted in `sorted`, -1 if none */
+    struct block_scores *sorted; /**< blocks of `bucket` in ranking order */
+    size_t sorted_size;
+};
+
+/** maximum length of volume group and logical volume names kept in stats */
+#define STATS_NAME_LEN 128
+
 struct activity_stats {
 	struct block_activity *block;
 	int64_t len;
 	pthread_mutex_t mutex;
+	/** sectors discarded from block since last write to it, NULL if no
+	 * discards were seen */
+	uint32_t *discard;
+	/** bytes transferred to and from block, NULL if sizes of IO weren't
+	 * provided */
+	struct block_bytes *bytes;
+	/** hour-of-day and day-of-week activity, NULL if not collected */
+	struct block_profile *profile;
+	/** cached local time breakdown of last time added to profile */
+	int64_t profile_time;
+	struct profile_time profile_tm;
+	/** level and trend of activity, NULL if not collected */
+	struct block_trend *trend;
+	int64_t trend_interval; /**< length of trend interval in seconds */
+	double trend_alpha; /**< level smoothing factor */
+	double trend_beta; /**< trend smoothing factor */
+	/** group (first block of group + 1) of blocks accessed together,
+	 * 0 for blocks not in any group, NULL if not collected */
+	uint32_t *group;
+	/** co-access sketch, NULL if not collected */
+	struct coaccess *coaccess;
+	/** blocks with highest scores, NULL if not maintained */
+	struct hot_index *hot;
+	/** summaries of chunks of CHUNK_BLOCKS blocks: highest scores and
+	 * newest access times of blocks in them, NULL if not maintained */
+	struct block_activity *summary;
+	/** blocks that were ever accessed, bit per block, NULL if not
+	 * tracked */
+	uint64_t *touched;
+	size_t touched_words;
+	/** size of single block (extent) in bytes, 0 if unknown */
+	uint64_t extent_size;
+	/** volume the statistics describe, empty strings if unknown */
+	char vg_name[STATS_NAME_LEN];
+	char lv_name[STATS_NAME_LEN];
+	/** number of times the statistics were saved to file */
+	uint64_t generation;
+	/** generation of last full save of statistics, journal entries
+	 * written after it apply to it, 0 if full save is needed */
+	uint64_t base_generation;
+	/** save block records and per-block data compressed */
+	int compress;
+	/** bitmap of blocks changed since last save */
+	uint64_t *dirty;
+	size_t dirty_words;
 };
 
 struct block_scores {
@@ -59,14 +229,281 @@ int add_block_write(struct activity_stats *activity,
 		     double mean_lifetime,
              double hit_score);
 
+/**
+ * Add IO to block statistics, recording its size too
+ *
+ * @val bytes size of the IO in the block (can be weighted same as hit_score)
+ * @val type T_READ or T_WRITE
+ */
+int add_block_io(struct activity_stats *activity,
+		int64_t off,
+		int64_t time,
+		double mean_lifetime,
+		double hit_score,
+		double bytes,
+		int type);
+
+/**
+ * Add IO with provided weight (from IO flags and rules) to block statistics,
+ * both its hit score and size are multiplied by the weight, so that cost
+ * model, which counts operations as score / hit score, sees weighted IO as
+ * `weight` operations of `bytes` each
+ */
+int add_block_weighted_io(struct activity_stats *activity, int64_t off,
+		int64_t time, double mean_lifetime, double hit_score,
+		double weight, double bytes, int type);
+
+/**
+ * Start collecting hour-of-day and day-of-week activity profile of blocks
+ */
+int enable_activity_profile(struct activity_stats *activity);
+
+/**
+ * Break down time to local day, hour and day of week
+ */
+void get_profile_time(time_t time, struct profile_time *pt);
+
+/**
+ * Return expected score of block collected in the hour of day provided,
+ * taking day of week into account, 0 if profile isn't collected
+ */
+float get_block_profile_score(struct activity_stats *activity, off_t off,
+        struct profile_time *pt);
+
+/**
+ * Start collecting (or set parameters for reading) level and trend of block
+ * activity
+ *
+ * @val interval length of single interval in seconds
+ * @val alpha smoothing factor for level (0, 1]
+ * @val beta smoothing factor for trend (0, 1]
+ */
+int enable_activity_trend(struct activity_stats *activity, int64_t interval,
+        double alpha, double beta);
+
+/**
+ * Return level and trend of block activity in last completed interval
+ * before provided time, intervals without activity are taken into account
+ */
+void get_block_trend(struct activity_stats *activity, off_t off, time_t time,
+        float *level, float *trend);
+
+/**
+ * Start looking for groups of blocks accessed together
+ *
+ * @val window length of time window (in seconds) in which accesses to
+ * different blocks are considered to be together
+ * @val threshold number of windows in which blocks need to be accessed
+ * together to be grouped
+ */
+int enable_coaccess_groups(struct activity_stats *activity, int64_t window,
+        float threshold);
+
+/**
+ * (Re)build bitmap of blocks that were ever accessed from their records and
+ * maintain it from now on, needs to be called again after blocks are
+ * modified directly
+ *
+ * Passes over all blocks use it to skip blocks never accessed.
+ */
+int index_touched_blocks(struct activity_stats *activity);
+
+/**
+ * Return first block, not before `off`, that was accessed and set `run_end`
+ * to the end of run of accessed blocks starting with it, returns
+ * activity->len if there are no more such blocks
+ *
+ * All blocks are treated as accessed if they aren't tracked.
+ */
+int64_t next_touched_blocks(struct activity_stats *activity, int64_t off,
+    int64_t *run_end);
+
+/**
+ * (Re)build chunk summaries of all blocks and maintain them from now on,
+ * needs to be called again after blocks are modified directly
+ *
+ * Summaries let selection of best blocks skip chunks that have no block
+ * good enough.
+ */
+int summarize_activity_stats(struct activity_stats *activity);
+
+/**
+ * Maintain index of `size` blocks with highest scores, so that they can be
+ * returned without looking at other blocks
+ *
+ * Blocks below the hottest ones are kept in reserve, replacing blocks that
+ * lose score on discard. Once the reserve runs out, blocks outside index get
+ * in on their next access. `size` can't be larger than UINT32_MAX / 2.
+ */
+int enable_hot_index(struct activity_stats *activity, size_t size,
+        int read_multiplier, int write_multiplier, double mean_lifetime);
+
+/**
+ * Return up to `size` hottest blocks from hot-set index, sorted from most to
+ * least active
+ *
+ * @return 0 if everything is OK, EINVAL if index isn't maintained
+ */
+int get_hot_blocks(struct activity_stats *activity, struct block_scores **bs,
+        size_t size, size_t *found);
+
+/**
+ * Return up to `size` hottest blocks from hot-set index saved in stats file,
+ * scores are calculated with provided parameters, order of blocks is the one
+ * of collector (that uses its own multipliers)
+ *
+ * Blocks changed in journal of the file replace their records in index or
+ * join it, blocks are then ranked again with provided parameters.
+ *
+ * Only the index and the journal are read, not the whole file.
+ *
+ * @return 0 if everything is OK, ENOENT if file has no index
+ */
+int read_hot_blocks(char *file, struct block_scores **bs, size_t size,
+        size_t *found, int read_multiplier, int write_multiplier,
+        double mean_lifetime);
+
+/**
+ * Return first block in group of blocks accessed together with provided one,
+ * -1 if block isn't in any group
+ */
+int64_t get_block_group(struct activity_stats *activity, off_t off);
+
+/**
+ * Cool down block after part of it was discarded (TRIMmed)
+ *
+ * Scores of block are reduced proportionally to amount of data removed
+ * from it since last write, a fully discarded block has its scores zeroed.
+ *
+ * @val off block number
+ * @val sectors number of sectors discarded from the block
+ * @val block_sectors size of the block in sectors
+ */
+int add_block_discard(struct activity_stats *activity,
+		int64_t off,
+		int64_t sectors,
+		int64_t block_sectors);
+
 /* print statistics to stdout */
 void dump_activity_stats(struct activity_stats *activity);
 void print_block_scores(struct block_scores *bs, size_t size);
 
+/**
+ * Record which volume the statistics describe, saved in the stats file
+ *
+ * @val extent_size size of single block in bytes
+ */
+void set_activity_stats_volume(struct activity_stats *activity,
+        const char *vg_name, const char *lv_name, uint64_t extent_size);
+
+/**
+ * Merge statistics of the same volume collected separately, scores of every
+ * block are decayed to its newest access time and summed
+ *
+ * Trends and co-access groups are not merged.
+ *
+ * @val threads number of threads merging ranges of blocks in parallel
+ * @return 0 on success, EINVAL if stats describe different volumes
+ */
+int merge_activity_stats(struct activity_stats **merged,
+    struct activity_stats **stats, size_t count, double mean_lifetime,
+    int threads);
+
+/** header and up to 16 regions of stats file */
+#define STATS_IMAGE_PARTS 17
+
+/** part of stats file, `len` bytes to be written at `offset` */
+struct stats_image_part {
+    void *buf; /**< aligned to 4096 bytes */
+    size_t len;
+    off_t offset;
+};
+
+/**
+ * Statistics serialized in version 2 format, the last part is the header
+ * and needs to be written after all others
+ */
+struct stats_image {
+    size_t parts;
+    struct stats_image_part part[STATS_IMAGE_PARTS];
+};
+
+/**
+ * Copy statistics and serialize them to file format, the statistics are
+ * locked only while copying
+ */
+int snapshot_activity_stats(struct activity_stats *activity,
+        struct stats_image **image);
+
+void free_stats_image(struct stats_image *image);
+
+/**
+ * Note that snapshot couldn't be saved, so journal can't be based on it
+ */
+void invalidate_activity_stats_base(struct activity_stats *activity);
+
+/**
+ * Write whole buffer at provided offset, retrying short writes
+ *
+ * @return 0 on success, EIO on error
+ */
+int pwrite_all(int fd, const void *buf, size_t len, off_t off);
+
+/**
+ * Save statistics to file (in version 2 format)
+ */
 int write_activity_stats(struct activity_stats *activity, char *file);
 
+/**
+ * Read statistics from file, both version 1 and version 2 files are
+ * supported, changes saved in journal of the file are applied too
+ */
 int read_activity_stats(struct activity_stats **activity, char *file);
 
+/** function receiving block records read from stats file */
+typedef int (*block_record_fn)(void *arg, int64_t off,
+        const struct block_activity *ba);
+
+/**
+ * Pass records of all blocks in stats file to `fn`, reading the file in
+ * pieces, without loading it whole to memory, journal of the file is applied
+ * too
+ *
+ * @return 0 if everything is OK, value returned by `fn` if it was non zero
+ * (stops the reading), error code otherwise
+ */
+int stream_activity_stats(char *file, block_record_fn fn, void *arg);
+
+/**
+ * function deciding if chunk of blocks starting with block `first` can be
+ * skipped, given highest scores and newest access times of its blocks in
+ * `summary`
+ *
+ * @return non zero to skip the chunk
+ */
+typedef int (*chunk_filter_fn)(void *arg, int64_t first,
+        const struct block_activity *summary);
+
+/**
+ * Like stream_activity_stats(), but chunks of CHUNK_BLOCKS blocks rejected
+ * by `filter` aren't decoded nor passed to `fn`
+ *
+ * Files without chunk summaries are streamed whole.
+ */
+int stream_activity_stats_filtered(char *file, block_record_fn fn,
+    chunk_filter_fn filter, void *arg);
+
+/**
+ * Return name of journal file kept together with statistics file, must be
+ * freed by caller
+ */
+char *get_journal_file_name(const char *file);
+
+/**
+ * Append blocks changed since last save to journal
+ */
+int append_activity_journal(struct activity_stats *activity, char *journal);
+
 int get_best_blocks(struct activity_stats *activity, struct block_scores **bs,
     size_t size, int read_multiplier, int write_multiplier,
     double mean_lifetime);
@@ -75,6 +512,111 @@ int get_best_blocks_with_max_score(struct activity_stats *activity,
 		struct block_scores **bs, size_t size, int read_multiplier,
 		int write_multiplier, double mean_lifetime, float max_score);
 
+/**
+ * Score all blocks at time `now` and group them in score histogram, must be
+ * freed with free_score_histogram()
+ */
+struct score_histogram *new_score_histogram(struct activity_stats *activity,
+    time_t now, const struct score_params *params);
+
+void free_score_histogram(struct score_histogram *hist);
+
+/**
+ * Return number of blocks with score higher than `score`
+ */
+uint64_t histogram_count_above(struct score_histogram *hist, float score);
+
+/**
+ * Return score not lower than scores of `q` (0 to 1) of all blocks
+ */
+float histogram_quantile(struct score_histogram *hist, double q);
+
+/**
+ * Like get_best_blocks_with_max_score(), but only blocks in buckets of
+ * `max_score` and the ones below it, until `size` are found, are looked at
+ *
+ * @val found[out] number of blocks returned
+ */
+int histogram_best_blocks(struct score_histogram *hist,
+    struct block_scores **bs, size_t size, size_t *found, float max_score);
+
+/**
+ * Rank all blocks by score at time `now`, from the most active one, blocks
+ * with equal scores are ranked by their number, must be freed with
+ * free_rank_cursor()
+ */
+struct rank_cursor *new_rank_cursor(struct activity_stats *activity,
+    time_t now, const struct score_params *params);
+
+void free_rank_cursor(struct rank_cursor *rc);
+
+/**
+ * Move cursor to block with provided rank (0 is the most active block)
+ */
+void rank_cursor_seek(struct rank_cursor *rc, uint64_t rank);
+
+/**
+ * Return next `size` blocks in ranking and move the cursor past them
+ *
+ * @val found[out] number of blocks returned, 0 at the end of ranking
+ */
+int rank_cursor_next(struct rank_cursor *rc, struct block_scores **bs,
+    size_t size, size_t *found);
+
+/**
+ * Return "size" best blocks with score equal or lower than `max_score` from
+ * stats file, reading it in pieces, using memory proportional to `size` only
+ *
+ * @val found[out] number of blocks returned, lower than size if the file has
+ * less blocks
+ */
+int get_best_blocks_from_file(char *file, struct block_scores **bs,
+    size_t size, size_t *found, int read_multiplier, int write_multiplier,
+    double mean_lifetime, float max_score);
+
+/**
+ * Like get_best_blocks_from_file() but with scores calculated for time `now`
+ */
+int get_best_blocks_from_file_at(char *file, struct block_scores **bs,
+    size_t size, size_t *found, int read_multiplier, int write_multiplier,
+    double mean_lifetime, float max_score, time_t now);
+
+/**
+ * Return "size" blocks that gained highest score between saving `old_file`
+ * and `new_file`, with scores calculated for time `now`
+ *
+ * Older file is loaded to memory, the newer one is streamed.
+ */
+int get_best_blocks_between_files(char *old_file, char *new_file,
+    struct block_scores **bs, size_t size, size_t *found,
+    int read_multiplier, int write_multiplier, double mean_lifetime,
+    float max_score, time_t now);
+
+/**
+ * Return name of snapshot taken at `time` in archive directory `dir`, must be
+ * freed by caller
+ */
+char *get_archive_file_name(const char *dir, time_t time);
+
+/**
+ * Add (version 2) stats file to archive in directory `dir`, removing
+ * snapshots taken more than `retention` seconds before it (0 keeps all)
+ */
+int archive_activity_stats(const char *file, const char *dir,
+    time_t retention);
+
+/**
+ * Return times of snapshots in archive, oldest first, array must be freed
+ * by caller
+ */
+int list_stats_archive(const char *dir, time_t **times, size_t *count);
+
+/**
+ * Return name of newest snapshot in archive taken not later than `time`,
+ * NULL if there's none, must be freed by caller
+ */
+char *find_archived_stats(const char *dir, time_t time);
+
 /**
  * returns reference to activity stats from single block
  */
@@ -101,6 +643,51 @@ float get_raw_block_write_score(struct block_activity *ba);
  */
 time_t get_last_write_time(struct block_activity *ba);
 
+/**
+ * return decayed number of bytes read from block, not adjusted for current
+ * time (decays together with read score)
+ */
+float get_block_read_bytes(struct activity_stats *activity, off_t off);
+
+/**
+ * return decayed number of bytes written to block, not adjusted for current
+ * time (decays together with write score)
+ */
+float get_block_write_bytes(struct activity_stats *activity, off_t off);
+
+/**
+ * Calculate scores of `count` blocks at time `now`, decayed and weighted
+ * according to `params`, to `out`
+ *
+ * Uses vector instructions (AVX2, AVX-512) when CPU supports them.
+ */
+void score_blocks(const struct block_activity *block, size_t count,
+    time_t now, const struct score_params *params, float *out);
+
+/**
+ * Calculate scores of `count` blocks starting with block `first`
+ */
+void score_range(struct activity_stats *activity, int64_t first,
+    size_t count, time_t now, const struct score_params *params, float *out);
+
+/**
+ * Give neighbouring blocks a share of the score of each block (`share` for
+ * adjacent, `share`^2 for next ones and so on up to `radius` blocks away),
+ * `score` holds scores of `len` blocks starting with block 0
+ *
+ * @return 0 if everything is OK, ENOMEM on lack of memory
+ */
+int smooth_block_scores(float *score, size_t len, float share, size_t radius);
+
+/**
+ * Set scores of blocks in co-access groups to the average score of their
+ * group, `score` holds scores of `len` blocks starting with block 0
+ *
+ * @return 0 if everything is OK, ENOMEM on lack of memory
+ */
+int set_group_block_scores(struct activity_stats *activity, float *score,
+    size_t len);
+
 /**
  * calculate block score at provided time
  */
@@ -21,575 +21,1374 @@
 #include <stdlib.h>
 #include "activity_stats.c"
 
-START_TEST(add_block_test)
+// heap of `size` best blocks, as used by selection of best blocks
+static void
+init_top_blocks(struct top_blocks *tb, struct block_scores *heap, size_t size)
 {
-  size_t size = 10;
-  size_t elems = 0;
-  struct block_scores *bs;
-  bs = malloc(sizeof(struct block_scores) * size);
-
-  fail_unless(bs != NULL);
-
-  struct block_scores block;
-  block.offset = 1;
-  block.score = 2.5;
-
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-
-  fail_unless(bs[0].offset == 1);
-  fail_unless(bs[0].score == 2.5);
-
-  block.offset = 4;
-  block.score = 5;
+  memset(tb, 0, sizeof(struct top_blocks));
+  tb->heap = heap;
+  tb->size = size;
+  tb->max_score = INFINITY;
+}
 
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
+// blocks pushed to heap of size 10 in all tests
+static const int64_t base_offset[] = { 1, 4, 2, 3, 5, 6, 7, 8, 9, 10 };
+static const float base_score[] = { 2.5, 5, 4, 1.5, 1.3, 1.2, 1.1875, 1.0625,
+  3, 2 };
 
-  fail_unless(bs[0].offset == 4);
-  fail_unless(bs[0].score == 5);
+static void
+push_base_blocks(struct top_blocks *tb, size_t count)
+{
+  for (size_t i=0; i < count; i++)
+    push_top_block(tb, base_offset[i], base_score[i]);
+}
 
-  block.offset = 2;
-  block.score = 4;
+START_TEST(add_block_test)
+{
+  struct block_scores bs[10];
+  struct top_blocks tb;
 
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
+  init_top_blocks(&tb, bs, 10);
+  push_base_blocks(&tb, 3);
+  sort_top_blocks(&tb);
 
+  fail_unless(tb.len == 3);
   fail_unless(bs[0].offset == 4);
   fail_unless(bs[0].score == 5);
   fail_unless(bs[1].offset == 2);
   fail_unless(bs[1].score == 4);
-
-  free(bs);
+  fail_unless(bs[2].offset == 1);
+  fail_unless(bs[2].score == 2.5);
 }
 END_TEST
 
-// add blocks up to the size of allocated array
-// last added block is at the end of array
+// add blocks up to the size of heap
 START_TEST(add_block_full_test)
 {
-  size_t size = 10;
-  size_t elems = 0;
-  struct block_scores *bs;
-  bs = malloc(sizeof(struct block_scores) * size);
-
-  fail_unless(bs != NULL);
-
-  struct block_scores block;
-
-  block.offset = 1;
-  block.score = 2.5;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-
-  block.offset = 4;
-  block.score = 5;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-
-  block.offset = 2;
-  block.score = 4;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-
-  block.offset = 3;
-  block.score = 1.5;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-
-  block.offset = 5;
-  block.score = 1.3;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-
-  block.offset = 6;
-  block.score = 1.2;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-
-  block.offset = 7;
-  block.score = 1.1;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-
-  block.offset = 8;
-  block.score = 1;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-
-  block.offset = 9;
-  block.score = 0.75;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-
-  block.offset = 10;
-  block.score = 0.5;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-
-  fail_unless(elems == 10);
+  struct block_scores bs[10];
+  struct top_blocks tb;
+
+  init_top_blocks(&tb, bs, 10);
+  push_base_blocks(&tb, 10);
+  sort_top_blocks(&tb);
+
+  fail_unless(tb.len == 10);
   fail_unless(bs[0].offset == 4);
   fail_unless(bs[0].score == 5);
   fail_unless(bs[1].offset == 2);
   fail_unless(bs[1].score == 4);
-  fail_unless(bs[2].offset == 1);
-  fail_unless(bs[2].score == 2.5);
-  fail_unless(bs[3].offset == 3);
-  fail_unless(bs[3].score == 1.5);
-  fail_unless(bs[8].offset == 9);
-  fail_unless(bs[8].score == 0.75);
-  fail_unless(bs[9].offset == 10);
-  fail_unless(bs[9].score == 0.5);
-
-  free(bs);
+  fail_unless(bs[2].offset == 9);
+  fail_unless(bs[2].score == 3);
+  fail_unless(bs[3].offset == 1);
+  fail_unless(bs[3].score == 2.5);
+  fail_unless(bs[4].offset == 10);
+  fail_unless(bs[4].score == 2);
+  fail_unless(bs[9].offset == 8);
+  fail_unless(bs[9].score == 1.0625);
 }
 END_TEST
-//
-// add blocks to fill array
-// last block is at the front of the array
+
+// block filling the heap is the best one
 START_TEST(add_final_block_front_test)
 {
-  size_t size = 10;
-  size_t elems = 0;
-  struct block_scores *bs;
-  bs = malloc(sizeof(struct block_scores) * size);
-
-  fail_unless(bs != NULL);
-
-  struct block_scores block;
-
-  block.offset = 1;
-  block.score = 2.5;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-
-  block.offset = 4;
-  block.score = 5;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-
-  block.offset = 2;
-  block.score = 4;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-
-  block.offset = 3;
-  block.score = 1.5;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-
-  block.offset = 5;
-  block.score = 1.3;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-
-  block.offset = 6;
-  block.score = 1.2;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-
-  block.offset = 7;
-  block.score = 1.1;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-
-  block.offset = 8;
-  block.score = 1;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-
-  block.offset = 9;
-  block.score = 3;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-
-  block.offset = 10;
-  block.score = 10;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-
-  fail_unless(elems == 10);
-  fail_unless(bs[0].offset == 10);
+  struct block_scores bs[10];
+  struct top_blocks tb;
+
+  init_top_blocks(&tb, bs, 10);
+  push_base_blocks(&tb, 9);
+  push_top_block(&tb, 11, 10);
+  sort_top_blocks(&tb);
+
+  fail_unless(tb.len == 10);
+  fail_unless(bs[0].offset == 11);
   fail_unless(bs[0].score == 10);
   fail_unless(bs[1].offset == 4);
   fail_unless(bs[1].score == 5);
-  fail_unless(bs[2].offset == 2);
-  fail_unless(bs[2].score == 4);
-  fail_unless(bs[3].offset == 9);
-  fail_unless(bs[3].score == 3);
-  fail_unless(bs[4].offset == 1);
-  fail_unless(bs[4].score == 2.5);
   fail_unless(bs[9].offset == 8);
-  fail_unless(bs[9].score == 1);
-
-  free(bs);
+  fail_unless(bs[9].score == 1.0625);
 }
 END_TEST
 
-// add blocks to fill array
-// last block is at the middle of the array
+// block filling the heap goes to the middle of ranking
 START_TEST(add_final_block_middle_test)
 {
-  size_t size = 10;
-  size_t elems = 0;
-  struct block_scores *bs;
-  bs = malloc(sizeof(struct block_scores) * size);
-
-  fail_unless(bs != NULL);
-
-  struct block_scores block;
-
-  block.offset = 1;
-  block.score = 2.5;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-
-  block.offset = 4;
-  block.score = 5;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-
-  block.offset = 2;
-  block.score = 4;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-
-  block.offset = 3;
-  block.score = 1.5;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-
-  block.offset = 5;
-  block.score = 1.3;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-
-  block.offset = 6;
-  block.score = 1.2;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-
-  block.offset = 7;
-  block.score = 1.1;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-
-  block.offset = 8;
-  block.score = 1;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-
-  block.offset = 9;
-  block.score = 3;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-
-  block.offset = 10;
-  block.score = 2;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-
-  fail_unless(elems == 10);
-  fail_unless(bs[0].offset == 4);
-  fail_unless(bs[0].score == 5);
-  fail_unless(bs[1].offset == 2);
-  fail_unless(bs[1].score == 4);
-  fail_unless(bs[2].offset == 9);
-  fail_unless(bs[2].score == 3);
+  struct block_scores bs[10];
+  struct top_blocks tb;
+
+  init_top_blocks(&tb, bs, 10);
+  push_base_blocks(&tb, 9);
+  push_top_block(&tb, 11, 2.125);
+  sort_top_blocks(&tb);
+
+  fail_unless(tb.len == 10);
   fail_unless(bs[3].offset == 1);
   fail_unless(bs[3].score == 2.5);
-  fail_unless(bs[4].offset == 10);
-  fail_unless(bs[4].score == 2);
-  fail_unless(bs[9].offset == 8);
-  fail_unless(bs[9].score == 1);
-
-  free(bs);
+  fail_unless(bs[4].offset == 11);
+  fail_unless(bs[4].score == 2.125);
+  fail_unless(bs[5].offset == 3);
+  fail_unless(bs[5].score == 1.5);
 }
 END_TEST
 
+// better block replaces the worst one in full heap
 START_TEST(replace_block_test)
 {
-  size_t size = 10;
-  size_t elems = 0;
-  struct block_scores *bs;
-  bs = malloc(sizeof(struct block_scores) * size);
-
-  fail_unless(bs != NULL);
-
-  struct block_scores block;
-
-  block.offset = 1;
-  block.score = 2.5;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-  block.offset = 4;
-  block.score = 5;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-  block.offset = 2;
-  block.score = 4;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-  block.offset = 3;
-  block.score = 1.5;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-  block.offset = 5;
-  block.score = 1.3;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-  block.offset = 6;
-  block.score = 1.2;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-  block.offset = 7;
-  block.score = 1.125;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-  block.offset = 8;
-  block.score = 1;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-  block.offset = 9;
-  block.score = 3;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-  block.offset = 10;
-  block.score = 2;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-
-  fail_unless(elems == 10);
-
-  block.offset = 11;
-  block.score = 10;
-
-  insert_score_to_block_scores(bs, elems, &block);
+  struct block_scores bs[10];
+  struct top_blocks tb;
 
+  init_top_blocks(&tb, bs, 10);
+  push_base_blocks(&tb, 10);
+  push_top_block(&tb, 11, 10);
+  sort_top_blocks(&tb);
+
+  fail_unless(tb.len == 10);
   fail_unless(bs[0].offset == 11);
   fail_unless(bs[0].score == 10);
   fail_unless(bs[1].offset == 4);
   fail_unless(bs[1].score == 5);
   fail_unless(bs[9].offset == 7);
-  fail_unless(bs[9].score == 1.125);
-
-  free(bs);
+  fail_unless(bs[9].score == 1.1875);
 }
 END_TEST
 
+// block replacing the worst one becomes the worst one itself
 START_TEST(replace_block_end_test)
 {
-  size_t size = 10;
-  size_t elems = 0;
-  struct block_scores *bs;
-  bs = malloc(sizeof(struct block_scores) * size);
-
-  fail_unless(bs != NULL);
-
-  struct block_scores block;
-
-  block.offset = 1;
-  block.score = 2.5;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-  block.offset = 4;
-  block.score = 5;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-  block.offset = 2;
-  block.score = 4;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-  block.offset = 3;
-  block.score = 1.5;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-  block.offset = 5;
-  block.score = 1.3;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-  block.offset = 6;
-  block.score = 1.2;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-  block.offset = 7;
-  block.score = 1.1875;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-  block.offset = 8;
-  block.score = 1.0625;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-  block.offset = 9;
-  block.score = 3;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-  block.offset = 10;
-  block.score = 2;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-
-  fail_unless(elems == 10);
-
-  block.offset = 11;
-  block.score = 1.125;
-
-  insert_score_to_block_scores(bs, elems, &block);
+  struct block_scores bs[10];
+  struct top_blocks tb;
+
+  init_top_blocks(&tb, bs, 10);
+  push_base_blocks(&tb, 10);
+  push_top_block(&tb, 11, 1.125);
+  sort_top_blocks(&tb);
 
+  fail_unless(tb.len == 10);
   fail_unless(bs[0].offset == 4);
   fail_unless(bs[0].score == 5);
-  fail_unless(bs[1].offset == 2);
-  fail_unless(bs[1].score == 4);
   fail_unless(bs[8].offset == 7);
   fail_unless(bs[8].score == 1.1875);
   fail_unless(bs[9].offset == 11);
   fail_unless(bs[9].score == 1.125);
-
-  free(bs);
 }
 END_TEST
 
 START_TEST(replace_block_middle_test)
 {
-  size_t size = 10;
-  size_t elems = 0;
-  struct block_scores *bs;
-  bs = malloc(sizeof(struct block_scores) * size);
-
-  fail_unless(bs != NULL);
-
-  struct block_scores block;
-
-  block.offset = 1;
-  block.score = 2.5;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-  block.offset = 4;
-  block.score = 5;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-  block.offset = 2;
-  block.score = 4;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-  block.offset = 3;
-  block.score = 1.5;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-  block.offset = 5;
-  block.score = 1.3;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-  block.offset = 6;
-  block.score = 1.2;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-  block.offset = 7;
-  block.score = 1.1875;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-  block.offset = 8;
-  block.score = 1.0625;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-  block.offset = 9;
-  block.score = 3;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-  block.offset = 10;
-  block.score = 2;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-
-  fail_unless(elems == 10);
-
-  block.offset = 11;
-  block.score = 2.125;
-
-  insert_score_to_block_scores(bs, elems, &block);
+  struct block_scores bs[10];
+  struct top_blocks tb;
+
+  init_top_blocks(&tb, bs, 10);
+  push_base_blocks(&tb, 10);
+  push_top_block(&tb, 11, 2.125);
+  sort_top_blocks(&tb);
 
+  fail_unless(tb.len == 10);
   fail_unless(bs[0].offset == 4);
   fail_unless(bs[0].score == 5);
-  fail_unless(bs[1].offset == 2);
-  fail_unless(bs[1].score == 4);
   fail_unless(bs[4].offset == 11);
   fail_unless(bs[4].score == 2.125);
+  fail_unless(bs[5].offset == 10);
+  fail_unless(bs[5].score == 2);
   fail_unless(bs[9].offset == 7);
   fail_unless(bs[9].score == 1.1875);
-
-  free(bs);
 }
 END_TEST
 
+// block worse than all in full heap doesn't change it
 START_TEST(replace_block_none_test)
 {
-  size_t size = 10;
-  size_t elems = 0;
-  struct block_scores *bs;
-  bs = malloc(sizeof(struct block_scores) * size);
-
-  fail_unless(bs != NULL);
-
-  struct block_scores block;
-
-  block.offset = 1;
-  block.score = 2.5;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-  block.offset = 4;
-  block.score = 5;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-  block.offset = 2;
-  block.score = 4;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-  block.offset = 3;
-  block.score = 1.5;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-  block.offset = 5;
-  block.score = 1.3;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-  block.offset = 6;
-  block.score = 1.2;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-  block.offset = 7;
-  block.score = 1.1875;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-  block.offset = 8;
-  block.score = 1.0625;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-  block.offset = 9;
-  block.score = 3;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-  block.offset = 10;
-  block.score = 2;
-  add_score_to_block_scores(bs, elems, &block);
-  elems++;
-
-  fail_unless(elems == 10);
-
-  block.offset = 11;
-  block.score = 0.125;
-
-  insert_score_to_block_scores(bs, elems, &block);
+  struct block_scores bs[10];
+  struct top_blocks tb;
 
+  init_top_blocks(&tb, bs, 10);
+  push_base_blocks(&tb, 10);
+  push_top_block(&tb, 11, 0.125);
+  sort_top_blocks(&tb);
+
+  fail_unless(tb.len == 10);
   fail_unless(bs[0].offset == 4);
   fail_unless(bs[0].score == 5);
-  fail_unless(bs[1].offset == 2);
-  fail_unless(bs[1].score == 4);
   fail_unless(bs[8].offset == 7);
   fail_unless(bs[8].score == 1.1875);
   fail_unless(bs[9].offset == 8);
   fail_unless(bs[9].score == 1.0625);
+}
+END_TEST
+
+// on a tie with the worst block in full heap the lower offset wins
+START_TEST(replace_block_tie_test)
+{
+  struct block_scores bs[10];
+  struct top_blocks tb;
+
+  init_top_blocks(&tb, bs, 10);
+  push_base_blocks(&tb, 10);
+  push_top_block(&tb, 11, 1.0625);
+  fail_unless(bs[0].offset == 8);
+  push_top_block(&tb, 0, 1.0625);
+  fail_unless(bs[0].offset == 0);
+  sort_top_blocks(&tb);
+
+  fail_unless(tb.len == 10);
+  fail_unless(bs[8].offset == 7);
+  fail_unless(bs[9].offset == 0);
+  fail_unless(bs[9].score == 1.0625);
+
+  // and blocks over the max score don't get in at all
+  init_top_blocks(&tb, bs, 10);
+  tb.max_score = 3;
+  push_base_blocks(&tb, 10);
+  sort_top_blocks(&tb);
+  fail_unless(tb.len == 8);
+  fail_unless(bs[0].offset == 9);
+  fail_unless(bs[0].score == 3);
+}
+END_TEST
+
+// equal scores cut by size of the selection, blocks with lower offsets win
+START_TEST(select_best_blocks_tie_test)
+{
+  struct activity_stats *activity = new_activity_stats_s(999);
+  struct block_scores bs[10];
+  time_t now = time(NULL);
+  size_t found;
+
+  for (int64_t i=0; i < activity->len; i++) {
+    activity->block[i].read_score = i % 100 == 50 ? 20 : 10;
+    activity->block[i].read_time = now;
+  }
+
+  for (int threads=1; threads <= 4; threads += 3) {
+    fail_unless(select_best_blocks(activity, bs, 10, &found, 1, 10, 1000000,
+          INFINITY, threads) == 0);
+    fail_unless(found == 10);
+    for (int i=0; i < 10; i++)
+      fail_unless(bs[i].offset == 50 + i * 100);
+
+    fail_unless(select_best_blocks(activity, bs, 10, &found, 1, 10, 1000000,
+          15, threads) == 0);
+    fail_unless(found == 10);
+    for (int i=0; i < 10; i++)
+      fail_unless(bs[i].offset == i);
+  }
+
+  destroy_activity_stats(activity);
+}
+END_TEST
+
+// best blocks first, on equal scores the one with lower offset
+static int
+compare_block_scores(const void *a, const void *b)
+{
+  const struct block_scores *x = a;
+  const struct block_scores *y = b;
+
+  if (x->score != y->score)
+    return x->score < y->score ? 1 : -1;
+  return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+// selection split between threads returns the same blocks as a full sort
+START_TEST(select_best_blocks_test)
+{
+  struct activity_stats *activity = new_activity_stats_s(99999);
+  struct block_scores *all = malloc(sizeof(struct block_scores) * activity->len);
+  struct block_scores *bs = malloc(sizeof(struct block_scores) * 1000);
+  time_t now = time(NULL);
+  size_t found;
+
+  srandom(1);
+  for (int64_t i=0; i < activity->len; i++) {
+    // plenty of equal scores, to check ordering of ties
+    activity->block[i].read_score = random() % 5000;
+    activity->block[i].read_time = now - random() % 100000;
+    activity->block[i].write_score = i % 3 ? 0 : random() % 500;
+    activity->block[i].write_time = now;
+  }
+
+  float *score = malloc(sizeof(float) * activity->len);
+  struct score_params params = { .read_multiplier = 1,
+    .write_multiplier = 10, .scale = 1.0 / 1000000 };
+  score_range(activity, 0, activity->len, now, &params, score);
+  for (int64_t i=0; i < activity->len; i++) {
+    all[i].offset = i;
+    all[i].score = score[i];
+  }
+  free(score);
+  qsort(all, activity->len, sizeof(struct block_scores), compare_block_scores);
+
+  for (int threads=1; threads <= 7; threads += 3) {
+    fail_unless(select_best_blocks(activity, bs, 1000, &found, 1, 10, 1000000,
+          INFINITY, threads) == 0);
+    fail_unless(found == 1000);
+    for (int i=0; i < 1000; i++)
+      fail_unless(bs[i].offset == all[i].offset);
+  }
+
+  // blocks over the max score are skipped
+  fail_unless(select_best_blocks(activity, bs, 1000, &found, 1, 10, 1000000,
+        all[500].score, 4) == 0);
+  fail_unless(found == 1000);
+  size_t first = 0;
+  while (all[first].score > all[500].score)
+    first++;
+  for (int i=0; i < 1000; i++)
+    fail_unless(bs[i].offset == all[first + i].offset);
+
+  free(all);
+  free(bs);
+  destroy_activity_stats(activity);
+}
+END_TEST
+
+// all score kernels supported by CPU return the same, accurate, scores
+START_TEST(score_kernels_test)
+{
+  const size_t len = 1000;
+  struct block_activity *block = calloc(sizeof(struct block_activity), len);
+  float *expected = malloc(sizeof(float) * len);
+  float *out = malloc(sizeof(float) * len);
+  struct score_params params = { .read_multiplier = 1,
+    .write_multiplier = 10, .scale = 1.0 / 1000 };
+  time_t now = 1000000;
+
+  srandom(3);
+  for (size_t i=0; i < len; i++) {
+    block[i].read_score = random() % 100000 / 10.0;
+    block[i].write_score = i % 5 ? 0 : random() % 1000;
+    // including accesses in the future and ones too old to matter
+    block[i].read_time = now - 200000 + random() % 200100;
+    block[i].write_time = now - random() % 20000;
+  }
+
+  score_blocks_with(score_kernel_scalar, block, len, now, &params, expected);
+
+  for (size_t i=0; i < len; i++) {
+    double read_age = now > block[i].read_time ? now - block[i].read_time : 0;
+    double write_age = now > block[i].write_time ? now - block[i].write_time : 0;
+    double score = block[i].read_score * exp(-read_age / 1000)
+      + block[i].write_score * exp(-write_age / 1000) * 10;
+    fail_unless(fabs(expected[i] - score) <= score * 1e-5 + 1e-30,
+        "block %zu score %g, expected %g", i, expected[i], score);
+  }
+
+  for (size_t k=0; k < SCORE_KERNELS_NUM; k++) {
+    if (!score_kernels[k].supported())
+      continue;
+    score_blocks_with(score_kernels[k].fn, block, len, now, &params, out);
+    for (size_t i=0; i < len; i++)
+      fail_unless(out[i] == expected[i], "kernel %s, block %zu: %g != %g",
+          score_kernels[k].name, i, out[i], expected[i]);
+  }
+
+  free(block);
+  free(expected);
+  free(out);
+}
+END_TEST
+
+// hot-set index follows changes of blocks and is saved with statistics
+START_TEST(hot_index_test)
+{
+  char file[] = "/tmp/lvmts_test_XXXXXX";
+  struct activity_stats *activity = new_activity_stats_s(999);
+  struct block_scores *bs = NULL;
+  struct block_scores *hot = NULL;
+  time_t now = time(NULL);
+  size_t found;
+
+  close(mkstemp(file));
+
+  srandom(4);
+  for (int i=0; i < 3000; i++)
+    fail_unless(add_block_read(activity, random() % 2000,
+          now - 10000 + random() % 10000, 100000, 1) == 0);
+
+  fail_unless(enable_hot_index(activity, 50, 1, 10, 100000) == 0);
+
+  // changes after the index was built, including extension of stats
+  for (int i=0; i < 3000; i++)
+    fail_unless(add_block_write(activity, random() % 3000,
+          now - 5000 + random() % 5000, 100000, 1) == 0);
+  fail_unless(add_block_read(activity, 5000, now, 100000, 100) == 0);
+
+  fail_unless(get_best_blocks(activity, &bs, 50, 1, 10, 100000) == 0);
+  fail_unless(get_hot_blocks(activity, &hot, 50, &found) == 0);
+  fail_unless(found == 50);
+  fail_unless(hot[0].offset == 5000);
+  for (int i=0; i < 50; i++)
+    fail_unless(hot[i].offset == bs[i].offset);
+
+  // blocks losing score are replaced by blocks from reserve
+  fail_unless(add_block_discard(activity, 5000, 8, 8) == 0);
+  fail_unless(get_best_blocks(activity, &bs, 50, 1, 10, 100000) == 0);
+  fail_unless(get_hot_blocks(activity, &hot, 50, &found) == 0);
+  fail_unless(hot[0].offset != 5000);
+  for (int i=0; i < 50; i++)
+    fail_unless(hot[i].offset == bs[i].offset);
+  fail_unless(activity->hot->len == activity->hot->capacity);
+
+  // as many of them as the reserve holds, without rebuilding the index
+  for (int i=0; i < 5; i++)
+    fail_unless(add_block_discard(activity, bs[i * 3].offset, 8, 8) == 0);
+  fail_unless(get_best_blocks(activity, &bs, 50, 1, 10, 100000) == 0);
+  fail_unless(get_hot_blocks(activity, &hot, 50, &found) == 0);
+  fail_unless(found == 50);
+  for (int i=0; i < 50; i++)
+    fail_unless(hot[i].offset == bs[i].offset);
+
+  activity->compress = 1;
+  fail_unless(write_activity_stats(activity, file) == 0);
+  fail_unless(read_hot_blocks(file, &hot, 10, &found, 1, 10, 100000) == 0);
+  fail_unless(found == 10);
+  for (int i=0; i < 10; i++)
+    fail_unless(hot[i].offset == bs[i].offset);
+
+  // blocks changed in journal are ranked together with the index
+  char *journal = get_journal_file_name(file);
+  fail_unless(journal != NULL);
+  fail_unless(add_block_read(activity, 7000, now, 100000, 1000) == 0);
+  fail_unless(append_activity_journal(activity, journal) == 0);
+  fail_unless(get_best_blocks(activity, &bs, 50, 1, 10, 100000) == 0);
+  fail_unless(read_hot_blocks(file, &hot, 10, &found, 1, 10, 100000) == 0);
+  fail_unless(found == 10);
+  fail_unless(hot[0].offset == 7000);
+  for (int i=0; i < 10; i++)
+    fail_unless(hot[i].offset == bs[i].offset);
+
+  unlink(journal);
+  free(journal);
+  unlink(file);
+  free(bs);
+  free(hot);
+  destroy_activity_stats(activity);
+}
+END_TEST
+
+// histogram answers count, quantile and paging queries like a full sort
+START_TEST(score_histogram_test)
+{
+  struct activity_stats *activity = new_activity_stats_s(49999);
+  struct block_scores *all = malloc(sizeof(struct block_scores) * activity->len);
+  struct block_scores *bs = NULL;
+  struct score_params params = { .read_multiplier = 1,
+    .write_multiplier = 10, .scale = 1.0 / 100000 };
+  struct score_histogram *hist;
+  time_t now = time(NULL);
+  size_t found;
+
+  srandom(5);
+  for (int64_t i=0; i < activity->len; i++) {
+    // many cold blocks and equal scores
+    activity->block[i].read_score = i % 4 ? random() % 3000 / 7.0 : 0;
+    activity->block[i].read_time = now - random() % 500000;
+    activity->block[i].write_score = i % 5 ? 0 : random() % 50;
+    activity->block[i].write_time = now;
+  }
+
+  hist = new_score_histogram(activity, now, &params);
+  fail_unless(hist != NULL);
+
+  float *score = malloc(sizeof(float) * activity->len);
+  score_range(activity, 0, activity->len, now, &params, score);
+  uint64_t hot = 0;
+  for (int64_t i=0; i < activity->len; i++) {
+    all[i].score = score[i];
+    all[i].offset = i;
+    hot += score[i] > 0;
+  }
+  qsort(all, activity->len, sizeof(struct block_scores), compare_block_scores);
+
+  for (int64_t i=0; i < activity->len; i += 997) {
+    uint64_t above = 0;
+    while (above < (uint64_t)activity->len && all[above].score > all[i].score)
+      above++;
+    fail_unless(histogram_count_above(hist, all[i].score) == above);
+  }
+  fail_unless(histogram_count_above(hist, 0) == hot);
+
+  fail_unless(histogram_quantile(hist, 1) == all[0].score);
+  fail_unless(histogram_quantile(hist, 0) == all[activity->len - 1].score);
+  fail_unless(histogram_quantile(hist, 0.95) ==
+      all[activity->len - 1 - (int64_t)(0.95 * (activity->len - 1))].score);
+
+  // paging down from the score of the last block returned
+  fail_unless(histogram_best_blocks(hist, &bs, 100, &found, INFINITY) == 0);
+  fail_unless(found == 100);
+  for (int i=0; i < 100; i++)
+    fail_unless(bs[i].offset == all[i].offset);
+  fail_unless(histogram_best_blocks(hist, &bs, 100, &found, all[150].score) == 0);
+  size_t first = 0;
+  while (all[first].score > all[150].score)
+    first++;
+  for (int i=0; i < 100; i++)
+    fail_unless(bs[i].offset == all[first + i].offset);
+
+  free_score_histogram(hist);
+  free(score);
+  free(all);
+  free(bs);
+  destroy_activity_stats(activity);
+}
+END_TEST
+
+// pages read with ranking cursor follow each other without gaps or repeats
+START_TEST(rank_cursor_test)
+{
+  struct activity_stats *activity = new_activity_stats_s(29999);
+  struct block_scores *all = malloc(sizeof(struct block_scores) * activity->len);
+  struct block_scores *bs = NULL;
+  struct score_params params = { .read_multiplier = 1,
+    .write_multiplier = 10, .scale = 1.0 / 100000 };
+  struct rank_cursor *rc;
+  time_t now = time(NULL);
+  int64_t rank = 0;
+  size_t found;
+
+  srandom(7);
+  for (int64_t i=0; i < activity->len; i++) {
+    // plenty of ties and blocks never accessed
+    activity->block[i].read_score = i % 3 ? random() % 200 : 0;
+    activity->block[i].read_time = i % 3 ? now : 0;
+  }
+
+  float *score = malloc(sizeof(float) * activity->len);
+  score_range(activity, 0, activity->len, now, &params, score);
+  for (int64_t i=0; i < activity->len; i++) {
+    all[i].offset = i;
+    all[i].score = score[i];
+  }
+  qsort(all, activity->len, sizeof(struct block_scores), compare_block_scores);
+
+  rc = new_rank_cursor(activity, now, &params);
+  fail_unless(rc != NULL);
+
+  do {
+    fail_unless(rank_cursor_next(rc, &bs, 37, &found) == 0);
+    for (size_t i=0; i < found; i++, rank++) {
+      fail_unless(bs[i].offset == all[rank].offset);
+      fail_unless(bs[i].score == all[rank].score);
+    }
+  } while (found);
+  fail_unless(rank == activity->len);
+
+  rank_cursor_seek(rc, 20000);
+  fail_unless(rank_cursor_next(rc, &bs, 10, &found) == 0);
+  fail_unless(found == 10);
+  fail_unless(bs[9].offset == all[20009].offset);
+  rank_cursor_seek(rc, 5);
+  fail_unless(rank_cursor_next(rc, &bs, 10, &found) == 0);
+  fail_unless(bs[0].offset == all[5].offset);
+
+  free_rank_cursor(rc);
+  free(score);
+  free(all);
+  free(bs);
+  destroy_activity_stats(activity);
+}
+END_TEST
+
+// partial discards lower the score, discarding rest of block zeroes it
+START_TEST(discard_block_test)
+{
+  struct activity_stats *activity = new_activity_stats();
+
+  fail_unless(activity != NULL);
+
+  fail_unless(add_block_read(activity, 3, 100, 1000, 16) == 0);
+  fail_unless(add_block_write(activity, 3, 100, 1000, 8) == 0);
+
+  fail_unless(add_block_discard(activity, 3, 2, 8) == 0);
+  fail_unless(activity->block[3].read_score == 12);
+  fail_unless(activity->block[3].write_score == 6);
+  fail_unless(activity->discard[3] == 2);
+
+  fail_unless(add_block_discard(activity, 3, 3, 8) == 0);
+  fail_unless(activity->block[3].read_score == 6);
+  fail_unless(activity->block[3].write_score == 3);
+
+  fail_unless(add_block_discard(activity, 3, 3, 8) == 0);
+  fail_unless(activity->block[3].read_score == 0);
+  fail_unless(activity->block[3].write_score == 0);
 
+  destroy_activity_stats(activity);
+}
+END_TEST
+
+// write to block resets amount of discarded data
+START_TEST(discard_block_write_test)
+{
+  struct activity_stats *activity = new_activity_stats();
+
+  fail_unless(activity != NULL);
+
+  fail_unless(add_block_read(activity, 0, 100, 1000, 16) == 0);
+  fail_unless(add_block_discard(activity, 0, 4, 8) == 0);
+  fail_unless(activity->block[0].read_score == 8);
+
+  fail_unless(add_block_write(activity, 0, 100, 1000, 16) == 0);
+  fail_unless(activity->discard[0] == 0);
+
+  // discards of blocks never accessed are ignored
+  fail_unless(add_block_discard(activity, 20, 8, 8) == 0);
+  fail_unless(activity->len == 1);
+
+  // extending stats extends discard counters too
+  fail_unless(add_block_read(activity, 10, 100, 1000, 16) == 0);
+  fail_unless(activity->len == 11);
+  fail_unless(activity->discard[10] == 0);
+
+  destroy_activity_stats(activity);
+}
+END_TEST
+
+// bytes are counted only after IO with size is seen and decay with score
+START_TEST(add_block_bytes_test)
+{
+  struct activity_stats *activity = new_activity_stats();
+
+  fail_unless(activity != NULL);
+
+  fail_unless(add_block_read(activity, 1, 100, 1000, 16) == 0);
+  fail_unless(activity->bytes == NULL);
+  fail_unless(get_block_read_bytes(activity, 1) == 0);
+
+  fail_unless(add_block_io(activity, 1, 100, 1000, 16, 4096, T_READ) == 0);
+  fail_unless(add_block_io(activity, 2, 100, 1000, 16, 512, T_WRITE) == 0);
+  fail_unless(get_block_read_bytes(activity, 1) == 4096);
+  fail_unless(get_block_write_bytes(activity, 1) == 0);
+  fail_unless(get_block_write_bytes(activity, 2) == 512);
+  fail_unless(activity->block[1].read_score == 32);
+
+  fail_unless(add_block_io(activity, 1, 1100, 1000, 16, 4096, T_READ) == 0);
+  fail_unless(fabs(get_block_read_bytes(activity, 1)
+        - (4096 * exp(-1) + 4096)) < 0.01);
+
+  destroy_activity_stats(activity);
+}
+END_TEST
+
+// weight scales operations and bytes the same, so weighted IO counts as
+// that many operations of its size
+START_TEST(add_block_weighted_io_test)
+{
+  struct activity_stats *activity = new_activity_stats();
+
+  fail_unless(activity != NULL);
+
+  fail_unless(add_block_weighted_io(activity, 1, 100, 1000, 16, 2, 4096,
+        T_READ) == 0);
+  fail_unless(add_block_io(activity, 2, 100, 1000, 16, 4096, T_READ) == 0);
+  fail_unless(add_block_io(activity, 2, 100, 1000, 16, 4096, T_READ) == 0);
+  fail_unless(activity->block[1].read_score == activity->block[2].read_score);
+  fail_unless(get_block_read_bytes(activity, 1)
+      == get_block_read_bytes(activity, 2));
+  fail_unless(activity->block[1].read_score / 16 == 2);
+  fail_unless(get_block_read_bytes(activity, 1) / 2 == 4096);
+
+  destroy_activity_stats(activity);
+}
+END_TEST
+
+// hits are added to hour of day and day of week buckets
+START_TEST(profile_block_test)
+{
+  struct activity_stats *activity = new_activity_stats();
+  struct profile_time pt;
+
+  fail_unless(activity != NULL);
+
+  setenv("TZ", "UTC", 1);
+  tzset();
+
+  fail_unless(enable_activity_profile(activity) == 0);
+
+  // Thursday, 1970-01-01 02:00
+  fail_unless(add_block_read(activity, 2, 2*60*60, 1000, 16) == 0);
+  fail_unless(add_block_write(activity, 2, 2*60*60 + 10, 1000, 16) == 0);
+
+  fail_unless(activity->len == 3);
+  fail_unless(activity->profile[2].hour[2] == 32);
+  fail_unless(activity->profile[2].weekday[4] == 32);
+  fail_unless(activity->profile[1].hour[2] == 0);
+
+  get_profile_time(2*60*60 + 30, &pt);
+  fail_unless(get_block_profile_score(activity, 2, &pt)
+      == 32 * 7.0 / PROFILE_MEAN_LIFETIME);
+
+  get_profile_time(3*60*60, &pt);
+  fail_unless(get_block_profile_score(activity, 2, &pt) == 0);
+
+  destroy_activity_stats(activity);
+}
+END_TEST
+
+// level follows activity, trend its change, idle intervals are accounted
+START_TEST(trend_block_test)
+{
+  struct activity_stats *activity = new_activity_stats();
+  float level, trend;
+
+  fail_unless(activity != NULL);
+  fail_unless(enable_activity_trend(activity, 100, 0.5, 0.5) == 0);
+
+  // 1 hit in interval 10, 2 hits in interval 11
+  fail_unless(add_block_read(activity, 0, 1000, 1000, 16) == 0);
+  fail_unless(add_block_read(activity, 0, 1100, 1000, 16) == 0);
+  fail_unless(add_block_read(activity, 0, 1150, 1000, 16) == 0);
+
+  // interval 10 closed, levels from before first hit were all zero
+  get_block_trend(activity, 0, 1199, &level, &trend);
+  fail_unless(level == 8);
+  fail_unless(trend == 4);
+
+  // interval 11 closed
+  get_block_trend(activity, 0, 1200, &level, &trend);
+  fail_unless(level == 22);
+  fail_unless(trend == 9);
+
+  // interval 12 idle
+  get_block_trend(activity, 0, 1300, &level, &trend);
+  fail_unless(level == 15.5);
+  fail_unless(trend == 1.25);
+
+  // long idle resets
+  get_block_trend(activity, 0, 100000, &level, &trend);
+  fail_unless(level == 0);
+  fail_unless(trend == 0);
+
+  destroy_activity_stats(activity);
+}
+END_TEST
+
+// blocks often accessed in the same window end up in one group
+START_TEST(coaccess_group_test)
+{
+  struct activity_stats *activity = new_activity_stats();
+
+  fail_unless(activity != NULL);
+  fail_unless(enable_coaccess_groups(activity, 10, 2) == 0);
+
+  for (int64_t t=100; t < 130; t += 10) {
+    fail_unless(add_block_read(activity, 5, t, 1000, 16) == 0);
+    fail_unless(add_block_write(activity, 3, t + 1, 1000, 16) == 0);
+    fail_unless(add_block_read(activity, 5, t + 2, 1000, 16) == 0);
+  }
+  // block 9 seen together with others only once
+  fail_unless(add_block_read(activity, 9, 122, 1000, 16) == 0);
+  fail_unless(add_block_read(activity, 7, 200, 1000, 16) == 0);
+
+  pthread_mutex_lock(&activity->mutex);
+  fail_unless(update_coaccess_groups(activity) == 0);
+  pthread_mutex_unlock(&activity->mutex);
+
+  fail_unless(get_block_group(activity, 3) == 3);
+  fail_unless(get_block_group(activity, 5) == 3);
+  fail_unless(get_block_group(activity, 7) == -1);
+  fail_unless(get_block_group(activity, 9) == -1);
+  fail_unless(get_block_group(activity, 0) == -1);
+
+  destroy_activity_stats(activity);
+}
+END_TEST
+
+// pair rejected because of group size limit doesn't merge group labels
+START_TEST(coaccess_group_limit_test)
+{
+  struct activity_stats *activity = new_activity_stats();
+  struct coaccess_pair *pairs;
+  size_t n = 0;
+
+  fail_unless(activity != NULL);
+  fail_unless(enable_coaccess_groups(activity, 10, 2) == 0);
+  fail_unless(add_block_read(activity, 301, 100, 1000, 16) == 0);
+
+  // chain of blocks 0 to COACCESS_MAX_GROUP - 1 fills a group
+  pairs = activity->coaccess->pairs;
+  for (uint32_t i=0; i + 1 < COACCESS_MAX_GROUP; i++)
+    pairs[n++] = (struct coaccess_pair) { .a = i, .b = i + 1, .count = 5 };
+  pairs[n++] = (struct coaccess_pair) { .a = 300, .b = 301, .count = 5 };
+  pairs[n++] = (struct coaccess_pair) { .a = COACCESS_MAX_GROUP - 1, .b = 300,
+    .count = 5 };
+
+  pthread_mutex_lock(&activity->mutex);
+  fail_unless(update_coaccess_groups(activity) == 0);
+  pthread_mutex_unlock(&activity->mutex);
+
+  fail_unless(get_block_group(activity, 0) == 0);
+  fail_unless(get_block_group(activity, COACCESS_MAX_GROUP - 1) == 0);
+  fail_unless(get_block_group(activity, 300) == 300);
+  fail_unless(get_block_group(activity, 301) == 300);
+
+  destroy_activity_stats(activity);
+}
+END_TEST
+
+// neighbouring blocks get share^distance of the score, up to radius
+START_TEST(smooth_block_scores_test)
+{
+  float score[] = { 8, 0, 0, 0, 0, 0, 4 };
+  float orig[7];
+
+  memcpy(orig, score, sizeof(score));
+  // radius 0 leaves scores untouched
+  fail_unless(smooth_block_scores(score, 7, 0.5, 0) == 0);
+  fail_unless(memcmp(score, orig, sizeof(score)) == 0);
+
+  fail_unless(smooth_block_scores(score, 7, 0.5, 2) == 0);
+  // edges don't wrap around or read outside the array
+  fail_unless(score[0] == 8);
+  fail_unless(score[1] == 4);
+  fail_unless(score[2] == 2);
+  fail_unless(score[3] == 0);
+  fail_unless(score[4] == 1);
+  fail_unless(score[5] == 2);
+  fail_unless(score[6] == 4);
+
+  // radius larger than array reaches the other end
+  memcpy(score, orig, sizeof(score));
+  fail_unless(smooth_block_scores(score, 7, 0.5, 10) == 0);
+  fail_unless(score[0] == 8 + 4 / 64.0);
+  fail_unless(score[6] == 4 + 8 / 64.0);
+}
+END_TEST
+
+// group members share the average of their already smoothed scores
+START_TEST(smooth_group_block_scores_test)
+{
+  struct activity_stats *activity = new_activity_stats();
+  float score[] = { 0, 0, 0, 8, 0, 0, 0, 0 };
+
+  fail_unless(activity != NULL);
+  fail_unless(enable_coaccess_groups(activity, 10, 2) == 0);
+  for (int64_t t=100; t < 130; t += 10) {
+    fail_unless(add_block_read(activity, 3, t, 1000, 16) == 0);
+    fail_unless(add_block_read(activity, 7, t + 1, 1000, 16) == 0);
+  }
+  pthread_mutex_lock(&activity->mutex);
+  fail_unless(update_coaccess_groups(activity) == 0);
+  pthread_mutex_unlock(&activity->mutex);
+  fail_unless(get_block_group(activity, 7) == 3);
+
+  fail_unless(smooth_block_scores(score, 8, 0.5, 1) == 0);
+  fail_unless(set_group_block_scores(activity, score, 8) == 0);
+
+  // blocks 3 and 7 average 8 and 0, neighbours keep smoothed score
+  fail_unless(score[3] == 4);
+  fail_unless(score[7] == 4);
+  fail_unless(score[2] == 4);
+  fail_unless(score[4] == 4);
+  fail_unless(score[6] == 0);
+
+  destroy_activity_stats(activity);
+}
+END_TEST
+
+// statistics survive saving to and reading from version 2 file
+START_TEST(write_read_stats_test)
+{
+  char file[] = "/tmp/lvmts_test_XXXXXX";
+  struct activity_stats *activity = new_activity_stats();
+  struct activity_stats *read = NULL;
+
+  close(mkstemp(file));
+
+  fail_unless(activity != NULL);
+  fail_unless(add_block_io(activity, 4, 100, 1000, 16, 4096, T_READ) == 0);
+  fail_unless(add_block_write(activity, 9, 200, 1000, 8) == 0);
+  set_activity_stats_volume(activity, "vg", "lv", 4*1024*1024);
+
+  fail_unless(write_activity_stats(activity, file) == 0);
+  fail_unless(read_activity_stats(&read, file) == 0);
+
+  fail_unless(read->len == 10);
+  fail_unless(read->block[4].read_time == 100);
+  fail_unless(read->block[4].read_score == 16);
+  fail_unless(read->block[9].write_time == 200);
+  fail_unless(read->block[9].write_score == 8);
+  fail_unless(read->bytes[4].read_bytes == 4096);
+  fail_unless(read->discard == NULL);
+  fail_unless(read->extent_size == 4*1024*1024);
+  fail_unless(!strcmp(read->vg_name, "vg"));
+  fail_unless(!strcmp(read->lv_name, "lv"));
+  fail_unless(read->generation == 1);
+  destroy_activity_stats(read);
+  read = NULL;
+
+  // damage the block table
+  int fd = open(file, O_WRONLY);
+  fail_unless(pwrite(fd, "x", 1, STATS_ALIGN + 1) == 1);
+  close(fd);
+
+  fail_unless(read_activity_stats(&read, file) != 0);
+  fail_unless(read == NULL);
+
+  unlink(file);
+  destroy_activity_stats(activity);
+}
+END_TEST
+
+// files in version 1 format can still be read
+START_TEST(read_stats_v1_test)
+{
+  char file[] = "/tmp/lvmts_test_XXXXXX";
+  struct activity_stats *read = NULL;
+  uint64_t header[2] = { FILE_MAGIC, 2 };
+  uint32_t pad[3] = { 0 };
+  uint64_t time;
+  float score;
+
+  FILE *f = fdopen(mkstemp(file), "w");
+  fail_unless(f != NULL);
+  fwrite(header, sizeof(header), 1, f);
+  fwrite(pad, sizeof(pad), 1, f);
+  for (int i=0; i < 2; i++) {
+    time = 10 + i;
+    score = 2 + i;
+    fwrite(&time, sizeof(time), 1, f);
+    fwrite(&score, sizeof(score), 1, f);
+    time = 20 + i;
+    score = 4 + i;
+    fwrite(&time, sizeof(time), 1, f);
+    fwrite(&score, sizeof(score), 1, f);
+  }
+  fclose(f);
+
+  fail_unless(read_activity_stats(&read, file) == 0);
+  fail_unless(read->len == 2);
+  fail_unless(read->block[1].read_time == 11);
+  fail_unless(read->block[1].read_score == 3);
+  fail_unless(read->block[1].write_time == 21);
+  fail_unless(read->block[1].write_score == 5);
+  fail_unless(read->lv_name[0] == '\0');
+
+  unlink(file);
+  destroy_activity_stats(read);
+}
+END_TEST
+
+// changes saved in journal are applied when reading statistics
+START_TEST(journal_stats_test)
+{
+  char file[] = "/tmp/lvmts_test_XXXXXX";
+  struct activity_stats *activity = new_activity_stats();
+  struct activity_stats *read = NULL;
+
+  close(mkstemp(file));
+  char *journal = get_journal_file_name(file);
+  fail_unless(journal != NULL);
+
+  fail_unless(add_block_read(activity, 2, 100, 1000, 16) == 0);
+  fail_unless(write_activity_stats(activity, file) == 0);
+  fail_unless(activity->dirty[0] == 0);
+
+  fail_unless(add_block_write(activity, 70, 200, 1000, 8) == 0);
+  fail_unless(add_block_discard(activity, 2, 1, 2) == 0);
+  fail_unless(activity->dirty[0] == 1 << 2);
+  fail_unless(activity->dirty[1] == 1 << 6);
+  fail_unless(append_activity_journal(activity, journal) == 0);
+  fail_unless(activity->dirty[1] == 0);
+  fail_unless(add_block_read(activity, 3, 300, 1000, 4) == 0);
+  fail_unless(append_activity_journal(activity, journal) == 0);
+  fail_unless(activity->generation == 3);
+
+  fail_unless(read_activity_stats(&read, file) == 0);
+  fail_unless(read->len == 71);
+  fail_unless(read->generation == 3);
+  fail_unless(read->block[2].read_score == 8);
+  fail_unless(read->discard[2] == 1);
+  fail_unless(read->block[3].read_score == 4);
+  fail_unless(read->block[70].write_time == 200);
+  destroy_activity_stats(read);
+  read = NULL;
+
+  // journal of an older file is ignored
+  fail_unless(add_block_read(activity, 4, 400, 1000, 4) == 0);
+  activity->block[3].read_score = 1;
+  fail_unless(write_activity_stats(activity, file) == 0);
+  fail_unless(read_activity_stats(&read, file) == 0);
+  fail_unless(read->block[3].read_score == 1);
+  fail_unless(read->generation == 4);
+  destroy_activity_stats(read);
+  read = NULL;
+
+  // damaged tail of journal is skipped, forcing full write
+  unlink(journal);
+  fail_unless(add_block_read(activity, 5, 500, 1000, 4) == 0);
+  fail_unless(append_activity_journal(activity, journal) == 0);
+  int fd = open(journal, O_WRONLY | O_APPEND);
+  fail_unless(write(fd, "garbage", 7) == 7);
+  close(fd);
+  fail_unless(read_activity_stats(&read, file) == 0);
+  fail_unless(read->block[5].read_score == 4);
+  fail_unless(read->base_generation == 0);
+  destroy_activity_stats(read);
+
+  unlink(journal);
+  unlink(file);
+  free(journal);
+  destroy_activity_stats(activity);
+}
+END_TEST
+
+// sparse statistics saved compressed take little space and read back intact
+START_TEST(compressed_stats_test)
+{
+  char file[] = "/tmp/lvmts_test_XXXXXX";
+  struct activity_stats *activity = new_activity_stats();
+  struct activity_stats *read = NULL;
+  struct stat st;
+
+  close(mkstemp(file));
+
+  fail_unless(add_block_io(activity, 1, 1000, 1000, 16, 512, T_WRITE) == 0);
+  fail_unless(add_block_read(activity, 2, 900, 1000, 8) == 0);
+  fail_unless(add_block_read(activity, 5000, 1100, 1000, 4) == 0);
+  fail_unless(add_block_read(activity, 99999, 1200, 1000, 2) == 0);
+  activity->compress = 1;
+
+  fail_unless(write_activity_stats(activity, file) == 0);
+  fail_unless(stat(file, &st) == 0);
+  fail_unless(st.st_size < 100000 * sizeof(struct block_activity) / 10);
+
+  fail_unless(read_activity_stats(&read, file) == 0);
+  fail_unless(read->len == 100000);
+  fail_unless(!memcmp(read->block, activity->block,
+        sizeof(struct block_activity) * activity->len));
+  fail_unless(!memcmp(read->bytes, activity->bytes,
+        sizeof(struct block_bytes) * activity->len));
+
+  unlink(file);
+  destroy_activity_stats(read);
+  destroy_activity_stats(activity);
+}
+END_TEST
+
+// best blocks found by streaming the file match those from loaded stats
+START_TEST(stream_best_blocks_test)
+{
+  char file[] = "/tmp/lvmts_test_XXXXXX";
+  struct activity_stats *activity = new_activity_stats_s(9999);
+  struct block_scores *bs = NULL;
+  struct block_scores *streamed = NULL;
+  size_t found;
+  time_t now = time(NULL);
+
+  close(mkstemp(file));
+  char *journal = get_journal_file_name(file);
+
+  for (size_t i=0; i < activity->len; i++) {
+    activity->block[i].read_time = now;
+    activity->block[i].read_score = (i * 7919) % 1000;
+  }
+
+  fail_unless(get_best_blocks(activity, &bs, 10, 1, 10, 1000000) == 0);
+
+  for (int compress=0; compress < 2; compress++) {
+    activity->compress = compress;
+    fail_unless(write_activity_stats(activity, file) == 0);
+    fail_unless(get_best_blocks_from_file(file, &streamed, 10, &found, 1, 10,
+          1000000, INFINITY) == 0);
+    fail_unless(found == 10);
+    for (int i=0; i < 10; i++)
+      fail_unless(streamed[i].offset == bs[i].offset);
+  }
+
+  // records in journal override the ones in file
+  fail_unless(add_block_read(activity, 5, now, 1000000, 5000) == 0);
+  fail_unless(add_block_write(activity, 12000, now, 1000000, 400) == 0);
+  fail_unless(append_activity_journal(activity, journal) == 0);
+
+  fail_unless(get_best_blocks_from_file(file, &streamed, 2, &found, 1, 10,
+        1000000, INFINITY) == 0);
+  fail_unless(found == 2);
+  fail_unless(streamed[0].offset == 5);
+  fail_unless(streamed[1].offset == 12000);
+
+  // all blocks with score not higher than max
+  fail_unless(get_best_blocks_from_file(file, &streamed, 10, &found, 1, 10,
+        1000000, 3000) == 0);
+  fail_unless(streamed[0].offset == bs[0].offset);
+
+  unlink(journal);
+  unlink(file);
+  free(journal);
+  free(bs);
+  free(streamed);
+  destroy_activity_stats(activity);
+}
+END_TEST
+
+// snapshots in archive can be found by time and compared with each other
+START_TEST(archive_stats_test)
+{
+  char file[] = "/tmp/lvmts_test_XXXXXX";
+  char dir[] = "/tmp/lvmts_archive_XXXXXX";
+  struct activity_stats *activity = new_activity_stats_s(100);
+  struct block_scores *bs = NULL;
+  time_t *times;
+  size_t count;
+  size_t found;
+  char *old_file;
+  char *new_file;
+  time_t now = time(NULL);
+
+  close(mkstemp(file));
+  fail_unless(mkdtemp(dir) != NULL);
+
+  for (size_t i=0; i < activity->len; i++) {
+    activity->block[i].read_time = now;
+    activity->block[i].read_score = 1000 - i;
+  }
+
+  fail_unless(write_activity_stats(activity, file) == 0);
+  fail_unless(archive_activity_stats(file, dir, 0) == 0);
+
+  fail_unless(list_stats_archive(dir, &times, &count) == 0);
+  fail_unless(count == 1);
+  fail_unless(times[0] >= now);
+  old_file = get_archive_file_name(dir, times[0]);
+  free(times);
+
+  fail_unless(find_archived_stats(dir, now - 1) == NULL);
+  new_file = find_archived_stats(dir, now + 1000);
+  fail_unless(new_file != NULL);
+  fail_unless(strcmp(new_file, old_file) == 0);
+  free(new_file);
+
+  // most of activity between snapshots happened on the least active block
+  fail_unless(add_block_read(activity, 99, now, 1000000, 100) == 0);
+  fail_unless(add_block_read(activity, 10, now, 1000000, 10) == 0);
+  new_file = get_archive_file_name(dir, now + 10);
+  fail_unless(write_activity_stats(activity, new_file) == 0);
+
+  fail_unless(get_best_blocks_between_files(old_file, new_file, &bs, 2,
+        &found, 1, 10, 1000000, INFINITY, now) == 0);
+  fail_unless(found == 2);
+  fail_unless(bs[0].offset == 99);
+  fail_unless(bs[1].offset == 10);
+
+  // snapshots outside of retention period are removed
+  char *ancient = get_archive_file_name(dir, now - 100);
+  fail_unless(write_activity_stats(activity, ancient) == 0);
+  fail_unless(archive_activity_stats(file, dir, 50) == 0);
+  fail_unless(access(ancient, F_OK) != 0);
+  fail_unless(list_stats_archive(dir, &times, &count) == 0);
+  fail_unless(count == 2);
+  fail_unless(times[0] >= now);
+  free(times);
+  free(ancient);
+
+  unlink(old_file);
+  unlink(new_file);
+  unlink(file);
+  fail_unless(rmdir(dir) == 0);
+  free(old_file);
+  free(new_file);
   free(bs);
+  destroy_activity_stats(activity);
+}
+END_TEST
+
+// scores of the same block from several collectors are decayed and summed
+START_TEST(merge_stats_test)
+{
+  struct activity_stats *stats[2];
+  struct activity_stats *merged = NULL;
+  double mean_lifetime = 1000;
+
+  stats[0] = new_activity_stats_s(3);
+  stats[1] = new_activity_stats_s(7);
+  set_activity_stats_volume(stats[0], "vg", "lv", 4096);
+
+  fail_unless(add_block_read(stats[0], 2, 1000, mean_lifetime, 10) == 0);
+  fail_unless(add_block_read(stats[1], 2, 2000, mean_lifetime, 5) == 0);
+  fail_unless(add_block_write(stats[1], 6, 1500, mean_lifetime, 3) == 0);
+
+  fail_unless(merge_activity_stats(&merged, stats, 2, mean_lifetime, 3) == 0);
+
+  fail_unless(merged->len == 8);
+  fail_unless(strcmp(merged->vg_name, "vg") == 0);
+  fail_unless(merged->extent_size == 4096);
+  fail_unless(merged->block[2].read_time == 2000);
+  fail_unless(fabs(merged->block[2].read_score - (5 + 10 * exp(-1))) < 0.0001);
+  fail_unless(merged->block[6].write_time == 1500);
+  fail_unless(merged->block[6].write_score == 3);
+  fail_unless(merged->block[1].read_score == 0);
+  destroy_activity_stats(merged);
+
+  // stats of different volumes can't be merged
+  set_activity_stats_volume(stats[1], "vg", "other", 4096);
+  fail_unless(merge_activity_stats(&merged, stats, 2, mean_lifetime, 1)
+      == EINVAL);
+
+  destroy_activity_stats(stats[0]);
+  destroy_activity_stats(stats[1]);
+}
+END_TEST
+
+static int
+count_records(void *arg, int64_t off, const struct block_activity *ba)
+{
+  (*(int64_t *)arg)++;
+  return 0;
+}
+
+static int
+skip_all_chunks(void *arg, int64_t first, const struct block_activity *summary)
+{
+  return 1;
+}
+
+// skipping chunks using their summaries doesn't change selected blocks
+START_TEST(chunk_summary_test)
+{
+  char file[] = "/tmp/lvmts_test_XXXXXX";
+  struct activity_stats *activity = new_activity_stats_s(10 * CHUNK_BLOCKS - 1);
+  struct block_scores *bs = malloc(sizeof(struct block_scores) * 100);
+  struct block_scores *all = malloc(sizeof(struct block_scores) * 100);
+  struct block_scores *streamed = NULL;
+  struct block_activity *summary;
+  time_t now = time(NULL);
+  int64_t count;
+  size_t found;
+
+  close(mkstemp(file));
+  char *journal = get_journal_file_name(file);
+
+  srandom(6);
+  for (int64_t i=0; i < activity->len; i++) {
+    int hot = i / CHUNK_BLOCKS == 3 || i / CHUNK_BLOCKS == 7;
+    activity->block[i].read_score = random() % (hot ? 5000 : 10);
+    activity->block[i].read_time = now - random() % 100000;
+    activity->block[i].write_score = random() % 3;
+    activity->block[i].write_time = now - random() % 100000;
+  }
+
+  fail_unless(summarize_activity_stats(activity) == 0);
+  fail_unless(activity->summary[3].read_score >= 10);
+  fail_unless(activity->summary[4].read_score < 10);
+
+  // without summaries all blocks are scored
+  summary = activity->summary;
+  activity->summary = NULL;
+  fail_unless(select_best_blocks(activity, all, 100, &found, 1, 10, 100000,
+        INFINITY, 1) == 0);
+  activity->summary = summary;
+  for (int threads=1; threads <= 3; threads += 2) {
+    fail_unless(select_best_blocks(activity, bs, 100, &found, 1, 10, 100000,
+          INFINITY, threads) == 0);
+    fail_unless(found == 100);
+    for (int i=0; i < 100; i++)
+      fail_unless(bs[i].offset == all[i].offset);
+  }
+
+  // summaries follow new activity
+  fail_unless(add_block_read(activity, 5 * CHUNK_BLOCKS + 1, now, 100000,
+        100000) == 0);
+  fail_unless(get_best_blocks(activity, &bs, 100, 1, 10, 100000) == 0);
+  fail_unless(bs[0].offset == 5 * CHUNK_BLOCKS + 1);
+
+  for (int compress=0; compress < 2; compress++) {
+    activity->compress = compress;
+    fail_unless(write_activity_stats(activity, file) == 0);
+    fail_unless(get_best_blocks_from_file(file, &streamed, 100, &found, 1, 10,
+          100000, INFINITY) == 0);
+    fail_unless(found == 100);
+    for (int i=0; i < 100; i++)
+      fail_unless(streamed[i].offset == bs[i].offset);
+
+    count = 0;
+    fail_unless(stream_activity_stats_filtered(file, count_records,
+          skip_all_chunks, &count) == 0);
+    fail_unless(count == 0);
+  }
+
+  // chunks with blocks changed in journal can't be skipped
+  fail_unless(add_block_write(activity, CHUNK_BLOCKS + 5, now, 100000, 1) == 0);
+  fail_unless(append_activity_journal(activity, journal) == 0);
+  count = 0;
+  fail_unless(stream_activity_stats_filtered(file, count_records,
+        skip_all_chunks, &count) == 0);
+  fail_unless(count == CHUNK_BLOCKS);
+
+  unlink(journal);
+  unlink(file);
+  free(journal);
+  free(bs);
+  free(all);
+  free(streamed);
+  destroy_activity_stats(activity);
+}
+END_TEST
+
+// blocks never accessed are skipped by passes over all blocks and the
+// bitmap of accessed blocks is saved with statistics
+START_TEST(touched_blocks_test)
+{
+  char file[] = "/tmp/lvmts_test_XXXXXX";
+  struct activity_stats *activity = new_activity_stats();
+  struct activity_stats *read = NULL;
+  struct block_scores *bs = NULL;
+  struct block_scores *all = NULL;
+  uint64_t *touched;
+  time_t now = time(NULL);
+  int64_t off, end;
+
+  close(mkstemp(file));
+  char *journal = get_journal_file_name(file);
+
+  fail_unless(index_touched_blocks(activity) == 0);
+  fail_unless(add_block_read(activity, 3, now, 100000, 1) == 0);
+  fail_unless(add_block_read(activity, 70, now, 100000, 5) == 0);
+  fail_unless(add_block_write(activity, 71, now, 100000, 1) == 0);
+  fail_unless(add_block_read(activity, 200000, now, 100000, 2) == 0);
+
+  off = next_touched_blocks(activity, 0, &end);
+  fail_unless(off == 3 && end == 4);
+  off = next_touched_blocks(activity, end, &end);
+  fail_unless(off == 70 && end == 72);
+  off = next_touched_blocks(activity, end, &end);
+  fail_unless(off == 200000 && end == 200001);
+  fail_unless(next_touched_blocks(activity, end, &end) == activity->len);
+
+  // not accessed blocks fill the rest of best blocks, as before
+  fail_unless(get_best_blocks(activity, &bs, 10, 1, 10, 100000) == 0);
+  touched = activity->touched;
+  activity->touched = NULL;
+  fail_unless(get_best_blocks(activity, &all, 10, 1, 10, 100000) == 0);
+  activity->touched = touched;
+  fail_unless(bs[0].offset == 71);
+  for (int i=0; i < 10; i++)
+    fail_unless(bs[i].offset == all[i].offset);
+
+  for (int compress=0; compress < 2; compress++) {
+    activity->compress = compress;
+    fail_unless(write_activity_stats(activity, file) == 0);
+    fail_unless(read_activity_stats(&read, file) == 0);
+    fail_unless(read->len == activity->len);
+    fail_unless(read->touched_words == (read->len + 63) / 64);
+    fail_unless(memcmp(read->touched, activity->touched,
+          sizeof(uint64_t) * activity->touched_words) == 0);
+    fail_unless(memcmp(read->block, activity->block,
+          sizeof(struct block_activity) * activity->len) == 0);
+    destroy_activity_stats(read);
+  }
+
+  // blocks from journal are marked too
+  fail_unless(add_block_write(activity, 5000, now, 100000, 1) == 0);
+  fail_unless(append_activity_journal(activity, journal) == 0);
+  fail_unless(read_activity_stats(&read, file) == 0);
+  off = next_touched_blocks(read, 72, &end);
+  fail_unless(off == 5000 && end == 5001);
+  destroy_activity_stats(read);
+
+  unlink(journal);
+  unlink(file);
+  free(journal);
+  free(bs);
+  free(all);
+  destroy_activity_stats(activity);
 }
 END_TEST
 
@@ -610,6 +1409,56 @@ block_scores_suite(void)
   tcase_add_test(tc, replace_block_end_test);
   tcase_add_test(tc, replace_block_middle_test);
   tcase_add_test(tc, replace_block_none_test);
+  tcase_add_test(tc, replace_block_tie_test);
+  suite_add_tcase(s, tc);
+
+  tc = tcase_create("selecting block_scores");
+  tcase_add_test(tc, select_best_blocks_tie_test);
+  tcase_add_test(tc, select_best_blocks_test);
+  tcase_add_test(tc, score_kernels_test);
+  tcase_add_test(tc, hot_index_test);
+  tcase_add_test(tc, score_histogram_test);
+  tcase_add_test(tc, rank_cursor_test);
+  suite_add_tcase(s, tc);
+
+  tc = tcase_create("discarding blocks");
+  tcase_add_test(tc, discard_block_test);
+  tcase_add_test(tc, discard_block_write_test);
+  suite_add_tcase(s, tc);
+
+  tc = tcase_create("counting bytes");
+  tcase_add_test(tc, add_block_bytes_test);
+  tcase_add_test(tc, add_block_weighted_io_test);
+  suite_add_tcase(s, tc);
+
+  tc = tcase_create("activity profile");
+  tcase_add_test(tc, profile_block_test);
+  suite_add_tcase(s, tc);
+
+  tc = tcase_create("activity trend");
+  tcase_add_test(tc, trend_block_test);
+  suite_add_tcase(s, tc);
+
+  tc = tcase_create("co-access groups");
+  tcase_add_test(tc, coaccess_group_test);
+  tcase_add_test(tc, coaccess_group_limit_test);
+  suite_add_tcase(s, tc);
+
+  tc = tcase_create("spatial smoothing");
+  tcase_add_test(tc, smooth_block_scores_test);
+  tcase_add_test(tc, smooth_group_block_scores_test);
+  suite_add_tcase(s, tc);
+
+  tc = tcase_create("stats file");
+  tcase_add_test(tc, write_read_stats_test);
+  tcase_add_test(tc, read_stats_v1_test);
+  tcase_add_test(tc, journal_stats_test);
+  tcase_add_test(tc, compressed_stats_test);
+  tcase_add_test(tc, stream_best_blocks_test);
+  tcase_add_test(tc, archive_stats_test);
+  tcase_add_test(tc, merge_stats_test);
+  tcase_add_test(tc, chunk_summary_test);
+  tcase_add_test(tc, touched_blocks_test);
   suite_add_tcase(s, tc);
 
   return s;
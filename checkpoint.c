@@ -0,0 +1,375 @@
+/*
+ * Copyright (C) 2012 Hubert Kario <kario@wsisiz.edu.pl>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "checkpoint.h"
+
+// number of IOs submitted together
+#define CHECKPOINT_QUEUE 64
+// regions are written in pieces of this size
+#define CHECKPOINT_IO_SIZE (4*1024*1024)
+
+struct checkpoint_writer {
+	int ring_fd; /**< -1 if io_uring isn't available */
+	unsigned entries;
+	void *sq_ring;
+	size_t sq_ring_len;
+	void *cq_ring;
+	size_t cq_ring_len;
+	struct io_uring_sqe *sqes;
+	size_t sqes_len;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+};
+
+/** single write (or sync, if buf is NULL) of checkpoint */
+struct checkpoint_io {
+	int fd;
+	const void *buf;
+	size_t len;
+	off_t offset;
+	int res;
+};
+
+static void
+unmap_ring(struct checkpoint_writer *cw)
+{
+	if (cw->sqes)
+		munmap(cw->sqes, cw->sqes_len);
+	if (cw->cq_ring && cw->cq_ring != cw->sq_ring)
+		munmap(cw->cq_ring, cw->cq_ring_len);
+	if (cw->sq_ring)
+		munmap(cw->sq_ring, cw->sq_ring_len);
+	if (cw->ring_fd >= 0)
+		close(cw->ring_fd);
+
+	cw->sqes = NULL;
+	cw->cq_ring = NULL;
+	cw->sq_ring = NULL;
+	cw->ring_fd = -1;
+}
+
+// set up io_uring with raw system calls, on failure the writer falls back
+// to pwrite()
+static int
+setup_ring(struct checkpoint_writer *cw)
+{
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+
+	cw->ring_fd = syscall(__NR_io_uring_setup, CHECKPOINT_QUEUE, &p);
+	if (cw->ring_fd < 0)
+		return -1;
+
+	cw->entries = p.sq_entries;
+	cw->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cw->cq_ring_len = p.cq_off.cqes
+		+ p.cq_entries * sizeof(struct io_uring_cqe);
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (cw->cq_ring_len > cw->sq_ring_len)
+			cw->sq_ring_len = cw->cq_ring_len;
+		cw->cq_ring_len = cw->sq_ring_len;
+	}
+
+	cw->sq_ring = mmap(NULL, cw->sq_ring_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, cw->ring_fd, IORING_OFF_SQ_RING);
+	if (cw->sq_ring == MAP_FAILED) {
+		cw->sq_ring = NULL;
+		goto err;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		cw->cq_ring = cw->sq_ring;
+	else {
+		cw->cq_ring = mmap(NULL, cw->cq_ring_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, cw->ring_fd, IORING_OFF_CQ_RING);
+		if (cw->cq_ring == MAP_FAILED) {
+			cw->cq_ring = NULL;
+			goto err;
+		}
+	}
+
+	cw->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	cw->sqes = mmap(NULL, cw->sqes_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, cw->ring_fd, IORING_OFF_SQES);
+	if (cw->sqes == MAP_FAILED) {
+		cw->sqes = NULL;
+		goto err;
+	}
+
+	cw->sq_head = (unsigned *)((char *)cw->sq_ring + p.sq_off.head);
+	cw->sq_tail = (unsigned *)((char *)cw->sq_ring + p.sq_off.tail);
+	cw->sq_mask = (unsigned *)((char *)cw->sq_ring + p.sq_off.ring_mask);
+	cw->sq_array = (unsigned *)((char *)cw->sq_ring + p.sq_off.array);
+	cw->cq_head = (unsigned *)((char *)cw->cq_ring + p.cq_off.head);
+	cw->cq_tail = (unsigned *)((char *)cw->cq_ring + p.cq_off.tail);
+	cw->cq_mask = (unsigned *)((char *)cw->cq_ring + p.cq_off.ring_mask);
+	cw->cqes = (struct io_uring_cqe *)((char *)cw->cq_ring + p.cq_off.cqes);
+
+	return 0;
+
+err:
+	unmap_ring(cw);
+	return -1;
+}
+
+struct checkpoint_writer *
+new_checkpoint_writer(void)
+{
+	struct checkpoint_writer *cw;
+
+	cw = calloc(sizeof(struct checkpoint_writer), 1);
+	if (!cw)
+		return NULL;
+
+	if (setup_ring(cw))
+		fprintf(stderr, "io_uring not available, using synchronous "
+			"writes for checkpoints\n");
+
+	return cw;
+}
+
+void
+free_checkpoint_writer(struct checkpoint_writer *cw)
+{
+	if (!cw)
+		return;
+
+	unmap_ring(cw);
+	free(cw);
+}
+
+// submit IOs to ring and wait for their completion on the calling thread,
+// results are saved in the `res` fields
+static int
+uring_submit_and_wait(struct checkpoint_writer *cw, struct checkpoint_io *io,
+    unsigned count)
+{
+	unsigned tail = *cw->sq_tail;
+	unsigned done = 0;
+
+	assert(count <= cw->entries);
+
+	for (unsigned i=0; i < count; i++, tail++) {
+		unsigned idx = tail & *cw->sq_mask;
+		struct io_uring_sqe *sqe = &cw->sqes[idx];
+
+		memset(sqe, 0, sizeof(struct io_uring_sqe));
+		sqe->fd = io[i].fd;
+		sqe->user_data = i;
+		if (io[i].buf) {
+			sqe->opcode = IORING_OP_WRITE;
+			sqe->addr = (unsigned long)io[i].buf;
+			sqe->len = io[i].len;
+			sqe->off = io[i].offset;
+		} else
+			sqe->opcode = IORING_OP_FSYNC;
+		cw->sq_array[idx] = idx;
+	}
+	__atomic_store_n(cw->sq_tail, tail, __ATOMIC_RELEASE);
+
+	for (unsigned submitted = 0; submitted < count || done < count;) {
+		int n = syscall(__NR_io_uring_enter, cw->ring_fd,
+			count - submitted, count - done, IORING_ENTER_GETEVENTS,
+			NULL, 0);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return EIO;
+		}
+		submitted += n;
+
+		unsigned head = *cw->cq_head;
+		unsigned cq_tail = __atomic_load_n(cw->cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != cq_tail; head++) {
+			struct io_uring_cqe *cqe = &cw->cqes[head & *cw->cq_mask];
+			io[cqe->user_data].res = cqe->res;
+			done++;
+		}
+		__atomic_store_n(cw->cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	return 0;
+}
+
+// perform IOs, using io_uring if available, failed and short writes (and
+// everything if io_uring can't be used) are redone synchronously
+static int
+do_checkpoint_io(struct checkpoint_writer *cw, struct checkpoint_io *io,
+    unsigned count)
+{
+	int ret = 0;
+
+	for (unsigned i=0; i < count; i++)
+		io[i].res = -EAGAIN;
+
+	if (cw->ring_fd >= 0 && uring_submit_and_wait(cw, io, count))
+		unmap_ring(cw);
+
+	for (unsigned i=0; i < count && !ret; i++) {
+		if (io[i].buf) {
+			if (io[i].res >= 0 && (size_t)io[i].res == io[i].len)
+				continue;
+			// kernel without IORING_OP_WRITE, don't try it again
+			if (io[i].res == -EINVAL)
+				unmap_ring(cw);
+			ret = pwrite_all(io[i].fd, io[i].buf, io[i].len,
+				io[i].offset);
+		} else {
+			if (io[i].res == 0)
+				continue;
+			if (fsync(io[i].fd))
+				ret = EIO;
+		}
+	}
+
+	return ret;
+}
+
+// write regions of image, then the header and sync the file
+static int
+write_stats_image(struct checkpoint_writer *cw, int fd,
+    struct stats_image *image)
+{
+	struct checkpoint_io io[CHECKPOINT_QUEUE];
+	unsigned count = 0;
+	unsigned queue = cw->ring_fd >= 0 && cw->entries < CHECKPOINT_QUEUE ?
+		cw->entries : CHECKPOINT_QUEUE;
+	int ret;
+
+	// regions in large pieces, header (the last part) only after them
+	for (size_t i=0; i + 1 < image->parts; i++) {
+		struct stats_image_part *part = &image->part[i];
+
+		for (size_t done=0; done < part->len; done += CHECKPOINT_IO_SIZE) {
+			io[count].fd = fd;
+			io[count].buf = (char *)part->buf + done;
+			io[count].len = part->len - done < CHECKPOINT_IO_SIZE ?
+				part->len - done : CHECKPOINT_IO_SIZE;
+			io[count].offset = part->offset + done;
+
+			if (++count < queue)
+				continue;
+
+			ret = do_checkpoint_io(cw, io, count);
+			if (ret)
+				return ret;
+			count = 0;
+		}
+	}
+
+	if (count) {
+		ret = do_checkpoint_io(cw, io, count);
+		if (ret)
+			return ret;
+	}
+
+	io[0].fd = fd;
+	io[0].buf = image->part[image->parts - 1].buf;
+	io[0].len = image->part[image->parts - 1].len;
+	io[0].offset = image->part[image->parts - 1].offset;
+	ret = do_checkpoint_io(cw, io, 1);
+	if (ret)
+		return ret;
+
+	io[0].buf = NULL;
+	return do_checkpoint_io(cw, io, 1);
+}
+
+// make rename of file durable
+static int
+sync_parent_dir(struct checkpoint_writer *cw, const char *file)
+{
+	struct checkpoint_io io;
+	char *tmp = strdup(file);
+	int ret;
+
+	if (!tmp)
+		return ENOMEM;
+
+	io.fd = open(dirname(tmp), O_RDONLY | O_DIRECTORY);
+	free(tmp);
+	if (io.fd < 0)
+		return EIO;
+
+	io.buf = NULL;
+	ret = do_checkpoint_io(cw, &io, 1);
+	close(io.fd);
+
+	return ret;
+}
+
+int
+checkpoint_activity_stats(struct checkpoint_writer *cw,
+        struct activity_stats *activity, const char *tmp_file,
+        const char *file)
+{
+	assert(cw);
+	assert(activity);
+
+	struct stats_image *image;
+	int ret;
+	int fd;
+
+	fd = open(tmp_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return EIO;
+
+	ret = snapshot_activity_stats(activity, &image);
+	if (ret) {
+		close(fd);
+		unlink(tmp_file);
+		return ret;
+	}
+
+	ret = write_stats_image(cw, fd, image);
+	close(fd);
+	free_stats_image(image);
+
+	// data is durable only now, so it may replace the old file
+	if (!ret && rename(tmp_file, file))
+		ret = EIO;
+	if (!ret)
+		ret = sync_parent_dir(cw, file);
+
+	if (ret) {
+		unlink(tmp_file);
+		// file doesn't hold the changes, next save must be a full one
+		invalidate_activity_stats_base(activity);
+	}
+
+	return ret;
+}
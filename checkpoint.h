@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2012 Hubert Kario <kario@wsisiz.edu.pl>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ */
+#ifndef _CHECKPOINT_H_
+#define _CHECKPOINT_H_
+#include "activity_stats.h"
+
+/**
+ * Writer of statistics checkpoints, uses io_uring when kernel supports it,
+ * plain pwrite() otherwise
+ *
+ * Writes are submitted to io_uring in batches, but every batch is waited
+ * for before the next one: a checkpoint blocks the calling thread until it
+ * is durable, no IO is left in flight between checkpoints.
+ */
+struct checkpoint_writer;
+
+struct checkpoint_writer *new_checkpoint_writer(void);
+
+void free_checkpoint_writer(struct checkpoint_writer *cw);
+
+/**
+ * Save snapshot of statistics to temporary file, make it durable and only
+ * then rename it to `file` and sync the directory
+ *
+ * Statistics are locked only for the time needed to copy them.
+ */
+int checkpoint_activity_stats(struct checkpoint_writer *cw,
+        struct activity_stats *activity, const char *tmp_file,
+        const char *file);
+
+#endif /* _CHECKPOINT_H_ */
@@ -55,6 +55,7 @@ free_program_params(struct program_params *pp)
         free(pp->conf_file_path);
 
     cfg_free(pp->cfg);
+    free(pp->pvs);
 
     if (pp->lvm2_handle)
         lvm2_exit(pp->lvm2_handle);
@@ -78,6 +79,34 @@ get_write_multiplier(struct program_params *pp, const char *lv_name)
                          "writeMultiplier");
 }
 
+float
+get_sync_multiplier(struct program_params *pp, const char *lv_name)
+{
+    return cfg_getfloat(cfg_gettsec(pp->cfg, "volume", lv_name),
+                         "syncMultiplier");
+}
+
+float
+get_metadata_multiplier(struct program_params *pp, const char *lv_name)
+{
+    return cfg_getfloat(cfg_gettsec(pp->cfg, "volume", lv_name),
+                         "metadataMultiplier");
+}
+
+float
+get_flush_multiplier(struct program_params *pp, const char *lv_name)
+{
+    return cfg_getfloat(cfg_gettsec(pp->cfg, "volume", lv_name),
+                         "flushMultiplier");
+}
+
+float
+get_readahead_multiplier(struct program_params *pp, const char *lv_name)
+{
+    return cfg_getfloat(cfg_gettsec(pp->cfg, "volume", lv_name),
+                         "readaheadMultiplier");
+}
+
 float
 get_hit_score(struct program_params *pp, const char *lv_name)
 {
@@ -92,6 +121,51 @@ get_score_scaling_factor(struct program_params *pp, const char *lv_name)
                          "timeExponent");
 }
 
+int
+get_io_rules_count(struct program_params *pp, const char *lv_name)
+{
+    cfg_t *tmp = cfg_gettsec(pp->cfg, "volume", lv_name);
+    assert(tmp);
+
+    return cfg_size(tmp, "ioRule");
+}
+
+const char *
+get_io_rule_process(struct program_params *pp, const char *lv_name, int rule)
+{
+    cfg_t *tmp = cfg_gettsec(pp->cfg, "volume", lv_name);
+    assert(tmp);
+
+    return cfg_getstr(cfg_getnsec(tmp, "ioRule", rule), "process");
+}
+
+long int
+get_io_rule_pid(struct program_params *pp, const char *lv_name, int rule)
+{
+    cfg_t *tmp = cfg_gettsec(pp->cfg, "volume", lv_name);
+    assert(tmp);
+
+    return cfg_getint(cfg_getnsec(tmp, "ioRule", rule), "pid");
+}
+
+const char *
+get_io_rule_cgroup(struct program_params *pp, const char *lv_name, int rule)
+{
+    cfg_t *tmp = cfg_gettsec(pp->cfg, "volume", lv_name);
+    assert(tmp);
+
+    return cfg_getstr(cfg_getnsec(tmp, "ioRule", rule), "cgroup");
+}
+
+float
+get_io_rule_weight(struct program_params *pp, const char *lv_name, int rule)
+{
+    cfg_t *tmp = cfg_gettsec(pp->cfg, "volume", lv_name);
+    assert(tmp);
+
+    return cfg_getfloat(cfg_getnsec(tmp, "ioRule", rule), "weight");
+}
+
 const char *
 get_volume_lv(struct program_params *pp, const char *lv_name)
 {
@@ -197,19 +271,50 @@ get_tier_device(struct program_params *pp, const char *lv_name, int tier)
 int
 get_device_tier(struct program_params *pp, const char *lv_name, const char *dev)
 {
-    cfg_t *tmp = cfg_gettsec(pp->cfg, "volume", lv_name);
-    assert(tmp);
+    return get_pv_tier(pp, get_pv_id(pp, lv_name, dev));
+}
 
-    cfg_t *pv_cfg;
+int
+get_pv_id(struct program_params *pp, const char *lv_name, const char *dev)
+{
+    for (size_t i=0; i < pp->pvs_len; i++)
+        if (!strcmp(pp->pvs[i].lv_name, lv_name)
+            && !strcmp(pp->pvs[i].path, dev))
+            return i;
 
-    for (size_t i=0; i < cfg_size(tmp, "pv"); i++) {
-        pv_cfg = cfg_getnsec(tmp, "pv", i);
-        if (!strcmp(cfg_getstr(pv_cfg, "path"), dev))
-            return cfg_getint(pv_cfg, "tier");
-    }
     return -1;
 }
 
+int
+get_pv_tier(struct program_params *pp, int pv_id)
+{
+    if (pv_id < 0)
+        return -1;
+
+    assert((size_t)pv_id < pp->pvs_len);
+    return pp->pvs[pv_id].tier;
+}
+
+float
+get_pv_pinning_score(struct program_params *pp, int pv_id)
+{
+    if (pv_id < 0)
+        return 0;
+
+    assert((size_t)pv_id < pp->pvs_len);
+    return pp->pvs[pv_id].pinning_score;
+}
+
+long int
+get_pv_max_space(struct program_params *pp, int pv_id)
+{
+    if (pv_id < 0)
+        return -1;
+
+    assert((size_t)pv_id < pp->pvs_len);
+    return pp->pvs[pv_id].max_space;
+}
+
 float get_tier_pinning_score(struct program_params *pp, const char *lv_name,
     int tier)
 {
@@ -227,6 +332,160 @@ float get_tier_pinning_score(struct program_params *pp, const char *lv_name,
     return 0;
 }
 
+// return configuration of physical volume at tier, NULL if there's none
+static cfg_t *
+get_tier_cfg(struct program_params *pp, const char *lv_name, int tier)
+{
+    cfg_t *vol_cfg = cfg_gettsec(pp->cfg, "volume", lv_name);
+    assert(vol_cfg);
+
+    cfg_t *pv_cfg;
+
+    for (size_t i=0; i < cfg_size(vol_cfg, "pv"); i++) {
+        pv_cfg = cfg_getnsec(vol_cfg, "pv", i);
+        if (cfg_getint(pv_cfg, "tier") == tier)
+            return pv_cfg;
+    }
+
+    return NULL;
+}
+
+int
+get_cost_model(struct program_params *pp, const char *lv_name)
+{
+    return cfg_getbool(cfg_gettsec(pp->cfg, "volume", lv_name), "costModel");
+}
+
+int
+get_pvwait(struct program_params *pp, const char *lv_name)
+{
+    return cfg_getint(cfg_gettsec(pp->cfg, "volume", lv_name), "pvmoveWait");
+}
+
+int
+get_check_wait(struct program_params *pp, const char *lv_name)
+{
+    return cfg_getint(cfg_gettsec(pp->cfg, "volume", lv_name), "checkWait");
+}
+
+long int
+get_trend_interval(struct program_params *pp, const char *lv_name)
+{
+    return cfg_getint(cfg_gettsec(pp->cfg, "volume", lv_name),
+                      "trendInterval");
+}
+
+float
+get_trend_alpha(struct program_params *pp, const char *lv_name)
+{
+    return cfg_getfloat(cfg_gettsec(pp->cfg, "volume", lv_name), "trendAlpha");
+}
+
+float
+get_trend_beta(struct program_params *pp, const char *lv_name)
+{
+    return cfg_getfloat(cfg_gettsec(pp->cfg, "volume", lv_name), "trendBeta");
+}
+
+int
+get_trend_forecast(struct program_params *pp, const char *lv_name)
+{
+    return cfg_getbool(cfg_gettsec(pp->cfg, "volume", lv_name),
+                       "trendForecast");
+}
+
+float
+get_spatial_share(struct program_params *pp, const char *lv_name)
+{
+    return cfg_getfloat(cfg_gettsec(pp->cfg, "volume", lv_name),
+                        "spatialShare");
+}
+
+int
+get_spatial_radius(struct program_params *pp, const char *lv_name)
+{
+    return cfg_getint(cfg_gettsec(pp->cfg, "volume", lv_name),
+                      "spatialRadius");
+}
+
+long int
+get_coaccess_window(struct program_params *pp, const char *lv_name)
+{
+    return cfg_getint(cfg_gettsec(pp->cfg, "volume", lv_name),
+                      "coAccessWindow");
+}
+
+float
+get_coaccess_threshold(struct program_params *pp, const char *lv_name)
+{
+    return cfg_getfloat(cfg_gettsec(pp->cfg, "volume", lv_name),
+                        "coAccessThreshold");
+}
+
+int
+get_activity_profile(struct program_params *pp, const char *lv_name)
+{
+    return cfg_getbool(cfg_gettsec(pp->cfg, "volume", lv_name),
+                       "activityProfile");
+}
+
+long int
+get_planner_lead(struct program_params *pp, const char *lv_name)
+{
+    return cfg_getint(cfg_gettsec(pp->cfg, "volume", lv_name), "plannerLead");
+}
+
+float
+get_planner_weight(struct program_params *pp, const char *lv_name)
+{
+    return cfg_getfloat(cfg_gettsec(pp->cfg, "volume", lv_name),
+                        "plannerWeight");
+}
+
+float
+get_tier_read_latency(struct program_params *pp, const char *lv_name,
+    int tier)
+{
+    cfg_t *pv_cfg = get_tier_cfg(pp, lv_name, tier);
+    if (!pv_cfg)
+        return 0;
+
+    return cfg_getfloat(pv_cfg, "readLatency");
+}
+
+float
+get_tier_write_latency(struct program_params *pp, const char *lv_name,
+    int tier)
+{
+    cfg_t *pv_cfg = get_tier_cfg(pp, lv_name, tier);
+    if (!pv_cfg)
+        return 0;
+
+    return cfg_getfloat(pv_cfg, "writeLatency");
+}
+
+long int
+get_tier_read_throughput(struct program_params *pp, const char *lv_name,
+    int tier)
+{
+    cfg_t *pv_cfg = get_tier_cfg(pp, lv_name, tier);
+    if (!pv_cfg)
+        return -1;
+
+    return cfg_getint(pv_cfg, "readThroughput");
+}
+
+long int
+get_tier_write_throughput(struct program_params *pp, const char *lv_name,
+    int tier)
+{
+    cfg_t *pv_cfg = get_tier_cfg(pp, lv_name, tier);
+    if (!pv_cfg)
+        return -1;
+
+    return cfg_getint(pv_cfg, "writeThroughput");
+}
+
 // parse time from string, such as "5m", "20s", "3h", "3:10" or "1:15:34"
 // as, respectively: 300, 20, 10800, 11400 and 4534
 // by default assume minutes
@@ -473,6 +732,77 @@ validate_require_positive(cfg_t *cfg, cfg_opt_t *opt)
     return 0;
 }
 
+static int
+validate_require_fraction(cfg_t *cfg, cfg_opt_t *opt)
+{
+    assert(opt->type == CFGT_FLOAT);
+
+    double value = cfg_opt_getnfloat(opt, cfg_opt_size(opt) - 1);
+    if (value <= 0.0 || value > 1.0) {
+        cfg_error(cfg, "Value for option %s must be larger than 0 and not "
+            "larger than 1 in %s section \"%s\"",
+            opt->name, cfg->name, cfg_title(cfg));
+        return -1;
+    }
+
+    return 0;
+}
+
+// gather configuration of PVs of all volumes to single table, so that
+// settings of extents can be found by PV id
+static int
+compile_pv_config(struct program_params *pp)
+{
+    size_t len = 0;
+
+    for (size_t v=0; v < cfg_size(pp->cfg, "volume"); v++)
+        len += cfg_size(cfg_getnsec(pp->cfg, "volume", v), "pv");
+
+    pp->pvs = calloc(sizeof(struct pv_config), len ? len : 1);
+    if (!pp->pvs)
+        return 1;
+    pp->pvs_len = 0;
+
+    for (size_t v=0; v < cfg_size(pp->cfg, "volume"); v++) {
+        cfg_t *vol_cfg = cfg_getnsec(pp->cfg, "volume", v);
+        const char *lv_name = cfg_title(vol_cfg);
+
+        for (size_t i=0; i < cfg_size(vol_cfg, "pv"); i++) {
+            cfg_t *pv_cfg = cfg_getnsec(vol_cfg, "pv", i);
+            struct pv_config *pc = &pp->pvs[pp->pvs_len++];
+            int tier = cfg_getint(pv_cfg, "tier");
+
+            pc->lv_name = lv_name;
+            pc->path = cfg_getstr(pv_cfg, "path");
+            pc->tier = tier;
+            pc->pinning_score = get_tier_pinning_score(pp, lv_name, tier);
+            pc->max_space = get_max_space_tier(pp, lv_name, tier);
+        }
+    }
+
+    return 0;
+}
+
+// check options that can't be used together
+static int
+validate_volumes(cfg_t *cfg)
+{
+    for (size_t v=0; v < cfg_size(cfg, "volume"); v++) {
+        cfg_t *vol_cfg = cfg_getnsec(cfg, "volume", v);
+
+        // profile scores are weighted hit counts, cost model scores are
+        // device time, they can't be added together
+        if (cfg_getbool(vol_cfg, "costModel")
+            && cfg_getint(vol_cfg, "plannerLead") > 0) {
+            fprintf(stderr, "Option plannerLead can't be used with costModel "
+                "in volume section \"%s\"\n", cfg_title(vol_cfg));
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
 /*
  * read configuration file
  */
@@ -484,6 +814,18 @@ read_config(struct program_params *pp)
         CFG_FLOAT("pinningScore", 0, CFGF_NONE),
         CFG_STR("path", NULL, CFGF_NONE),
         CFG_INT_CB("maxUsedSpace", -1, CFGF_NONE, parse_size_value),
+        CFG_FLOAT("readLatency", 0, CFGF_NONE),
+        CFG_FLOAT("writeLatency", 0, CFGF_NONE),
+        CFG_INT_CB("readThroughput", -1, CFGF_NONE, parse_size_value),
+        CFG_INT_CB("writeThroughput", -1, CFGF_NONE, parse_size_value),
+        CFG_END()
+    };
+
+    static cfg_opt_t io_rule_opts[] = {
+        CFG_STR("process", NULL, CFGF_NONE),
+        CFG_INT("pid", -1, CFGF_NONE),
+        CFG_STR("cgroup", NULL, CFGF_NONE),
+        CFG_FLOAT("weight", 1, CFGF_NONE),
         CFG_END()
     };
 
@@ -494,9 +836,26 @@ read_config(struct program_params *pp)
         CFG_FLOAT("hitScore",      16, CFGF_NONE),
         CFG_FLOAT("readMultiplier", 1, CFGF_NONE),
         CFG_FLOAT("writeMultiplier", 4, CFGF_NONE),
+        CFG_FLOAT("syncMultiplier", 1, CFGF_NONE),
+        CFG_FLOAT("metadataMultiplier", 1, CFGF_NONE),
+        CFG_FLOAT("flushMultiplier", 1, CFGF_NONE),
+        CFG_FLOAT("readaheadMultiplier", 1, CFGF_NONE),
+        CFG_BOOL("costModel", cfg_false, CFGF_NONE),
+        CFG_BOOL("activityProfile", cfg_false, CFGF_NONE),
+        CFG_INT_CB("plannerLead",    0, CFGF_NONE, parse_time_value),
+        CFG_FLOAT("plannerWeight",   1, CFGF_NONE),
+        CFG_INT_CB("trendInterval",  0, CFGF_NONE, parse_time_value),
+        CFG_FLOAT("trendAlpha",      0.5, CFGF_NONE),
+        CFG_FLOAT("trendBeta",       0.2, CFGF_NONE),
+        CFG_BOOL("trendForecast",    cfg_false, CFGF_NONE),
+        CFG_FLOAT("spatialShare",    0, CFGF_NONE),
+        CFG_INT("spatialRadius",     1, CFGF_NONE),
+        CFG_INT_CB("coAccessWindow", 0, CFGF_NONE, parse_time_value),
+        CFG_FLOAT("coAccessThreshold", 8, CFGF_NONE),
         CFG_INT_CB("pvmoveWait",     5*60, CFGF_NONE, parse_time_value),
         CFG_INT_CB("checkWait",      15*60, CFGF_NONE, parse_time_value),
         CFG_SEC("pv", pv_opts, CFGF_TITLE | CFGF_MULTI),
+        CFG_SEC("ioRule", io_rule_opts, CFGF_TITLE | CFGF_MULTI),
         CFG_END()
     };
 
@@ -519,12 +878,38 @@ read_config(struct program_params *pp)
         validate_require_nonnegative);
     cfg_set_validate_func(cfg, "volume|writeMultiplier",
         validate_require_nonnegative);
+    cfg_set_validate_func(cfg, "volume|syncMultiplier",
+        validate_require_nonnegative);
+    cfg_set_validate_func(cfg, "volume|metadataMultiplier",
+        validate_require_nonnegative);
+    cfg_set_validate_func(cfg, "volume|flushMultiplier",
+        validate_require_nonnegative);
+    cfg_set_validate_func(cfg, "volume|readaheadMultiplier",
+        validate_require_nonnegative);
     cfg_set_validate_func(cfg, "volume|pv|pinningScore",
         validate_require_nonnegative);
     cfg_set_validate_func(cfg, "volume|pv|tier",
         validate_require_nonnegative);
     cfg_set_validate_func(cfg, "volume|pv|maxUsedSpace",
         validate_require_nonnegative);
+    cfg_set_validate_func(cfg, "volume|plannerWeight",
+        validate_require_nonnegative);
+    cfg_set_validate_func(cfg, "volume|spatialShare",
+        validate_require_nonnegative);
+    cfg_set_validate_func(cfg, "volume|spatialRadius",
+        validate_require_nonnegative);
+    cfg_set_validate_func(cfg, "volume|coAccessThreshold",
+        validate_require_positive);
+    cfg_set_validate_func(cfg, "volume|trendAlpha",
+        validate_require_fraction);
+    cfg_set_validate_func(cfg, "volume|trendBeta",
+        validate_require_fraction);
+    cfg_set_validate_func(cfg, "volume|pv|readLatency",
+        validate_require_nonnegative);
+    cfg_set_validate_func(cfg, "volume|pv|writeLatency",
+        validate_require_nonnegative);
+    cfg_set_validate_func(cfg, "volume|ioRule|weight",
+        validate_require_nonnegative);
     // TODO cfg_set_validate_func(cfg, "volume", validate_pv); // do they belong to volume, is there enough space
 
     switch(cfg_parse(cfg, pp->conf_file_path)) {
@@ -542,7 +927,18 @@ read_config(struct program_params *pp)
         assert(0);
     }
 
+    if (validate_volumes(cfg)) {
+        fprintf(stderr, "Configuration file errors, aborting\n");
+        cfg_free(cfg);
+        return 1;
+    }
+
     pp->cfg = cfg;
 
+    if (compile_pv_config(pp)) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
     return 0;
 }
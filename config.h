@@ -3,10 +3,21 @@
 
 #include <confuse.h>
 
+/** configuration of physical volume of a volume, indexed by PV id */
+struct pv_config {
+    const char *lv_name; // title of volume section
+    const char *path;
+    int tier;
+    float pinning_score; // of tier of the PV
+    long int max_space; // of tier of the PV
+};
+
 struct program_params {
     char *conf_file_path;
     void *lvm2_handle;
     cfg_t *cfg;
+    struct pv_config *pvs; // PVs of all volumes, compiled by read_config()
+    size_t pvs_len;
 };
 
 struct program_params* new_program_params();
@@ -17,6 +28,18 @@ float get_read_multiplier(struct program_params *pp, const char *lv_name);
 
 float get_write_multiplier(struct program_params *pp, const char *lv_name);
 
+/**
+ * Multipliers of hit score for IO with specific RWBS flags (synchronous,
+ * metadata, flush/FUA and readahead), applied by collector
+ */
+float get_sync_multiplier(struct program_params *pp, const char *lv_name);
+
+float get_metadata_multiplier(struct program_params *pp, const char *lv_name);
+
+float get_flush_multiplier(struct program_params *pp, const char *lv_name);
+
+float get_readahead_multiplier(struct program_params *pp, const char *lv_name);
+
 float get_hit_score(struct program_params *pp, const char *lv_name);
 
 float get_score_scaling_factor(struct program_params *pp, const char *lv_name);
@@ -33,6 +56,29 @@ const char *get_tier_device(struct program_params *pp, const char *lv_name, int
  */
 int get_device_tier(struct program_params *pp, const char *lv_name, const char *dev);
 
+/**
+ * Return id of device named dev in volume lv_name
+ *
+ * -1 if not found
+ */
+int get_pv_id(struct program_params *pp, const char *lv_name, const char *dev);
+
+/**
+ * Return tier of PV with provided id, -1 for id -1
+ */
+int get_pv_tier(struct program_params *pp, int pv_id);
+
+/**
+ * Return pinning score of tier of PV with provided id, 0 for id -1
+ */
+float get_pv_pinning_score(struct program_params *pp, int pv_id);
+
+/**
+ * Return max used space on tier of PV with provided id, -1 (no limit) for
+ * id -1
+ */
+long int get_pv_max_space(struct program_params *pp, int pv_id);
+
 /**
  * Returns pinning score for provided volume
  */
@@ -55,6 +101,129 @@ int higher_tiers_exist(struct program_params *pp, const char *lv_name, int tier)
 long int get_max_space_tier(struct program_params *pp, const char *lv_name,
     int tier);
 
+/**
+ * Check if extents of volume are scored with device time cost model
+ */
+int get_cost_model(struct program_params *pp, const char *lv_name);
+
+/**
+ * Return time (in seconds) to wait before checking if pvmove finished
+ */
+int get_pvwait(struct program_params *pp, const char *lv_name);
+
+/**
+ * Return time (in seconds) to wait after detecting there's nothing to do
+ */
+int get_check_wait(struct program_params *pp, const char *lv_name);
+
+/**
+ * Return length (in seconds) of intervals in which level and trend of
+ * extent activity is collected, 0 if it's not collected
+ */
+long int get_trend_interval(struct program_params *pp, const char *lv_name);
+
+/**
+ * Return smoothing factors for level and trend of extent activity
+ */
+float get_trend_alpha(struct program_params *pp, const char *lv_name);
+
+float get_trend_beta(struct program_params *pp, const char *lv_name);
+
+/**
+ * Check if extents should be ranked by activity predicted from trend
+ */
+int get_trend_forecast(struct program_params *pp, const char *lv_name);
+
+/**
+ * Return share of extent score given to its neighbours (and share of that
+ * given to their neighbours, up to radius), 0 if scores aren't smoothed
+ */
+float get_spatial_share(struct program_params *pp, const char *lv_name);
+
+/**
+ * Return how many neighbours on each side of extent get share of its score
+ */
+int get_spatial_radius(struct program_params *pp, const char *lv_name);
+
+/**
+ * Return length (in seconds) of window in which accesses to different
+ * extents are considered to happen together, 0 if co-access groups aren't
+ * collected
+ */
+long int get_coaccess_window(struct program_params *pp, const char *lv_name);
+
+/**
+ * Return number of windows in which extents need to be accessed together
+ * to be put in one group
+ */
+float get_coaccess_threshold(struct program_params *pp, const char *lv_name);
+
+/**
+ * Check if collector should gather hour-of-day and day-of-week activity
+ * profile of extents
+ */
+int get_activity_profile(struct program_params *pp, const char *lv_name);
+
+/**
+ * Return how far ahead (in seconds) the planner looks when predicting
+ * activity from profile, 0 if planner is disabled
+ */
+long int get_planner_lead(struct program_params *pp, const char *lv_name);
+
+/**
+ * Return multiplier of predicted change in activity added to extent score
+ */
+float get_planner_weight(struct program_params *pp, const char *lv_name);
+
+/**
+ * Return time (in seconds) a single read or write operation takes on tier
+ */
+float get_tier_read_latency(struct program_params *pp, const char *lv_name,
+    int tier);
+
+float get_tier_write_latency(struct program_params *pp, const char *lv_name,
+    int tier);
+
+/**
+ * Return read or write throughput (in bytes per second) of tier
+ *
+ * -1 if not specified
+ */
+long int get_tier_read_throughput(struct program_params *pp,
+    const char *lv_name, int tier);
+
+long int get_tier_write_throughput(struct program_params *pp,
+    const char *lv_name, int tier);
+
+/**
+ * Return number of IO attribution rules defined for volume
+ */
+int get_io_rules_count(struct program_params *pp, const char *lv_name);
+
+/**
+ * Return process name pattern of IO rule, NULL if rule matches any process
+ */
+const char *get_io_rule_process(struct program_params *pp, const char *lv_name,
+    int rule);
+
+/**
+ * Return process ID of IO rule, -1 if rule matches any PID
+ */
+long int get_io_rule_pid(struct program_params *pp, const char *lv_name,
+    int rule);
+
+/**
+ * Return cgroup path pattern of IO rule, NULL if rule matches any cgroup
+ */
+const char *get_io_rule_cgroup(struct program_params *pp, const char *lv_name,
+    int rule);
+
+/**
+ * Return hit score multiplier of IO rule (0 to ignore matching IO)
+ */
+float get_io_rule_weight(struct program_params *pp, const char *lv_name,
+    int rule);
+
 /**
  * read configuration file
  */
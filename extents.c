@@ -22,37 +22,40 @@
 #include "config.h"
 
 void
-free_extents(struct extents *e)
+free_extent_stats(struct extent_stats *es)
 {
-    if (!e)
+    if (!es)
         return;
 
-    free(e->extents);
+    free(es->extents);
+
+    for(size_t i=0; i<es->devs_len; i++)
+        free(es->devs[i]);
+    free(es->devs);
 
-    free(e);
+    for(int t=0; es->hot && t <= es->tiers; t++)
+        free(es->hot[t].ext);
+    for(int t=0; es->cold && t <= es->tiers; t++)
+        free(es->cold[t].ext);
+    free(es->hot);
+    free(es->cold);
+
+    free(es);
 }
 
 void
-free_extent_stats(struct extent_stats *es)
+extent_scores_changed(struct extent_stats *es)
 {
-    if (!es)
-        return;
-
-    if (es->extents) {
-        for(size_t i=0; i<es->length; i++) {
-            if (es->extents[i].dev)
-                free(es->extents[i].dev);
-        }
-        free(es->extents);
-    }
-
-    free(es);
+    for(int t=0; es->hot && t <= es->tiers; t++)
+        es->hot[t].sorted = 0;
+    for(int t=0; es->cold && t <= es->tiers; t++)
+        es->cold[t].sorted = 0;
 }
 
 void
 free_extent(struct extent *e)
 {
-    // do nothing, extent is freed after in free_extents()
+    // do nothing, extent is freed after in free_extent_stats()
     return;
 }
 
@@ -63,14 +66,14 @@ compare_extents(struct extents *e1, struct extents *e2)
     assert(e1);
     assert(e2);
 
-    for(size_t i=0; i < e1->length && e2->length && i < SIZE_MAX; i++) {
-        if (e1->extents[i]->score == e2->extents[i]->score)
+    for(size_t i=0; i < e1->length && i < e2->length; i++) {
+        if (get_extent(e1, i)->score == get_extent(e2, i)->score)
           continue;
 
-        if (e1->extents[i]->score > e2->extents[i]->score)
+        if (get_extent(e1, i)->score > get_extent(e2, i)->score)
           return 1;
 
-        // if (e1->extents[i]->score < e2->extents[i]->score)
+        // if (get_extent(e1, i)->score < get_extent(e2, i)->score)
         return -1;
     }
 
@@ -94,7 +97,7 @@ get_extent(struct extents *e, size_t nmemb)
 {
     assert(e);
     assert(e->length > nmemb);
-    return (e->extents[nmemb]);
+    return &e->base[e->index[nmemb]];
 }
 
 int
@@ -102,9 +105,9 @@ count_extents(struct extents *e, float score, int hot_cold)
 {
     size_t count = 0;
     for(size_t i=0; i<e->length; i++) {
-        if (hot_cold == ES_COLD && e->extents[i]->score > score)
+        if (hot_cold == ES_COLD && get_extent(e, i)->score > score)
             count++;
-        if (hot_cold == ES_HOT && e->extents[i]->score < score)
+        if (hot_cold == ES_HOT && get_extent(e, i)->score < score)
             count++;
     }
 
@@ -115,25 +118,9 @@ void
 truncate_extents(struct extents *e, size_t len)
 {
     assert(e);
-    assert(e->extents);
-
-    if (e->length == len)
-      return;
-
-    assert(e->length > len);
-
-    struct extent **ext;
-
-    ext = realloc(e->extents, sizeof(struct extent*) * len);
-
-    if (!ext) {
-        //free(e->extents);
-        e->extents = NULL;
-        e->length = 0;
-        return;
-    }
+    assert(e->length >= len);
 
-    e->extents = ext;
+    // extents remain in candidate index
     e->length = len;
 }
 
@@ -141,7 +128,7 @@ int
 get_extent_tier(struct program_params *pp, const char *lv_name,
     struct extent *e)
 {
-    return get_device_tier(pp, lv_name, e->dev);
+    return get_pv_tier(pp, e->pv_id);
 }
 
 off_t
@@ -152,7 +139,8 @@ get_avaiable_space(struct program_params *pp, const char *lv_name, int tier)
     if (!pv_name)
       return 0;
 
-    off_t avaiable_space = get_max_space_tier(pp, lv_name, tier);
+    off_t avaiable_space = get_pv_max_space(pp,
+        get_pv_id(pp, lv_name, pv_name));
 
     if (avaiable_space == 0)
         return avaiable_space;
@@ -7,16 +7,30 @@
 
 struct program_params;
 
+/** extents that are candidates for move, hot or cold first */
+struct extent_index {
+    uint32_t *ext; // positions in extent_stats extents
+    size_t length;
+    size_t sorted; // number of leading entries already in final order
+};
+
 /** extent statistics */
 struct extent_stats {
-    struct extent *extents;
+    struct extent *extents; // ordered by LE
     size_t length;
     char *lv_name;
+    char **devs; // names of devices used by extents, indexed by dev_id
+    size_t devs_len;
+    int tiers; // candidate indexes exist for tiers from -1 to tiers - 1
+    struct extent_index *hot; // hot[tier + 1]: extents on tiers below tier
+    struct extent_index *cold; // cold[tier + 1]: extents on tier
 };
 
 /** single extent data */
 struct extent {
     char *dev; // reference, not allocated string
+    int dev_id; // index of dev in extent_stats devs
+    int pv_id; // id of PV configuration of dev, -1 if not configured
     off_t pe;
     off_t le;
     float score; // calculated score at time of stats reading
@@ -24,23 +38,32 @@ struct extent {
     time_t last_read_access;
     float write_score; // write score at time last_write_access
     time_t last_write_access;
+    float read_bytes; // bytes read at time last_read_access
+    float write_bytes; // bytes written at time last_write_access
+    off_t group; // first LE of group of extents moved together, -1 if none
 };
 
 /**
- * List of sorted extent references according to score
+ * List of extents sorted according to score, part of candidate index
+ * of extent_stats, valid as long as it is
  */
 struct extents {
-    struct extent **extents;
+    struct extent *base; // extents of extent_stats
+    uint32_t *index; // positions of extents in base
     size_t length;
     int sort;
 };
 
-void free_extents(struct extents *e);
-
 void free_extent_stats(struct extent_stats *es);
 
 void free_extent(struct extent *e); // do nothing
 
+/**
+ * Mark candidate indexes as unsorted, must be called after scores of extents
+ * change
+ */
+void extent_scores_changed(struct extent_stats *es);
+
 /** strcmp for extents
  * @return -1 if e1 is "smaller" than e2, 0 if they're equal and 1 if e1 is
  * "bigger" than e2
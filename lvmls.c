@@ -233,6 +233,37 @@ struct pv_info *LE_to_PE(const char *vg_name, const char *lv_name, uint64_t le_n
     return pv_info;
 }
 
+// return first segment of logical volume specified by vg_name and lv_name,
+// num is set to number of its segments, sorted by starting logical extent
+struct pv_allocations *get_LV_segments(const char *vg_name, const char *lv_name,
+    size_t *num)
+{
+    size_t lower = 0, upper = pv_segments_num;
+
+    // find first segment not sorted before the volume
+    while (lower < upper) {
+        size_t mid = lower + (upper - lower) / 2;
+        int r = strcmp(pv_segments[mid].vg_name, vg_name);
+        if (!r)
+            r = strcmp(pv_segments[mid].lv_name, lv_name);
+        if (r < 0)
+            lower = mid + 1;
+        else
+            upper = mid;
+    }
+
+    *num = 0;
+    while (lower + *num < pv_segments_num
+        && !strcmp(pv_segments[lower + *num].vg_name, vg_name)
+        && !strcmp(pv_segments[lower + *num].lv_name, lv_name))
+        *num += 1;
+
+    if (!*num)
+        return NULL;
+
+    return &pv_segments[lower];
+}
+
 struct vg_pe_sizes {
     char *vg_name;
     uint64_t pe_size;
@@ -60,6 +60,13 @@ void pv_info_free(struct pv_info *pv);
 // on specific device
 struct pv_info *LE_to_PE(const char *vg_name, const char *lv_name, uint64_t le_num);
 
+/**
+ * Returns first of segments of logical volume, sorted by starting logical
+ * extent, sets num to their number. NULL if volume has no segments
+ */
+struct pv_allocations *get_LV_segments(const char *vg_name, const char *lv_name,
+    size_t *num);
+
 uint64_t get_pe_size(const char *vg_name);
 
 /**
@@ -22,6 +22,8 @@
 #include <errno.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <math.h>
+#include <time.h>
 #include "activity_stats.h"
 #include "lvmls.h"
 
@@ -35,11 +37,24 @@ int pvmove_output = 0;
 int print_le = 0;
 char *lv_name = NULL;
 char *vg_name = NULL;
+char *archive = NULL;
+time_t at_time = -1;
+time_t from_time = -1;
+time_t to_time = -1;
+int list_archive = 0;
+int hot_index = 0;
+int64_t skip_blocks = -1;
+int get_quantile = 0;
+double quantile;
+int get_count = 0;
+float count_score;
 
 void
 usage(void)
 {
   printf("Usage: lvmtscat [options] [--LE|--VG VolumeGroupName --LV LogicalVolumeName] StatsFile\n");
+  printf("       lvmtscat [options] [--LE|--VG VolumeGroupName --LV LogicalVolumeName] --archive Dir\n");
+  printf("                (--at Time|--from Time [--to Time]|--list)\n");
   printf("\n");
   printf(" -b,--blocks            Number of blocks to print\n");
   printf(" -r,--read-multiplier   Read score multiplier\n");
@@ -49,9 +64,51 @@ usage(void)
   printf(" --LE                   Print logical extents, not physical extents\n");
   printf(" --LV                   Name of logical volume\n");
   printf(" --VG                   Name of volume group\n");
+  printf(" --archive              Directory with archived statistics snapshots\n");
+  printf(" --at                   Print blocks most active at given time\n");
+  printf(" --from                 Print blocks most active between --from and --to\n");
+  printf(" --to                   End of time range (now by default)\n");
+  printf(" --list                 List snapshots in archive\n");
+  printf(" --hot                  Print blocks from hot-set index saved by lvmtscd\n");
+  printf("                        (fast, but only as many blocks as in index,\n");
+  printf("                        chosen with lvmtscd --hot-*-multiplier values)\n");
+  printf(" --skip                 Skip given number of most active blocks, for\n");
+  printf("                        printing blocks page by page\n");
+  printf(" --quantile             Print score not lower than scores of given\n");
+  printf("                        fraction (0 to 1) of all blocks\n");
+  printf(" --count-above          Print number of blocks with score higher than\n");
+  printf("                        given one\n");
+  printf("                        (time is in seconds since epoch or\n");
+  printf("                        YYYY-MM-DD[ HH:MM[:SS]] format)\n");
   printf(" -?,--help              This message\n");
 }
 
+// parse time given as seconds since epoch or as local date and time
+int
+parse_time(const char *str, time_t *t)
+{
+  const char *formats[] = { "%Y-%m-%d %H:%M:%S", "%Y-%m-%dT%H:%M:%S",
+    "%Y-%m-%d %H:%M", "%Y-%m-%d", NULL };
+  struct tm tm;
+  char *end;
+
+  *t = strtoll(str, &end, 10);
+  if (*str && !*end)
+    return 0;
+
+  for (int i=0; formats[i]; i++) {
+    memset(&tm, 0, sizeof(struct tm));
+    end = strptime(str, formats[i], &tm);
+    if (end && !*end) {
+      tm.tm_isdst = -1;
+      *t = mktime(&tm);
+      return *t == -1;
+    }
+  }
+
+  return 1;
+}
+
 int
 parse_arguments(int argc, char **argv)
 {
@@ -68,6 +125,15 @@ parse_arguments(int argc, char **argv)
               {"LE",               no_argument,       0, 0 }, // 6
               {"LV",               required_argument, 0, 0 }, // 7
               {"VG",               required_argument, 0, 0 }, // 8
+              {"archive",          required_argument, 0, 0 }, // 9
+              {"at",               required_argument, 0, 0 }, // 10
+              {"from",             required_argument, 0, 0 }, // 11
+              {"to",               required_argument, 0, 0 }, // 12
+              {"list",             no_argument,       0, 0 }, // 13
+              {"hot",              no_argument,       0, 0 }, // 14
+              {"skip",             required_argument, 0, 0 }, // 15
+              {"quantile",         required_argument, 0, 0 }, // 16
+              {"count-above",      required_argument, 0, 0 }, // 17
 			  {0, 0, 0, 0}
   };
 
@@ -97,6 +163,47 @@ parse_arguments(int argc, char **argv)
           case 8:
             vg_name = optarg;
             break;
+          case 9:
+            archive = optarg;
+            break;
+          case 10:
+          case 11:
+          case 12:
+            if (parse_time(optarg, option_index == 10 ? &at_time :
+                  option_index == 11 ? &from_time : &to_time)) {
+              fprintf(stderr, "Invalid time: %s\n", optarg);
+              f_ret = 1;
+            }
+            break;
+          case 13:
+            list_archive = 1;
+            break;
+          case 14:
+            hot_index = 1;
+            break;
+          case 15:
+            skip_blocks = atoll(optarg);
+            if (skip_blocks < 0) {
+              fprintf(stderr, "Number of skipped blocks can't be negative!\n");
+              f_ret = 1;
+            }
+            break;
+          case 16:
+            quantile = atof(optarg);
+            if (quantile < 0 || quantile > 1) {
+              fprintf(stderr, "Quantile must be between 0 and 1!\n");
+              f_ret = 1;
+            }
+            get_quantile = 1;
+            break;
+          case 17:
+            count_score = atof(optarg);
+            if (count_score < 0) {
+              fprintf(stderr, "Score can't be negative!\n");
+              f_ret = 1;
+            }
+            get_count = 1;
+            break;
         }
 	break;
       case 'b':
@@ -148,9 +255,121 @@ parse_arguments(int argc, char **argv)
   if (f_ret == 0)
     file = argv[optind];
 
+  if (f_ret == 0 && !archive && (at_time != -1 || from_time != -1
+        || to_time != -1 || list_archive)) {
+    fprintf(stderr, "Time queries need --archive\n");
+    f_ret = 1;
+  }
+
+  if (f_ret == 0 && hot_index && (archive || get_max)) {
+    fprintf(stderr, "--hot can't be used with --archive or --max-score\n");
+    f_ret = 1;
+  }
+
+  if (f_ret == 0 && skip_blocks != -1 && (archive || hot_index || get_max)) {
+    fprintf(stderr, "--skip can't be used with --archive, --hot or --max-score\n");
+    f_ret = 1;
+  }
+
+  if (f_ret == 0 && (get_quantile || get_count)
+      && (archive || hot_index || get_max || skip_blocks != -1)) {
+    fprintf(stderr, "--quantile and --count-above can't be used with "
+        "--archive, --hot, --max-score or --skip\n");
+    f_ret = 1;
+  }
+
+  if (f_ret == 0 && at_time != -1 && from_time != -1) {
+    fprintf(stderr, "--at and --from are mutually exclusive\n");
+    f_ret = 1;
+  }
+
   return f_ret;
 }
 
+int
+print_archive(char *dir)
+{
+  time_t *times;
+  size_t count;
+  char buf[64];
+
+  if (list_stats_archive(dir, &times, &count)) {
+    fprintf(stderr, "Can't read archive \"%s\"\n", dir);
+    return 1;
+  }
+
+  for (size_t i=0; i < count; i++) {
+    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", localtime(&times[i]));
+    printf("%lld %s\n", (long long)times[i], buf);
+  }
+
+  free(times);
+
+  return 0;
+}
+
+// return blocks ranked after `skip_blocks` most active ones, the file is
+// streamed keeping only the skipped blocks and the page in memory, equal
+// scores are ranked by block number, so pages don't overlap
+int
+get_ranked_blocks(char *file, struct block_scores **bs, size_t *found,
+    double mean_lifetime)
+{
+  int ret;
+
+  ret = get_best_blocks_from_file(file, bs, skip_blocks + blocks, found,
+      read_mult, write_mult, mean_lifetime, INFINITY);
+  if (ret)
+    return ret;
+
+  if (*found <= (size_t)skip_blocks) {
+    *found = 0;
+    return 0;
+  }
+
+  *found -= skip_blocks;
+  memmove(*bs, *bs + skip_blocks, sizeof(struct block_scores) * *found);
+
+  return 0;
+}
+
+// print answers to score distribution queries, scores of all blocks are
+// grouped in histogram, only blocks of the bucket the answer falls in are
+// looked at
+int
+print_score_distribution(char *file, double mean_lifetime)
+{
+  struct score_params params = { .read_multiplier = read_mult,
+    .write_multiplier = write_mult, .scale = 1 / mean_lifetime };
+  struct activity_stats *as;
+  struct score_histogram *hist;
+  int ret = 0;
+
+  if (read_activity_stats(&as, file))
+    return EIO;
+
+  hist = new_score_histogram(as, time(NULL), &params);
+  destroy_activity_stats(as);
+  if (!hist)
+    return ENOMEM;
+
+  if (get_quantile) {
+    float score = histogram_quantile(hist, quantile);
+    if (isnan(score))
+      ret = ENOMEM;
+    else
+      printf("%f\n", score);
+  }
+
+  if (get_count)
+    printf("%llu\n",
+        (unsigned long long)histogram_count_above(hist, count_score));
+
+  free_score_histogram(hist);
+
+  return ret;
+}
+
 int
 main(int argc, char **argv)
 {
@@ -161,14 +380,30 @@ main(int argc, char **argv)
 	if (parse_arguments(argc, argv))
 		return 1;
 
-	struct activity_stats *as = NULL;
+    if (list_archive)
+        return print_archive(archive);
+
+    if (archive && at_time == -1 && from_time == -1) {
+        fprintf(stderr, "Time of query must be provided with --at or"
+            " --from\n");
+        usage();
+        return 1;
+    }
 
-	if (file == NULL) {
+	if (file == NULL && !archive) {
       fprintf(stderr, "No file name provided\n");
 	  usage();
 	  return 1;
 	}
 
+    if (get_quantile || get_count) {
+        if (print_score_distribution(file, mean_lifetime)) {
+            fprintf(stderr, "Can't read \"%s\"\n", file);
+            return 1;
+        }
+        return 0;
+    }
+
     if (!print_le && (!lv_name || !vg_name)) {
         fprintf(stderr, "You must ask for logical extents or provide volume"
             " group and logical volume name.\n");
@@ -182,21 +417,63 @@ main(int argc, char **argv)
         init_le_to_pe(&pp);
     }
 
-	n = read_activity_stats(&as, file);
-	assert(!n);
-
 	struct block_scores *bs = NULL;
+	size_t found;
+	char *old_file = NULL;
+	char *new_file = NULL;
 
-	if(get_max)
-	   get_best_blocks_with_max_score(as, &bs, blocks, read_mult,
-			   write_mult, mean_lifetime, max_score);
-	else
-	   get_best_blocks(as, &bs, blocks, read_mult, write_mult, mean_lifetime);
+	if (at_time != -1) {
+		new_file = find_archived_stats(archive, at_time);
+		if (!new_file) {
+			fprintf(stderr, "No snapshot in archive from before given time\n");
+			ret = 1;
+			goto cleanup;
+		}
+		n = get_best_blocks_from_file_at(new_file, &bs, blocks, &found,
+				read_mult, write_mult, mean_lifetime,
+				get_max ? max_score : INFINITY, at_time);
+	} else if (from_time != -1) {
+		if (to_time == -1)
+			to_time = time(NULL);
+		old_file = find_archived_stats(archive, from_time);
+		new_file = find_archived_stats(archive, to_time);
+		if (!old_file || !new_file || !strcmp(old_file, new_file)) {
+			fprintf(stderr, "No snapshots in archive for given time range\n");
+			ret = 1;
+			goto cleanup;
+		}
+		// activity between the snapshots closest to range ends
+		n = get_best_blocks_between_files(old_file, new_file, &bs, blocks,
+				&found, read_mult, write_mult, mean_lifetime,
+				get_max ? max_score : INFINITY, to_time);
+	} else if (hot_index) {
+		n = read_hot_blocks(file, &bs, blocks, &found, read_mult, write_mult,
+				mean_lifetime);
+		if (n == ENOENT) {
+			fprintf(stderr, "File \"%s\" has no hot-set index\n", file);
+			ret = 1;
+			goto cleanup;
+		}
+	} else if (skip_blocks != -1) {
+		n = get_ranked_blocks(file, &bs, &found, mean_lifetime);
+	} else {
+		// stream the file, keeping only the best blocks in memory
+		n = get_best_blocks_from_file(file, &bs, blocks, &found, read_mult,
+				write_mult, mean_lifetime, get_max ? max_score : INFINITY);
+	}
+	if (n) {
+		fprintf(stderr, "Can't read \"%s\"\n", new_file ? new_file : file);
+		ret = 1;
+		goto cleanup;
+	}
+
+    if (!found)
+        goto cleanup;
 
     if (pvmove_output) {
         if (print_le) {
             printf("%li", bs[0].offset);
-            for (int i=1; i< blocks; i++) {
+            for (size_t i=1; i< found; i++) {
                 printf(":%li", bs[i].offset);
             }
             printf("\n");
@@ -205,7 +482,7 @@ main(int argc, char **argv)
             struct pv_info *pvn;
             pvi = LE_to_PE(vg_name, lv_name, bs[0].offset);
             printf("%s:%li", pvi->pv_name, pvi->start_seg);
-            for (int i=1; i<blocks; i++) {
+            for (size_t i=1; i<found; i++) {
                 pvn = LE_to_PE(vg_name, lv_name, bs[i].offset);
                 if (!pvn)
                   continue;
@@ -228,17 +505,15 @@ main(int argc, char **argv)
             fprintf(stderr, "Unsupported combination of parameters"
                 " (add --pvmove or --LE)\n");
         } else
-	        print_block_scores(bs, blocks);
+	        print_block_scores(bs, found);
     }
 
+cleanup:
+	free(old_file);
+	free(new_file);
 	free(bs);
 	bs = NULL;
 
-	//dump_activity_stats(as);
-
-	destroy_activity_stats(as);
-	as = NULL;
-
     if (!print_le) {
         le_to_pe_exit(&pp);
     }
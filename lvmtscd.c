@@ -30,12 +30,20 @@
 #include <pthread.h>
 #include <getopt.h>
 #include <signal.h>
+#include <fnmatch.h>
 #include "volumes.h"
 #include "activity_stats.h"
+#include "checkpoint.h"
 #include "config.h"
 
+/** mean lifetime of block scores (in seconds) */
+#define SCORE_MEAN_LIFETIME (3*24*60*60.0)
+
 static int programEnd = 0;
 
+/** size of buffer for process name (kernel limits it to 16 characters) */
+#define PROC_NAME_LEN 32
+
 struct trace_point {
 	int8_t dev_major;
 	int8_t dev_minor;
@@ -47,6 +55,7 @@ struct trace_point {
 	char rwbs_data[20];
 	int64_t block;
 	int64_t len;
+	char process_name[PROC_NAME_LEN];
 };
 
 #define BASE_10 10
@@ -201,11 +210,236 @@ parse_trace_line(char *line, struct trace_point *ret) {
 
 	ret->len = nl;
 
-	// only process name left, which we ignore
+	/*
+	 * process name
+	 */
+	nptr = endptr;
+	while(isspace(*nptr)) {
+		nptr++;
+	}
+	if (*nptr != '[')
+		return 0;
+	nptr++;
+	n = 0;
+	while(*nptr && *nptr != ']' && *nptr != '\n'
+	    && n < sizeof(ret->process_name) - 1) {
+		ret->process_name[n] = *nptr;
+		n++;
+		nptr++;
+	}
+	ret->process_name[n] = '\0';
 
 	return 0;
 }
 
+/** compiled IO attribution rule from config file */
+struct io_rule {
+	char *process; /**< fnmatch() pattern for process name, NULL for any */
+	int32_t pid; /**< process ID, -1 for any */
+	char *cgroup; /**< fnmatch() pattern for cgroup path, NULL for any */
+	double weight; /**< hit score multiplier, 0 causes the IO to be ignored */
+};
+
+/** number of processes for which cgroup membership is remembered */
+#define CGROUP_CACHE_SIZE 64
+/** how long (in seconds) to trust the cached cgroup of a process */
+#define CGROUP_CACHE_TTL 60
+
+struct cgroup_cache_entry {
+	int32_t pid;
+	int64_t time;
+	char path[256];
+};
+
+/** weights applied to hit score of IO before it is added to stats */
+struct io_weights {
+	struct io_rule *rules;
+	size_t rules_len;
+	double sync_mult; /**< multiplier for synchronous IO ('S') */
+	double meta_mult; /**< multiplier for metadata IO ('M') */
+	double flush_mult; /**< multiplier for flush and FUA IO ('F') */
+	double ahead_mult; /**< multiplier for readahead IO ('A') */
+	int need_cgroup; /**< set if any rule needs cgroup of process */
+	struct cgroup_cache_entry cgroup_cache[CGROUP_CACHE_SIZE];
+};
+
+void
+free_io_weights(struct io_weights *iw)
+{
+	if (!iw)
+		return;
+
+	for (size_t i=0; i < iw->rules_len; i++) {
+		free(iw->rules[i].process);
+		free(iw->rules[i].cgroup);
+	}
+	free(iw->rules);
+	free(iw);
+}
+
+/**
+ * Compile IO rules of volume from configuration
+ */
+struct io_weights *
+new_io_weights(struct program_params *pp, const char *lv_name)
+{
+	struct io_weights *iw;
+	const char *tmp;
+
+	iw = calloc(sizeof(struct io_weights), 1);
+	if (!iw)
+		return NULL;
+
+	iw->sync_mult = get_sync_multiplier(pp, lv_name);
+	iw->meta_mult = get_metadata_multiplier(pp, lv_name);
+	iw->flush_mult = get_flush_multiplier(pp, lv_name);
+	iw->ahead_mult = get_readahead_multiplier(pp, lv_name);
+
+	iw->rules_len = get_io_rules_count(pp, lv_name);
+	if (!iw->rules_len)
+		return iw;
+
+	iw->rules = calloc(sizeof(struct io_rule), iw->rules_len);
+	if (!iw->rules)
+		goto iw_cleanup;
+
+	for (size_t i=0; i < iw->rules_len; i++) {
+		tmp = get_io_rule_process(pp, lv_name, i);
+		if (tmp) {
+			iw->rules[i].process = strdup(tmp);
+			if (!iw->rules[i].process)
+				goto iw_cleanup;
+		}
+		tmp = get_io_rule_cgroup(pp, lv_name, i);
+		if (tmp) {
+			iw->rules[i].cgroup = strdup(tmp);
+			if (!iw->rules[i].cgroup)
+				goto iw_cleanup;
+			iw->need_cgroup = 1;
+		}
+		iw->rules[i].pid = get_io_rule_pid(pp, lv_name, i);
+		iw->rules[i].weight = get_io_rule_weight(pp, lv_name, i);
+	}
+
+	return iw;
+
+iw_cleanup:
+	free_io_weights(iw);
+	return NULL;
+}
+
+/**
+ * Return cgroup path of process, empty string if it can't be determined
+ *
+ * Prefers the cgroup v2 (unified) hierarchy, falls back to the first
+ * hierarchy listed in /proc/<pid>/cgroup
+ */
+static const char *
+get_process_cgroup(struct io_weights *iw, int32_t pid, int64_t now)
+{
+	struct cgroup_cache_entry *ce = &iw->cgroup_cache[pid % CGROUP_CACHE_SIZE];
+	char *fname = NULL;
+	char *line = NULL;
+	size_t line_len = 0;
+	FILE *f;
+	char *path;
+
+	if (ce->pid == pid && now - ce->time < CGROUP_CACHE_TTL)
+		return ce->path;
+
+	ce->pid = pid;
+	ce->time = now;
+	ce->path[0] = '\0';
+
+	if (asprintf(&fname, "/proc/%i/cgroup", pid) == -1)
+		return ce->path;
+
+	f = fopen(fname, "r");
+	free(fname);
+	if (!f) // process already exited
+		return ce->path;
+
+	while (getline(&line, &line_len, f) != -1) {
+		// format is "hierarchy-ID:controller-list:cgroup-path"
+		path = strchr(line, ':');
+		if (!path)
+			continue;
+		path = strchr(path + 1, ':');
+		if (!path)
+			continue;
+		path++;
+		path[strcspn(path, "\n")] = '\0';
+
+		if (!strncmp(line, "0::", 3) || ce->path[0] == '\0') {
+			strncpy(ce->path, path, sizeof(ce->path) - 1);
+			ce->path[sizeof(ce->path) - 1] = '\0';
+		}
+		if (!strncmp(line, "0::", 3))
+			break;
+	}
+
+	free(line);
+	fclose(f);
+
+	return ce->path;
+}
+
+/**
+ * Return the multiplier for hit score of IO with provided RWBS flags
+ *
+ * multipliers of all flags present are combined, so a synchronous metadata
+ * write gets both the sync and metadata multiplier
+ */
+static double
+get_rwbs_weight(struct io_weights *iw, const char *rwbs)
+{
+	double weight = 1.0;
+
+	if (strchr(rwbs, 'S'))
+		weight *= iw->sync_mult;
+	if (strchr(rwbs, 'M'))
+		weight *= iw->meta_mult;
+	if (strchr(rwbs, 'F'))
+		weight *= iw->flush_mult;
+	if (strchr(rwbs, 'A'))
+		weight *= iw->ahead_mult;
+
+	return weight;
+}
+
+/**
+ * Return the multiplier for hit score of provided IO
+ *
+ * First rule that matches process name, PID and cgroup of the IO wins,
+ * IO not matching any rule has weight of 1. The result is multiplied by
+ * the weight of RWBS flags of the IO.
+ */
+double
+get_io_weight(struct io_weights *iw, struct trace_point *tp, int64_t now)
+{
+	const char *cgroup = NULL;
+	double rwbs_weight = get_rwbs_weight(iw, tp->rwbs_data);
+
+	for (size_t i=0; i < iw->rules_len; i++) {
+		struct io_rule *r = &iw->rules[i];
+
+		if (r->pid >= 0 && r->pid != tp->process_id)
+			continue;
+		if (r->process && fnmatch(r->process, tp->process_name, 0))
+			continue;
+		if (r->cgroup) {
+			if (!cgroup)
+				cgroup = get_process_cgroup(iw, tp->process_id, now);
+			if (fnmatch(r->cgroup, cgroup, 0))
+				continue;
+		}
+
+		return r->weight * rwbs_weight;
+	}
+
+	return rwbs_weight;
+}
+
 int64_t
 div_ceil(int64_t num, int64_t denum) {
 	return (num - 1)/denum + 1;
@@ -239,7 +473,7 @@ trace_blocks_to_extents(int64_t *offset, int64_t *len, int64_t *extent, size_t s
 		return 0;
 	}
 
-	*len -= (*extent + 1) * s_in_e - *offset - 1;
+	*len -= (*extent + 1) * s_in_e - *offset;
 	*offset += (*extent + 1) * s_in_e - *offset;
 	return 1;
 }
@@ -249,6 +483,8 @@ collect_trace_points(char *device,
 		     struct activity_stats *activity,
 		     int64_t granularity,
 		     size_t esize,
+		     double hit_score,
+		     struct io_weights *weights,
 		     int *ender) {
 #define TRACE_APP "btrace"
 	FILE *trace;
@@ -266,8 +502,12 @@ collect_trace_points(char *device,
 	int64_t tim;
 	int64_t trace_start = time(NULL);
 	int64_t extent;
-    double mean_lifetime = 3*24*60*60.0L; // TODO
-    double hit_score = 16.0L; // TODO
+	int64_t prev_len;
+	int64_t s_in_e = div_ceil(esize, ssize);
+	double weight;
+	int type;
+	// lvmtscat scores blocks with the same lifetime
+	double mean_lifetime = SCORE_MEAN_LIFETIME;
 
 
 	n = asprintf(&command, TRACE_APP " %s", device);
@@ -284,24 +524,45 @@ collect_trace_points(char *device,
 			continue;
 
 		if (!strcmp(tp->action, "Q") && tp->len) { // only queued operations
-			tim = trace_start + tp->nanoseconds / NS_IN_S;
-			if (strchr(tp->rwbs_data, 'R') != NULL) { // read
-				while(trace_blocks_to_extents(&tp->block,
-							&tp->len, &extent,
-							ssize, esize))
-					add_block_read(activity, extent, tim,
-						    mean_lifetime, hit_score);
-				add_block_read(activity, extent, tim,
-						mean_lifetime, hit_score);
-			} else if (strchr(tp->rwbs_data, 'W') != NULL ) { // write
+			if (strchr(tp->rwbs_data, 'D') != NULL) { // discard
+				// data is gone no matter who removed it, so
+				// IO rules don't apply
+				prev_len = tp->len;
 				while(trace_blocks_to_extents(&tp->block,
 							&tp->len, &extent,
-							ssize, esize))
-					add_block_write(activity, extent, tim,
-							mean_lifetime, hit_score);
-				add_block_write(activity, extent, tim,
-						mean_lifetime, hit_score);
-			} // ignore other types of operations
+							ssize, esize)) {
+					add_block_discard(activity, extent,
+						prev_len - tp->len, s_in_e);
+					prev_len = tp->len;
+				}
+				add_block_discard(activity, extent, tp->len,
+						s_in_e);
+				continue;
+			}
+
+			tim = trace_start + tp->nanoseconds / NS_IN_S;
+			weight = get_io_weight(weights, tp, tim);
+			if (weight == 0.0) // IO excluded by rules
+				continue;
+
+			if (strchr(tp->rwbs_data, 'R') != NULL) // read
+				type = T_READ;
+			else if (strchr(tp->rwbs_data, 'W') != NULL) // write
+				type = T_WRITE;
+			else // ignore other types of operations
+				continue;
+
+			prev_len = tp->len;
+			while(trace_blocks_to_extents(&tp->block, &tp->len,
+						&extent, ssize, esize)) {
+				add_block_weighted_io(activity, extent, tim,
+					mean_lifetime, hit_score, weight,
+					(prev_len - tp->len) * ssize, type);
+				prev_len = tp->len;
+			}
+			add_block_weighted_io(activity, extent, tim,
+				mean_lifetime, hit_score, weight,
+				tp->len * ssize, type);
 		}
 	}
 
@@ -315,7 +576,10 @@ collect_trace_points(char *device,
 struct thread_param {
 	struct activity_stats *activ;
 	int32_t delay;
+	int32_t compact; /**< number of checkpoints between full writes */
 	char *file;
+	char *archive; /**< directory with snapshots of past checkpoints */
+	int64_t retention; /**< how long to keep snapshots (in seconds) */
 	int *ender;
 };
 
@@ -346,22 +610,61 @@ disk_write_worker(void *in) {
 	struct thread_param *tp = (struct thread_param *)in;
 
 	char *tmp_file = create_temp_file_name(tp->file);
+	char *journal = get_journal_file_name(tp->file);
+	struct activity_stats *activ = tp->activ;
+	struct checkpoint_writer *cw = new_checkpoint_writer();
+	int ret;
+
+	if (!cw)
+		fprintf(stderr, "Can't create checkpoint writer, using "
+				"synchronous writes\n");
 
 	for (;!*tp->ender;) {
 		sleep(tp->delay);
 
-		if (write_activity_stats(tp->activ, tmp_file)) {
+		// only this thread saves stats, so generations can be read
+		// without lock
+		if (activ->base_generation
+		    && activ->generation - activ->base_generation < tp->compact) {
+			if (append_activity_journal(activ, journal))
+				fprintf(stderr, "Error writing activity stats"
+						" to journal %s\n", journal);
+			continue;
+		}
+
+		if (cw)
+			ret = checkpoint_activity_stats(cw, activ, tmp_file,
+				tp->file);
+		else {
+			ret = write_activity_stats(activ, tmp_file);
+			if (!ret && rename(tmp_file, tp->file)) {
+				// file doesn't hold the changes, next save must
+				// be a full one
+				invalidate_activity_stats_base(activ);
+				ret = EIO;
+			}
+			if (ret)
+				unlink(tmp_file);
+		}
+		if (ret) {
 			fprintf(stderr, "Error writing activity stats"
 					" to file %s\n", tmp_file);
-			unlink(tmp_file);
 			continue;
 		}
 
-		rename(tmp_file, tp->file);
+		// entries in journal apply to previous file, drop them
+		unlink(journal);
+
+		if (tp->archive
+		    && archive_activity_stats(tp->file, tp->archive, tp->retention))
+			fprintf(stderr, "Error adding activity stats"
+					" to archive %s\n", tp->archive);
 	}
 
+	free_checkpoint_writer(cw);
 	free(tp);
 	free(tmp_file);
+	free(journal);
 	return NULL;
 }
 
@@ -380,6 +683,13 @@ struct lvmtscd_params {
 	int64_t granularity;
 	char *file;
 	int64_t delay;
+	int64_t compact;
+	int compress;
+	char *archive;
+	int64_t retention;
+	int64_t hot_blocks;
+	int hot_read_mult; /**< multipliers used for ordering hot-set index */
+	int hot_write_mult;
 	char *lv_dev_name;
 	int daemonize;
 	int show_help;
@@ -398,6 +708,21 @@ usage(char *name) {
 	printf("\t-l,--lv-dev d    Monitor device `d`\n");
 	printf("\t-d,--debug       Don't daemonize, run in forground\n");
 	printf("\t--delay l        How often write statistics to file (in seconds)\n");
+	printf("\t--compact n      Rewrite whole statistics file every `n` writes,\n"
+	       "\t                 saving only changed extents to journal between\n");
+	printf("\t--compress       Save statistics file compressed\n");
+	printf("\t--archive a      Keep snapshot of every full statistics file\n"
+	       "\t                 write in directory `a`\n");
+	printf("\t--retention r    Remove snapshots older than `r` seconds\n"
+	       "\t                 (0 keeps all, default 7 days)\n");
+	printf("\t--hot-blocks n   Keep index of `n` most active extents, saved\n"
+	       "\t                 with statistics (0 disables, default 1024)\n");
+	printf("\t--hot-read-multiplier r\n"
+	       "\t                 Read score multiplier used for ordering the\n"
+	       "\t                 index (default 1, as in lvmtscat)\n");
+	printf("\t--hot-write-multiplier w\n"
+	       "\t                 Write score multiplier used for ordering the\n"
+	       "\t                 index (default 10, as in lvmtscat)\n");
     printf("\t-c,--config c    Name of config file\n");
 	printf("\t-?,--help        This message\n");
 }
@@ -416,6 +741,11 @@ parse_arguments(int argc, char **argv, struct lvmtscd_params *pp) {
 	pp->daemonize = 1;
 	pp->show_help = 0;
 	pp->delay = 60 * 5; // write dumps every 5 minutes
+	pp->compact = 12; // and whole file once an hour
+	pp->retention = 7 * 24 * 60 * 60;
+	pp->hot_blocks = 1024;
+	pp->hot_read_mult = 1;
+	pp->hot_write_mult = 10;
 
 	struct option long_options[] = {
 		{"extent-size",  required_argument, 0, 0 }, // 0
@@ -426,6 +756,13 @@ parse_arguments(int argc, char **argv, struct lvmtscd_params *pp) {
 		{"help",         no_argument,       0, '?' }, // 5
 		{"delay",        required_argument, 0, 0 }, // 6
         {"config",       required_argument, 0, 'c'}, // 7
+		{"compact",      required_argument, 0, 0 }, // 8
+		{"compress",     no_argument,       0, 0 }, // 9
+		{"archive",      required_argument, 0, 0 }, // 10
+		{"retention",    required_argument, 0, 0 }, // 11
+		{"hot-blocks",   required_argument, 0, 0 }, // 12
+		{"hot-read-multiplier", required_argument, 0, 0 }, // 13
+		{"hot-write-multiplier", required_argument, 0, 0 }, // 14
 		{0, 0, 0, 0}
 	};
 
@@ -469,6 +806,57 @@ parse_arguments(int argc, char **argv, struct lvmtscd_params *pp) {
 						}
 						pp->delay = tmp_lint;
 						break;
+					case 8: /* compact */
+						tmp_lint = atoll(optarg);
+						if (tmp_lint <= 0) {
+							fprintf(stderr, "Invalid parameter to option `compact`\n");
+							f_ret = 1;
+							goto usage;
+						}
+						pp->compact = tmp_lint;
+						break;
+					case 9: /* compress */
+						pp->compress = 1;
+						break;
+					case 10: /* archive */
+						pp->archive = optarg;
+						break;
+					case 11: /* retention */
+						tmp_lint = atoll(optarg);
+						if (tmp_lint < 0) {
+							fprintf(stderr, "Invalid parameter to option `retention`\n");
+							f_ret = 1;
+							goto usage;
+						}
+						pp->retention = tmp_lint;
+						break;
+					case 12: /* hot-blocks */
+						tmp_lint = atoll(optarg);
+						if (tmp_lint < 0 || tmp_lint > UINT32_MAX / 2) {
+							fprintf(stderr, "Invalid parameter to option `hot-blocks`\n");
+							f_ret = 1;
+							goto usage;
+						}
+						pp->hot_blocks = tmp_lint;
+						break;
+					case 13: /* hot-read-multiplier */
+						tmp_lint = atoll(optarg);
+						if (tmp_lint < 0 || tmp_lint > INT32_MAX) {
+							fprintf(stderr, "Invalid parameter to option `hot-read-multiplier`\n");
+							f_ret = 1;
+							goto usage;
+						}
+						pp->hot_read_mult = tmp_lint;
+						break;
+					case 14: /* hot-write-multiplier */
+						tmp_lint = atoll(optarg);
+						if (tmp_lint < 0 || tmp_lint > INT32_MAX) {
+							fprintf(stderr, "Invalid parameter to option `hot-write-multiplier`\n");
+							f_ret = 1;
+							goto usage;
+						}
+						pp->hot_write_mult = tmp_lint;
+						break;
 					default:
 						fprintf(stderr, "Unknown option %i\n",
 								option_index);
@@ -503,6 +891,13 @@ parse_arguments(int argc, char **argv, struct lvmtscd_params *pp) {
     if (!pp->config_file)
       pp->config_file = strdup("doc/sample.conf");
 
+	if (pp->hot_blocks && !pp->hot_read_mult && !pp->hot_write_mult) {
+		fprintf(stderr, "Hot-set index needs non zero read or write "
+				"multiplier\n");
+		f_ret = 1;
+		goto usage;
+	}
+
 	if (pp->file && pp->lv_dev_name)
 		goto no_output;
 
@@ -560,10 +955,53 @@ main(int argc, char **argv) {
       asprintf(&pp.lv_dev_name, "/dev/%s/%s", get_volume_vg(pp.pp, vol_name),
           get_volume_lv(pp.pp, vol_name));
 
+	struct io_weights *weights = new_io_weights(pp.pp, vol_name);
+	if (!weights) {
+		fprintf(stderr, "Out of memory error\n");
+		exit(1);
+	}
+
 	//activ = new_activity_stats_s(1<<10); // assume 2^11 extents (40GiB)
 	if(read_activity_stats(&activ, pp.file)) {
 		fprintf(stderr, "Can't read \"%s\". Ignoring.\n", pp.file);
 		activ = new_activity_stats_s(1<<10); // assume 2^11 extents (40GiB)
+		// saved with statistics, so that readers skip unused extents
+		if (!activ || index_touched_blocks(activ)) {
+			fprintf(stderr, "Out of memory error\n");
+			exit(1);
+		}
+	}
+
+	set_activity_stats_volume(activ, get_volume_vg(pp.pp, vol_name),
+		get_volume_lv(pp.pp, vol_name), pp.esize);
+	activ->compress = pp.compress;
+
+	if (pp.hot_blocks
+	    && enable_hot_index(activ, pp.hot_blocks, pp.hot_read_mult,
+		    pp.hot_write_mult, SCORE_MEAN_LIFETIME)) {
+		fprintf(stderr, "Out of memory error\n");
+		exit(1);
+	}
+
+	if (get_activity_profile(pp.pp, vol_name)
+	    && enable_activity_profile(activ)) {
+		fprintf(stderr, "Out of memory error\n");
+		exit(1);
+	}
+
+	if (get_trend_interval(pp.pp, vol_name) > 0
+	    && enable_activity_trend(activ, get_trend_interval(pp.pp, vol_name),
+			get_trend_alpha(pp.pp, vol_name),
+			get_trend_beta(pp.pp, vol_name))) {
+		fprintf(stderr, "Out of memory error\n");
+		exit(1);
+	}
+
+	if (get_coaccess_window(pp.pp, vol_name) > 0
+	    && enable_coaccess_groups(activ, get_coaccess_window(pp.pp, vol_name),
+			get_coaccess_threshold(pp.pp, vol_name))) {
+		fprintf(stderr, "Out of memory error\n");
+		exit(1);
 	}
 
 	if (pp.daemonize)
@@ -575,7 +1013,10 @@ main(int argc, char **argv) {
 
 	tp->activ = activ;
 	tp->delay = pp.delay;
+	tp->compact = pp.compact;
 	tp->file = pp.file;
+	tp->archive = pp.archive;
+	tp->retention = pp.retention;
 	tp->ender = &programEnd;
 
 	pthread_attr_t pt_attr;
@@ -595,6 +1036,8 @@ main(int argc, char **argv) {
 				 activ,
 				 pp.granularity,
 				 pp.esize,
+				 get_hit_score(pp.pp, vol_name),
+				 weights,
 				 &programEnd)) {
 		fprintf(stderr, "Error while tracing");
 		ret = 1;
@@ -609,6 +1052,7 @@ main(int argc, char **argv) {
 	pthread_join(thread, &thret);
 
 	destroy_activity_stats(activ);
+	free_io_weights(weights);
     free_program_params(pp.pp);
 
 	fprintf(stderr, "done\n");
@@ -0,0 +1,146 @@
+/*
+ * Copyright (C) 2012 Hubert Kario <kario@wsisiz.edu.pl>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include "activity_stats.h"
+
+char *in_file = NULL;
+char *out_file = NULL;
+char *lv_name = NULL;
+char *vg_name = NULL;
+int64_t extent_size = -1;
+int compress = 0;
+
+void
+usage(void)
+{
+  printf("Usage: lvmtsconv [options] InputStatsFile OutputStatsFile\n");
+  printf("\n");
+  printf("Convert statistics file to current (version 2) file format\n");
+  printf("\n");
+  printf(" -e,--extent-size      Size of extent in bytes\n");
+  printf(" -z,--compress         Write compressed file\n");
+  printf(" --LV                  Name of logical volume\n");
+  printf(" --VG                  Name of volume group\n");
+  printf(" -?,--help             This message\n");
+}
+
+int
+parse_arguments(int argc, char **argv)
+{
+  int c;
+  int f_ret = 0;
+
+  struct option long_options[] = {
+              {"extent-size",      required_argument, 0, 'e' }, // 0
+              {"help",             no_argument,       0, '?' }, // 1
+              {"LV",               required_argument, 0, 0 }, // 2
+              {"VG",               required_argument, 0, 0 }, // 3
+              {"compress",         no_argument,       0, 'z' }, // 4
+              {0, 0, 0, 0}
+  };
+
+  while(1) {
+    int option_index = 0;
+
+    c = getopt_long(argc, argv, "e:z?", long_options, &option_index);
+
+    if (c == -1)
+      break;
+
+    switch(c) {
+      case 0: /* long options */
+        switch(option_index) {
+          case 2:
+            lv_name = optarg;
+            break;
+          case 3:
+            vg_name = optarg;
+            break;
+        }
+        break;
+      case 'e':
+        extent_size = atoll(optarg);
+        if (extent_size <= 0) {
+          fprintf(stderr, "Extent size must be larger than zero!\n");
+          f_ret = 1;
+        }
+        break;
+      case 'z':
+        compress = 1;
+        break;
+      case '?':
+        usage();
+        f_ret = 1;
+        break;
+      default:
+        fprintf(stderr, "Unknown option: %c\n", c);
+        break;
+    }
+  }
+
+  if (f_ret == 0 && argc - optind == 2) {
+    in_file = argv[optind];
+    out_file = argv[optind + 1];
+  }
+
+  return f_ret;
+}
+
+int
+main(int argc, char **argv)
+{
+    struct activity_stats *as = NULL;
+
+    if (parse_arguments(argc, argv))
+        return 1;
+
+    if (in_file == NULL || out_file == NULL) {
+        fprintf(stderr, "Input and output file names must be provided\n");
+        usage();
+        return 1;
+    }
+
+    if (read_activity_stats(&as, in_file)) {
+        fprintf(stderr, "Can't read \"%s\"\n", in_file);
+        return 1;
+    }
+
+    // version 1 files don't record volume, keep what the file has otherwise
+    if (vg_name || lv_name || extent_size > 0)
+        set_activity_stats_volume(as, vg_name ? vg_name : as->vg_name,
+            lv_name ? lv_name : as->lv_name,
+            extent_size > 0 ? extent_size : as->extent_size);
+
+    as->compress = compress;
+
+    if (write_activity_stats(as, out_file)) {
+        fprintf(stderr, "Can't write \"%s\"\n", out_file);
+        destroy_activity_stats(as);
+        return 1;
+    }
+
+    destroy_activity_stats(as);
+
+    return 0;
+}
@@ -89,9 +89,10 @@ queue_extents_move(struct extents *ext, struct program_params *pp,
     int ret;
     int error = 0;
     for(size_t i = 0; i < ext->length; i++) {
+        struct extent *e = get_extent(ext, i);
         const char *pv_name = get_tier_device(pp, lv_name, dst_tier);
         printf("Calculating optimal position for LE extent %li on %s...\n",
-            ext->extents[i]->le, pv_name);
+            e->le, pv_name);
 
         struct le_info le_inf;
         le_inf = get_first_LE_info(get_volume_vg(pp, lv_name),
@@ -100,9 +101,9 @@ queue_extents_move(struct extents *ext, struct program_params *pp,
         printf("First LE on %s is %li, PE: %li\n",
             le_inf.dev, le_inf.le, le_inf.pe);
 
-        uint64_t optimal_pe = le_inf.pe + ext->extents[i]->le - le_inf.le;
+        uint64_t optimal_pe = le_inf.pe + e->le - le_inf.le;
         printf("Optimal position for LE %li is PE %li\n",
-            ext->extents[i]->le, optimal_pe);
+            e->le, optimal_pe);
 
         struct le_info optimal;
         optimal = get_PE_allocation(get_volume_vg(pp, lv_name), pv_name,
@@ -112,9 +113,9 @@ queue_extents_move(struct extents *ext, struct program_params *pp,
             printf("PE %li is free\n", optimal.pe);
             snprintf(cmd, 4096, "pvmove -i1 --alloc anywhere %s:%li %s:%li "
                 "# LE: %li, score: %f\n",
-                ext->extents[i]->dev, ext->extents[i]->pe,
+                e->dev, e->pe,
                 optimal.dev, optimal.pe,
-                ext->extents[i]->le, ext->extents[i]->score);
+                e->le, e->score);
             printf(cmd);
         } else {
             if (optimal.dev == NULL)
@@ -124,9 +125,9 @@ queue_extents_move(struct extents *ext, struct program_params *pp,
                 printf("PE %li is allocated by LV %s LE %li, using default allocation\n",
                     optimal_pe, optimal.lv_name, optimal.le);
 retry_pvmove:
-            snprintf(cmd, 4096, "pvmove -i1 --alloc anywhere %s:%li %s # LE: %li, score: %f\n", ext->extents[i]->dev,
-                ext->extents[i]->pe, get_tier_device(pp, lv_name, dst_tier),
-                ext->extents[i]->le, ext->extents[i]->score);
+            snprintf(cmd, 4096, "pvmove -i1 --alloc anywhere %s:%li %s # LE: %li, score: %f\n", e->dev,
+                e->pe, get_tier_device(pp, lv_name, dst_tier),
+                e->le, e->score);
             printf(cmd);
         }
 
@@ -146,7 +147,7 @@ retry_pvmove:
             }
         }
         error = 0;
-        printf("LE %li moved\n", ext->extents[i]->le);
+        printf("LE %li moved\n", e->le);
     }
     return 0;
 }
@@ -159,23 +160,34 @@ static int
 add_pinning_scores(struct extent_stats *es, struct program_params *pp,
     const char *lv_name)
 {
+    // members of a group may reside on different tiers, they all get the
+    // highest pinning score among them, so that their scores stay equal
+    // and they remain next to each other in candidate indexes
+    float *group_pin = calloc(sizeof(float), es->length ? es->length : 1);
+    if (!group_pin)
+        return -1;
+
     for(size_t i=0; i < es->length; i++) {
-        int tier = get_extent_tier(pp, lv_name, &es->extents[i]);
-        es->extents[i].score += get_tier_pinning_score(pp, lv_name, tier);
+        off_t group = es->extents[i].group;
+        float pin = get_pv_pinning_score(pp, es->extents[i].pv_id);
+        if (group >= 0 && group < es->length && pin > group_pin[group])
+            group_pin[group] = pin;
     }
-    return 0;
-}
 
-static int
-get_pvwait(struct program_params *pp, const char *lv_name)
-{
-    return cfg_getint(cfg_gettsec(pp->cfg, "volume", lv_name), "pvmoveWait");
-}
+    for(size_t i=0; i < es->length; i++) {
+        off_t group = es->extents[i].group;
+        if (group >= 0 && group < es->length)
+            es->extents[i].score += group_pin[group];
+        else
+            es->extents[i].score +=
+                get_pv_pinning_score(pp, es->extents[i].pv_id);
+    }
 
-static int
-get_check_wait(struct program_params *pp, const char *lv_name)
-{
-    return cfg_getint(cfg_gettsec(pp->cfg, "volume", lv_name), "checkWait");
+    free(group_pin);
+
+    extent_scores_changed(es);
+
+    return 0;
 }
 
 /** controlling daemon main loop */
@@ -235,7 +247,7 @@ main_loop(struct program_params *pp)
             if (available_extents < 0)
               available_extents = 0;
 
-            struct extents *ext = NULL;
+            struct extents ext;
 
             // get next hottest min(100, free_space) extents
             size_t max_extents = 100;
@@ -248,23 +260,19 @@ main_loop(struct program_params *pp)
                 goto no_cleanup;
             }
 
-            if (!ext->length) {
-                free_extents(ext);
+            if (!ext.length)
                 continue;
-            }
 
             printf("Moving extents to higher tier\n");
 
             // move them from slow storage,
             // until no space left
-            ret = queue_extents_move(ext, pp, lv_name, tier);
+            ret = queue_extents_move(&ext, pp, lv_name, tier);
             if (ret) {
                 fprintf(stderr, "Can't queue extents move\n");
                 goto no_cleanup;
             }
 
-            free_extents(ext);
-
             if (!stop)
                 sleep(get_pvwait(pp, lv_name));
 
@@ -285,7 +293,7 @@ main_loop(struct program_params *pp)
         // If there are blocks in slow storage with higher
         // score than ones in fast storage, move 10 worst extents from fast to slow
         // if move queued, continue
-        struct extents *prev_tier_max = NULL;
+        struct extents prev_tier_max;
         int prev_tier = -1;
         for (int tier = TIER_MAX; tier >= 0; tier--) {
             off_t free_space = get_avaiable_space(pp, lv_name, tier);
@@ -301,11 +309,11 @@ main_loop(struct program_params *pp)
                     break;
             }
 
-            struct extents *curr_tier_min = NULL;
+            struct extents curr_tier_min;
 
             printf("trying to move cold extents from tier %i\n", tier);
 
-            if (!prev_tier_max) { // get base line extents
+            if (prev_tier < 0) { // get base line extents
                 ret = extents_selector(es, &prev_tier_max, pp, lv_name, tier-1,
                     5, ES_HOT);
                 if (ret) {
@@ -322,32 +330,34 @@ main_loop(struct program_params *pp)
                 goto no_cleanup;
             }
 
-            printf("low tier best: %f\n", prev_tier_max->extents[0]->score);
-            printf("high tier worst: %f\n", curr_tier_min->extents[0]->score);
-
             // check if extents in lower tier are hotter
-            if (compare_extents(prev_tier_max, curr_tier_min) > 0) {
-                float prev_score = get_extent_score(get_extent(prev_tier_max, 0));
-                float curr_score = get_extent_score(get_extent(curr_tier_min, 0));
+            if (prev_tier_max.length && curr_tier_min.length
+                && compare_extents(&prev_tier_max, &curr_tier_min) > 0) {
+                float prev_score = get_extent_score(get_extent(&prev_tier_max, 0));
+                float curr_score = get_extent_score(get_extent(&curr_tier_min, 0));
+
+                printf("low tier best: %f\n", prev_score);
+                printf("high tier worst: %f\n", curr_score);
+
                 // don't move more extents that would push very hot extents
                 // to low tier or cold extents to higher tier when there is
                 // more cold extents to swap than hotter and vice-versa
-                int prev_count = count_extents(prev_tier_max, curr_score, ES_COLD);
-                int curr_count = count_extents(curr_tier_min, prev_score, ES_HOT);
+                int prev_count = count_extents(&prev_tier_max, curr_score, ES_COLD);
+                int curr_count = count_extents(&curr_tier_min, prev_score, ES_HOT);
 
                 int move_extents =
                   (prev_count > curr_count)?curr_count:prev_count;
 
-                truncate_extents(prev_tier_max, move_extents);
-                truncate_extents(curr_tier_min, move_extents);
+                truncate_extents(&prev_tier_max, move_extents);
+                truncate_extents(&curr_tier_min, move_extents);
 
                 // queue move of extents that remain
-                ret = queue_extents_move(prev_tier_max, pp, lv_name, tier);
+                ret = queue_extents_move(&prev_tier_max, pp, lv_name, tier);
                 if (ret) {
                     fprintf(stderr, "%s:%i: queue extents failed\n", __FILE__, __LINE__);
                     goto no_cleanup;
                 }
-                ret = queue_extents_move(curr_tier_min, pp, lv_name, prev_tier);
+                ret = queue_extents_move(&curr_tier_min, pp, lv_name, prev_tier);
                 if (ret) {
                     fprintf(stderr, "%s:%i: queue extents failed\n", __FILE__, __LINE__);
                     goto no_cleanup;
@@ -356,10 +366,6 @@ main_loop(struct program_params *pp)
                 printf("Nothing to do\n");
             }
 
-            free_extents(curr_tier_min);
-            free_extents(prev_tier_max);
-            prev_tier_max = NULL;
-
             // remember previous tier extents
             ret = extents_selector(es, &prev_tier_max, pp, lv_name, tier, 5, ES_HOT);
             if (ret) {
@@ -0,0 +1,174 @@
+/*
+ * Copyright (C) 2012 Hubert Kario <kario@wsisiz.edu.pl>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include "activity_stats.h"
+
+char *out_file = NULL;
+char **in_files = NULL;
+int in_count = 0;
+double mean_lifetime = 3 * 24 * 60 * 60;
+int threads = 0;
+int compress = 0;
+
+void
+usage(void)
+{
+  printf("Usage: lvmtsmerge [options] -o OutputStatsFile InputStatsFile...\n");
+  printf("\n");
+  printf("Merge statistics of the same volume collected by several lvmtscd\n");
+  printf("(e.g. on different hosts of a cluster)\n");
+  printf("\n");
+  printf(" -o,--output           Name of merged statistics file\n");
+  printf(" -l,--mean-lifetime    Mean lifetime of scores used by lvmtscd"
+      " (in seconds)\n");
+  printf(" -j,--threads          Number of threads merging the files\n");
+  printf(" -z,--compress         Write compressed file\n");
+  printf(" -?,--help             This message\n");
+}
+
+int
+parse_arguments(int argc, char **argv)
+{
+  int c;
+  int f_ret = 0;
+
+  struct option long_options[] = {
+              {"output",           required_argument, 0, 'o' }, // 0
+              {"mean-lifetime",    required_argument, 0, 'l' }, // 1
+              {"threads",          required_argument, 0, 'j' }, // 2
+              {"compress",         no_argument,       0, 'z' }, // 3
+              {"help",             no_argument,       0, '?' }, // 4
+              {0, 0, 0, 0}
+  };
+
+  while(1) {
+    int option_index = 0;
+
+    c = getopt_long(argc, argv, "o:l:j:z?", long_options, &option_index);
+
+    if (c == -1)
+      break;
+
+    switch(c) {
+      case 'o':
+        out_file = optarg;
+        break;
+      case 'l':
+        mean_lifetime = atof(optarg);
+        if (mean_lifetime <= 0) {
+          fprintf(stderr, "Mean lifetime must be larger than zero!\n");
+          f_ret = 1;
+        }
+        break;
+      case 'j':
+        threads = atoi(optarg);
+        if (threads <= 0) {
+          fprintf(stderr, "Number of threads must be larger than zero!\n");
+          f_ret = 1;
+        }
+        break;
+      case 'z':
+        compress = 1;
+        break;
+      case '?':
+        usage();
+        f_ret = 1;
+        break;
+      default:
+        fprintf(stderr, "Unknown option: %c\n", c);
+        break;
+    }
+  }
+
+  if (f_ret == 0) {
+    in_files = &argv[optind];
+    in_count = argc - optind;
+  }
+
+  return f_ret;
+}
+
+int
+main(int argc, char **argv)
+{
+    struct activity_stats **stats = NULL;
+    struct activity_stats *merged = NULL;
+    int ret = 1;
+    int n;
+
+    if (parse_arguments(argc, argv))
+        return 1;
+
+    if (out_file == NULL || in_count < 1) {
+        fprintf(stderr, "Output and at least one input file name must be"
+            " provided\n");
+        usage();
+        return 1;
+    }
+
+    if (!threads)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    stats = calloc(sizeof(struct activity_stats *), in_count);
+    if (!stats) {
+        fprintf(stderr, "Out of memory error\n");
+        return 1;
+    }
+
+    for (int i=0; i < in_count; i++) {
+        if (read_activity_stats(&stats[i], in_files[i])) {
+            fprintf(stderr, "Can't read \"%s\"\n", in_files[i]);
+            goto cleanup;
+        }
+    }
+
+    n = merge_activity_stats(&merged, stats, in_count, mean_lifetime,
+        threads);
+    if (n == EINVAL) {
+        fprintf(stderr, "Statistics files describe different volumes\n");
+        goto cleanup;
+    } else if (n) {
+        fprintf(stderr, "Out of memory error\n");
+        goto cleanup;
+    }
+
+    merged->compress = compress;
+
+    if (write_activity_stats(merged, out_file)) {
+        fprintf(stderr, "Can't write \"%s\"\n", out_file);
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    for (int i=0; i < in_count; i++)
+        if (stats[i])
+            destroy_activity_stats(stats[i]);
+    free(stats);
+    if (merged)
+        destroy_activity_stats(merged);
+
+    return ret;
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2012 Hubert Kario <kario@wsisiz.edu.pl>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+/*
+ * Measure how many block scores per second single core calculates with
+ * every score kernel supported by the CPU
+ */
+#include "activity_stats.c"
+#include <sys/time.h>
+
+#define BENCH_BLOCKS (4 * 1024 * 1024)
+#define BENCH_ROUNDS 8
+
+static double
+now_seconds(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+int
+main(int argc, char **argv)
+{
+    struct block_activity *block;
+    struct score_params params = { .read_multiplier = 1,
+        .write_multiplier = 10, .scale = 1.0 / (3 * 24 * 60 * 60) };
+    time_t now = time(NULL);
+    float *out;
+
+    block = malloc(sizeof(struct block_activity) * BENCH_BLOCKS);
+    out = malloc(sizeof(float) * BENCH_BLOCKS);
+    if (!block || !out) {
+        fprintf(stderr, "Out of memory error\n");
+        return 1;
+    }
+
+    srandom(1);
+    for (size_t i=0; i < BENCH_BLOCKS; i++) {
+        block[i].read_score = random() % 100000;
+        block[i].read_time = now - random() % (14 * 24 * 60 * 60);
+        block[i].write_score = random() % 10000;
+        block[i].write_time = now - random() % (14 * 24 * 60 * 60);
+    }
+
+    for (size_t k=0; k < SCORE_KERNELS_NUM; k++) {
+        if (!score_kernels[k].supported()) {
+            printf("%-8s not supported by CPU\n", score_kernels[k].name);
+            continue;
+        }
+
+        // warm up caches
+        score_blocks_with(score_kernels[k].fn, block, BENCH_BLOCKS, now,
+            &params, out);
+
+        double start = now_seconds();
+        for (int r=0; r < BENCH_ROUNDS; r++)
+            score_blocks_with(score_kernels[k].fn, block, BENCH_BLOCKS, now,
+                &params, out);
+        double time = now_seconds() - start;
+
+        printf("%-8s %8.1f M scores/s per core\n", score_kernels[k].name,
+            (double)BENCH_BLOCKS * BENCH_ROUNDS / time / 1e6);
+    }
+
+    free(block);
+    free(out);
+
+    return 0;
+}
@@ -21,11 +21,15 @@
 #include <stdio.h>
 #include <assert.h>
 #include <string.h>
+#include <math.h>
 #include "config.h"
 #include "volumes.h"
 #include "activity_stats.h"
 #include "lvmls.h"
 
+// number of extents put in order at once in candidate indexes
+#define CANDIDATES_BATCH 256
+
 // TODO stub
 off_t
 get_extent_size(struct program_params *pp, const char *lv_name)
@@ -42,58 +46,320 @@ get_first_volume_name(struct program_params *pp)
     return cfg_title(tmp);
 }
 
-// selects best or worst extents in collection not residing on specific devices
-int extents_selector(struct extent_stats *es, struct extents **ret,
+// comparison function for sorting extents according to their score
+static int
+extent_compare(const void *v1, const void *v2)
+{
+    struct extent *e1 = (struct extent *)v1;
+    struct extent *e2 = (struct extent *)v2;
+
+    if (e1->score > e2->score)
+      return -1;
+    if (e1->score < e2->score)
+      return 1;
+
+    // keep extents of a group together
+    if (e1->group != e2->group)
+      return (e1->group < e2->group)?-1:1;
+
+    if (e1->le != e2->le)
+      return (e1->le < e2->le)?-1:1;
+
+    return 0;
+}
+
+// check if extent a should be moved before extent b
+static int
+better_candidate(const struct extent *base, uint32_t a, uint32_t b,
+    int hot_cold)
+{
+    int r = extent_compare(&base[a], &base[b]);
+
+    return (hot_cold == ES_HOT)?r < 0:r > 0;
+}
+
+// partial quicksort: put n best of len extents in order at the start of ext,
+// the rest is left unordered after them
+static void
+partial_sort_candidates(const struct extent *base, uint32_t *ext, size_t len,
+    size_t n, int hot_cold)
+{
+    uint32_t tmp;
+
+#define swap_ext(A, B) { tmp = ext[(A)]; ext[(A)] = ext[(B)]; ext[(B)] = tmp; }
+
+    while (len > 1 && n > 0) {
+        swap_ext(len / 2, len - 1);
+
+        size_t store = 0;
+        for (size_t i=0; i < len - 1; i++)
+            if (better_candidate(base, ext[i], ext[len - 1], hot_cold)) {
+                swap_ext(i, store);
+                store++;
+            }
+        swap_ext(store, len - 1);
+
+        // extents after pivot need ordering only if n reaches past it
+        if (store + 1 < n)
+            partial_sort_candidates(base, ext + store + 1, len - store - 1,
+                n - store - 1, hot_cold);
+
+        len = store;
+        if (n > store)
+            n = store;
+    }
+
+#undef swap_ext
+}
+
+// make sure that at least n first extents of index are in final order
+static void
+sort_candidates(struct extent_stats *es, struct extent_index *ei, size_t n,
+    int hot_cold)
+{
+    if (n <= ei->sorted)
+        return;
+
+    // order more than needed, so that walking the index doesn't partition
+    // the rest of it again for every extent
+    if (n < ei->sorted * 2)
+        n = ei->sorted * 2;
+    if (n < CANDIDATES_BATCH)
+        n = CANDIDATES_BATCH;
+    if (n > ei->length)
+        n = ei->length;
+
+    // leading extents are already the best ones
+    partial_sort_candidates(es->extents, ei->ext + ei->sorted,
+        ei->length - ei->sorted, n - ei->sorted, hot_cold);
+    ei->sorted = n;
+}
+
+// selects best or worst extents in collection not residing on specific
+// devices: for hot extents, ones on tiers lower than max_tier, for cold,
+// ones on max_tier. Returned list references candidate index of es
+int extents_selector(struct extent_stats *es, struct extents *ret,
     struct program_params *pp, const char *lv_name, int max_tier,
     int max_extents, int hot_cold)
 {
     assert(ret);
     assert(hot_cold == ES_HOT || hot_cold == ES_COLD);
 
-    // allocate memory for `max_extent` entires
-    *ret = malloc(sizeof(struct extents));
-    assert(*ret);
-    (*ret)->length = 0;
-    (*ret)->sort = hot_cold;
-    (*ret)->extents = malloc(sizeof(struct extent*) * max_extents);
-    assert((*ret)->extents); // TODO error handling
-
-    // a bit complicated for(;;), basically it searches from 0 when we're
-    // looking for hot extents and searches from last extent in `es` in case
-    // we're looking for cold extents. In both cases it doesn't load more than
-    // max_extents to ret
-    for(ssize_t i=(hot_cold == ES_HOT)?0:es->length-1;
-        (hot_cold == ES_HOT && i < es->length && (*ret)->length < max_extents)
-            || (hot_cold == ES_COLD && i >= 0 && (*ret)->length < max_extents);
-        i = (hot_cold == ES_HOT)?i+1:i-1) {
-
-        int tier = get_extent_tier(pp, lv_name, &es->extents[i]);
-
-        if ((hot_cold == ES_HOT && max_tier < tier) ||
-            (hot_cold == ES_COLD && max_tier == tier)) {
-            (*ret)->extents[(*ret)->length] = &es->extents[i];
-            (*ret)->length++;
+    ret->base = es->extents;
+    ret->index = NULL;
+    ret->length = 0;
+    ret->sort = hot_cold;
+
+    // no extents reside on tiers that don't exist
+    if (max_tier < -1 || max_tier >= es->tiers || max_extents <= 0)
+        return 0;
+
+    struct extent_index *ei = (hot_cold == ES_HOT)?
+        &es->hot[max_tier + 1] : &es->cold[max_tier + 1];
+    size_t len = 0;
+
+    while (len < ei->length && len < max_extents) {
+        sort_candidates(es, ei, len + 1, hot_cold);
+
+        off_t group = es->extents[ei->ext[len]].group;
+        size_t end = len + 1;
+
+        // extents of a group have the same score so they are next to each
+        // other, select all of them or none
+        if (group >= 0) {
+            while (end < ei->length) {
+                sort_candidates(es, ei, end + 1, hot_cold);
+                if (es->extents[ei->ext[end]].group != group)
+                    break;
+                end++;
+            }
+
+            // move group only if it fits, unless it can never fit
+            if (end > max_extents) {
+                if (len)
+                    break;
+                end = max_extents;
+            }
         }
+
+        len = end;
     }
 
+    ret->index = ei->ext;
+    ret->length = len;
+
     return 0;
 }
 
-// comparison function for sorting extents according to their score
+// sort extents into candidate indexes of tiers: extents on lower tiers for
+// hot selection and extents on the tier itself for cold selection, indexes
+// are ordered on first selection
 static int
-extent_compare(const void *v1, const void *v2)
+build_candidate_indexes(struct program_params *pp, struct extent_stats *es)
 {
-    struct extent *e1 = (struct extent *)v1;
-    struct extent *e2 = (struct extent *)v2;
+    assert(es->length <= UINT32_MAX);
 
-    if (e1->score > e2->score)
-      return -1;
-    if (e1->score < e2->score)
-      return 1;
+    es->tiers = 0;
+    for (size_t i=0; i < es->length; i++) {
+        int tier = get_pv_tier(pp, es->extents[i].pv_id);
+        if (tier >= es->tiers)
+            es->tiers = tier + 1;
+    }
+
+    // index of tier t is at t + 1, unconfigured devices are at tier -1
+    es->hot = calloc(sizeof(struct extent_index), es->tiers + 1);
+    es->cold = calloc(sizeof(struct extent_index), es->tiers + 1);
+    if (!es->hot || !es->cold)
+        return -1;
+
+    for (size_t i=0; i < es->length; i++) {
+        int tier = get_pv_tier(pp, es->extents[i].pv_id);
+        es->cold[tier + 1].length++;
+        for (int t=-1; t < tier; t++)
+            es->hot[t + 1].length++;
+    }
+
+    for (int t=0; t <= es->tiers; t++) {
+        es->hot[t].ext = malloc(sizeof(uint32_t) * es->hot[t].length);
+        es->cold[t].ext = malloc(sizeof(uint32_t) * es->cold[t].length);
+        if ((es->hot[t].length && !es->hot[t].ext)
+            || (es->cold[t].length && !es->cold[t].ext))
+            return -1;
+        es->hot[t].length = 0;
+        es->cold[t].length = 0;
+    }
+
+    for (size_t i=0; i < es->length; i++) {
+        int tier = get_pv_tier(pp, es->extents[i].pv_id);
+        struct extent_index *ei = &es->cold[tier + 1];
+        ei->ext[ei->length++] = i;
+        for (int t=-1; t < tier; t++) {
+            ei = &es->hot[t + 1];
+            ei->ext[ei->length++] = i;
+        }
+    }
+
+    return 0;
+}
+
+/** device time cost of IO on single tier */
+struct tier_cost {
+    int tier;
+    double read_latency; // seconds per read operation
+    double write_latency; // seconds per write operation
+    double read_byte_cost; // seconds per byte read
+    double write_byte_cost; // seconds per byte written
+};
+
+// collect cost parameters of all tiers of volume, ordered from the fastest
+// tier to the slowest, sets len to number of tiers. Returns -1 on lack of
+// memory
+static int
+get_tier_costs(struct program_params *pp, const char *lv_name,
+    struct tier_cost **tc, size_t *len)
+{
+    long int throughput;
+
+    *tc = NULL;
+    *len = 0;
+
+    for (int tier=0; ; tier++) {
+        if (get_tier_device(pp, lv_name, tier)) {
+            struct tier_cost *tmp;
+            tmp = realloc(*tc, sizeof(struct tier_cost) * (*len + 1));
+            if (!tmp) {
+                free(*tc);
+                *tc = NULL;
+                *len = 0;
+                return -1;
+            }
+            *tc = tmp;
+
+            tmp[*len].tier = tier;
+            tmp[*len].read_latency = get_tier_read_latency(pp, lv_name, tier);
+            tmp[*len].write_latency = get_tier_write_latency(pp, lv_name, tier);
+
+            throughput = get_tier_read_throughput(pp, lv_name, tier);
+            tmp[*len].read_byte_cost = (throughput > 0)?1.0/throughput:0;
+            throughput = get_tier_write_throughput(pp, lv_name, tier);
+            tmp[*len].write_byte_cost = (throughput > 0)?1.0/throughput:0;
+
+            (*len)++;
+        }
+
+        if (!lower_tiers_exist(pp, lv_name, tier))
+            break;
+    }
 
     return 0;
 }
 
+// estimated time (in seconds) the device needs to serve provided IO
+static double
+tier_io_time(struct tier_cost *tc, double reads, double read_bytes,
+    double writes, double write_bytes)
+{
+    return reads * tc->read_latency + read_bytes * tc->read_byte_cost
+        + writes * tc->write_latency + write_bytes * tc->write_byte_cost;
+}
+
+// device time saved by keeping extent on faster tier instead of slower one.
+// For extents on the fastest tier it's the time that would be lost by
+// moving them down, for others, time saved by moving them up a tier, so
+// that extents on neighbouring tiers are compared using the same measure
+static float
+calculate_cost_score(struct tier_cost *tc, size_t tc_len, int tier,
+    struct extent *e, time_t now, float scale, float hit_score)
+{
+    size_t i;
+
+    if (tc_len < 2)
+        return 0;
+
+    // extents on unknown PVs are treated as residing on slowest tier
+    for (i=0; i < tc_len - 1; i++)
+        if (tc[i].tier == tier)
+            break;
+
+    size_t upper = (i > 0)?i-1:0;
+    size_t lower = upper + 1;
+
+    // IO weights scale both scores and bytes (see add_block_weighted_io()),
+    // so a weighted IO costs as much as that many IOs
+    double read_decay = exp(-1.0 * scale * (now - e->last_read_access));
+    double write_decay = exp(-1.0 * scale * (now - e->last_write_access));
+
+    double reads = e->read_score * read_decay / hit_score;
+    double read_bytes = e->read_bytes * read_decay;
+    double writes = e->write_score * write_decay / hit_score;
+    double write_bytes = e->write_bytes * write_decay;
+
+    return tier_io_time(&tc[lower], reads, read_bytes, writes, write_bytes)
+        - tier_io_time(&tc[upper], reads, read_bytes, writes, write_bytes);
+}
+
+// return index of device name in table of devices used by extents, adding
+// it if necessary, -1 on lack of memory
+static int
+intern_device(struct extent_stats *es, const char *dev)
+{
+    // volumes span at most a handful of PVs
+    for (size_t i=0; i < es->devs_len; i++)
+        if (!strcmp(es->devs[i], dev))
+            return i;
+
+    char **devs = realloc(es->devs, sizeof(char *) * (es->devs_len + 1));
+    if (!devs)
+        return -1;
+    es->devs = devs;
+
+    es->devs[es->devs_len] = strdup(dev);
+    if (!es->devs[es->devs_len])
+        return -1;
+
+    return es->devs_len++;
+}
+
 int
 get_volume_stats(struct program_params *pp, const char *lv_name, struct extent_stats **es)
 {
@@ -119,68 +385,202 @@ get_volume_stats(struct program_params *pp, const char *lv_name, struct extent_s
     ret = read_activity_stats(&as, file);
     assert(!ret);
 
+    // version 2 files record which volume they were collected for
+    if (as->lv_name[0] && (strcmp(as->vg_name, get_volume_vg(pp, lv_name))
+            || strcmp(as->lv_name, get_volume_lv(pp, lv_name))))
+        fprintf(stderr, "Warning: file %s holds statistics of volume %s/%s\n",
+            file, as->vg_name, as->lv_name);
+
     (*es)->extents = malloc(sizeof(struct extent) * as->len);
     assert((*es)->extents); // XXX better error checking
     (*es)->length = as->len;
+    (*es)->devs = NULL;
+    (*es)->devs_len = 0;
+    (*es)->tiers = 0;
+    (*es)->hot = NULL;
+    (*es)->cold = NULL;
 
     // load LE to PE translation tables
     init_le_to_pe(pp);
 
+    // segments of volume are sorted by LE, so extents are mapped to them
+    // in single pass
+    size_t seg_num;
+    struct pv_allocations *seg = get_LV_segments(get_volume_vg(pp, lv_name),
+        get_volume_lv(pp, lv_name), &seg_num);
+    struct pv_allocations *seg_end = seg ? seg + seg_num : NULL;
+    int dev_id = -1;
+    int pv_id = -1;
+
     // collect general volume parameters
     float read_mult = get_read_multiplier(pp, lv_name);
     float write_mult = get_write_multiplier(pp, lv_name);
     float hit_score = get_hit_score(pp, lv_name);
     float scale = get_score_scaling_factor(pp, lv_name);
 
+    // device time cost model
+    struct tier_cost *tc = NULL;
+    size_t tc_len = 0;
+    // scores of all extents, adjusted as a whole before being set in extents
+    float *scores = NULL;
+
+    int cost_model = get_cost_model(pp, lv_name);
+    if (cost_model && get_tier_costs(pp, lv_name, &tc, &tc_len)) {
+        fprintf(stderr, "Out of memory\n");
+        f_ret = -1;
+        goto cleanup;
+    }
+
+    // extents never accessed have zero score
+    scores = calloc(sizeof(float), as->len ? as->len : 1);
+    if (!scores) {
+        fprintf(stderr, "Out of memory\n");
+        f_ret = -1;
+        goto cleanup;
+    }
+
+    // score all extents in batches
+    if (!cost_model) {
+        struct score_params sp = { .read_multiplier = read_mult,
+            .write_multiplier = write_mult, .scale = scale };
+        int64_t end;
+        for (int64_t off=next_touched_blocks(as, 0, &end); off < as->len;
+                off=next_touched_blocks(as, end, &end))
+            score_range(as, off, end - off, now, &sp, &scores[off]);
+    }
+
+    // planner moves extents ahead of their daily busy period, using
+    // activity profile collected by lvmtscd, it's never enabled together
+    // with cost model (see read_config())
+    long int planner_lead = get_planner_lead(pp, lv_name);
+    float planner_weight = get_planner_weight(pp, lv_name);
+    struct profile_time pt_now, pt_ahead;
+    get_profile_time(now, &pt_now);
+    get_profile_time(now + planner_lead, &pt_ahead);
+
+    // rank by activity predicted over the next check interval
+    int trend_forecast = get_trend_forecast(pp, lv_name)
+        && get_trend_interval(pp, lv_name) > 0 && as->trend;
+    double horizon = 0;
+    if (trend_forecast) {
+        enable_activity_trend(as, get_trend_interval(pp, lv_name),
+            get_trend_alpha(pp, lv_name), get_trend_beta(pp, lv_name));
+        horizon = (double)get_check_wait(pp, lv_name)
+            / get_trend_interval(pp, lv_name);
+    }
+
     for(size_t i=0; i < as->len; i++) {
         // just a shorthand, so that we wouldn't have to write full (*es)->...
         struct extent *e = &((*es)->extents[i]);
 
         // get logical extent to physical extent mapping for extent
-        struct pv_info *pv_i;
-        pv_i = LE_to_PE(get_volume_vg(pp, lv_name),
-                        get_volume_lv(pp, lv_name),
-                        i);
-        if (!pv_i) {
+        while (seg < seg_end && i >= seg->lv_start + seg->pv_length) {
+            seg++;
+            dev_id = -1;
+        }
+        if (seg == seg_end || i < seg->lv_start) {
             fprintf(stderr, "error when translating extent %li\n", i);
             fprintf(stderr, "Do you have permission to access lvm device?\n");
             abort();
         }
+        if (dev_id < 0) {
+            dev_id = intern_device(*es, seg->pv_name);
+            if (dev_id < 0) {
+                fprintf(stderr, "Out of memory\n");
+                f_ret = -1;
+                goto cleanup;
+            }
+            pv_id = get_pv_id(pp, lv_name, seg->pv_name);
+        }
 
         // get activity stats for block
         struct block_activity *ba = get_block_activity(as, i);
 
-        // save collected data
-        e->dev = strdup(pv_i->pv_name);
-        assert(e->dev); // TODO better error handling
+        // save collected data, device names are shared by extents
+        e->dev_id = dev_id;
+        e->dev = (*es)->devs[dev_id];
+        e->pv_id = pv_id;
 
         e->le = i;
-        e->pe = pv_i->start_seg;
+        e->pe = seg->pv_start + (i - seg->lv_start);
         e->read_score =
             get_block_activity_raw_score(ba, T_READ);
         e->last_read_access = get_last_read_time(ba);
         e->write_score =
             get_block_activity_raw_score(ba, T_WRITE);
         e->last_write_access = get_last_write_time(ba);
+        e->read_bytes = get_block_read_bytes(as, i);
+        e->write_bytes = get_block_write_bytes(as, i);
+        e->group = get_block_group(as, i);
 
-        e->score = calculate_score( e->read_score,
-                                    e->last_read_access,
-                                    read_mult,
-                                    e->write_score,
-                                    e->last_write_access,
-                                    write_mult,
+        if (cost_model)
+            scores[i] = calculate_cost_score(tc, tc_len,
+                                    get_pv_tier(pp, pv_id),
+                                    e,
                                     now,
-                                    scale);
+                                    scale,
+                                    hit_score);
+
+        // scale score by predicted change in activity, smoothed by a single
+        // hit so that barely active extents don't get extreme ratios
+        if (trend_forecast) {
+            float level, trend;
+            get_block_trend(as, i, now, &level, &trend);
+            double forecast = level + trend * horizon;
+            if (forecast < 0)
+                forecast = 0;
+            scores[i] *= (forecast + hit_score) / (level + hit_score);
+        }
+
+        // add predicted change in activity, so that extents get promoted
+        // before their busy period and demoted after it
+        if (planner_lead > 0 && as->profile) {
+            scores[i] += planner_weight
+                * (get_block_profile_score(as, i, &pt_ahead)
+                   - get_block_profile_score(as, i, &pt_now));
+            if (scores[i] < 0)
+                scores[i] = 0;
+        }
+    }
+
+    // spread heat to neighbouring extents, radius is validated to be
+    // non negative when reading configuration
+    float spatial_share = get_spatial_share(pp, lv_name);
+    if (spatial_share > 0
+        && smooth_block_scores(scores, as->len, spatial_share,
+            (size_t)get_spatial_radius(pp, lv_name))) {
+        fprintf(stderr, "Out of memory\n");
+        f_ret = -1;
+        goto cleanup;
+    }
+
+    // extents in groups are moved together, so rank them together
+    if (set_group_block_scores(as, scores, as->len)) {
+        fprintf(stderr, "Out of memory\n");
+        f_ret = -1;
+        goto cleanup;
+    }
+
+    for (size_t i=0; i < as->len; i++)
+        (*es)->extents[i].score = scores[i];
 
-        pv_info_free(pv_i);
+    // index extents by tier instead of sorting all of them, only hottest
+    // and coldest candidates are ever put in order
+    if (build_candidate_indexes(pp, *es)) {
+        fprintf(stderr, "Out of memory\n");
+        f_ret = -1;
+        goto cleanup;
     }
 
-    // clean up
+cleanup:
     destroy_activity_stats(as);
+    free(tc);
+    free(scores);
 
-    // sort according to score
-    qsort((*es)->extents, (*es)->length, sizeof(struct extent),
-        extent_compare);
+    if (f_ret) {
+        free_extent_stats(*es);
+        *es = NULL;
+    }
 
     return f_ret;
 }
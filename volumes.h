@@ -29,7 +29,7 @@ const char *get_first_volume_name(struct program_params *pp);
  * @var hot_cold return hottest (ES_HOT) or coldest extents (ES_COLD)
  */
 int extents_selector(   struct extent_stats *es,
-                        struct extents **ret,
+                        struct extents *ret,
                         struct program_params *pp,
                         const char *lv_name,
                         int max_tier,